@@ -0,0 +1,186 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "parallelizer-private.h"
+
+/* How often to sample.  PSI's shortest average is over 10 seconds,
+   so after changing the limit we wait for it to catch up. */
+#define SAMPLE_INTERVAL_MS      2000
+#define SAMPLES_AFTER_CHANGE    3
+
+/* hysteresis:  lower the limit above target*HIGH,
+   raise it below target*LOW, and otherwise leave it alone */
+#define HIGH_FACTOR             1.25
+#define LOW_FACTOR              0.5
+
+typedef struct _Adaptive Adaptive;
+struct _Adaptive
+{
+  System *system;
+  double target;                /* percent of time stalled */
+  unsigned max_limit;
+  guint timeout_id;
+  unsigned n_samples_to_skip;
+  gboolean has_psi;
+  long n_cpus;
+};
+
+/* "some avg10" from a /proc/pressure file:  the percentage of the
+   last 10 seconds in which some task waited for the resource. */
+static gboolean
+read_psi_some_avg10 (const char *filename,
+                     double     *avg10_out)
+{
+  FILE *fp = fopen (filename, "re");
+  gboolean rv;
+  if (fp == NULL)
+    return FALSE;
+  rv = fscanf (fp, "some avg10=%lf", avg10_out) == 1;
+  fclose (fp);
+  return rv;
+}
+
+/* Without PSI (before linux 4.20, or disabled), estimate
+   the same from the load:  the fraction of runnable
+   tasks that are waiting for a cpu. */
+static gboolean
+read_loadavg_pressure (long    n_cpus,
+                       double *pressure_out)
+{
+  FILE *fp = fopen ("/proc/loadavg", "re");
+  double load1;
+  gboolean rv;
+  if (fp == NULL)
+    return FALSE;
+  rv = fscanf (fp, "%lf", &load1) == 1;
+  fclose (fp);
+  if (!rv)
+    return FALSE;
+  *pressure_out = load1 > n_cpus ? (load1 - n_cpus) * 100.0 / load1 : 0.0;
+  return TRUE;
+}
+
+/* The worst of the cpu, io and memory pressures. */
+static gboolean
+read_pressure (Adaptive   *adaptive,
+               double     *pressure_out,
+               const char **which_out)
+{
+  static const char *resources[] = { "cpu", "io", "memory" };
+  unsigned i;
+  if (adaptive->has_psi)
+    {
+      *pressure_out = 0;
+      *which_out = resources[0];
+      for (i = 0; i < G_N_ELEMENTS (resources); i++)
+        {
+          char filename[64];
+          double avg10;
+          g_snprintf (filename, sizeof (filename),
+                      "/proc/pressure/%s", resources[i]);
+          if (!read_psi_some_avg10 (filename, &avg10))
+            continue;
+          if (avg10 > *pressure_out)
+            {
+              *pressure_out = avg10;
+              *which_out = resources[i];
+            }
+        }
+      return TRUE;
+    }
+  *which_out = "loadavg";
+  return read_loadavg_pressure (adaptive->n_cpus, pressure_out);
+}
+
+static gboolean
+handle_adaptive_timeout (gpointer data)
+{
+  Adaptive *adaptive = data;
+  System *system = adaptive->system;
+  unsigned old_max = system->max_running_tasks;
+  unsigned new_max = old_max;
+  const char *which;
+  double pressure;
+
+  if (adaptive->n_samples_to_skip > 0)
+    {
+      adaptive->n_samples_to_skip--;
+      return TRUE;
+    }
+  if (!read_pressure (adaptive, &pressure, &which))
+    return TRUE;
+
+  if (pressure > adaptive->target * HIGH_FACTOR)
+    {
+      /* back off quickly */
+      unsigned step = MAX (old_max / 8, 1);
+      new_max = old_max > step ? old_max - step : 1;
+    }
+  else if (pressure < adaptive->target * LOW_FACTOR
+        && system->n_running_tasks >= old_max
+        && system->n_unstarted_tasks + system->batch_items->len > 0
+        && old_max < adaptive->max_limit)
+    {
+      /* probe upwards slowly, and only if it would start something */
+      new_max = old_max + 1;
+    }
+  if (new_max == old_max)
+    return TRUE;
+
+  g_message ("adaptive: %s pressure %.1f%% (target %.1f%%): "
+             "max running tasks %u -> %u",
+             which, pressure, adaptive->target, old_max, new_max);
+  system->stats.n_adaptive_changes++;
+  adaptive->n_samples_to_skip = SAMPLES_AFTER_CHANGE;
+  system_set_max_running_tasks (system, new_max);
+  return TRUE;
+}
+
+static void
+adaptive__all_done (System         *system,
+                    const GTimeVal *current_time,
+                    gpointer        handler_data)
+{
+  Adaptive *adaptive = handler_data;
+  if (adaptive->timeout_id != 0)
+    {
+      g_source_remove (adaptive->timeout_id);
+      adaptive->timeout_id = 0;
+    }
+}
+
+static SystemTrapFuncs adaptive_funcs =
+{
+  NULL,
+  NULL,
+  NULL,
+  NULL,
+  adaptive__all_done
+};
+
+void
+system_set_adaptive (System  *system,
+                     double   target,
+                     unsigned max_limit)
+{
+  Adaptive *adaptive = g_slice_new (Adaptive);
+  double unused;
+  adaptive->system = system;
+  adaptive->target = target;
+  adaptive->n_cpus = sysconf (_SC_NPROCESSORS_ONLN);
+  if (adaptive->n_cpus < 1)
+    adaptive->n_cpus = 1;
+  adaptive->max_limit = MAX (max_limit, 1);
+  adaptive->n_samples_to_skip = 0;
+  adaptive->has_psi = read_psi_some_avg10 ("/proc/pressure/cpu", &unused);
+  if (!adaptive->has_psi)
+    g_message ("adaptive: no /proc/pressure, using the load average");
+
+  /* start at one task per cpu, and let the controller find the rest */
+  system_set_max_running_tasks (system,
+                                MIN ((unsigned) adaptive->n_cpus,
+                                     adaptive->max_limit));
+  adaptive->timeout_id = g_timeout_add (SAMPLE_INTERVAL_MS,
+                                        handle_adaptive_timeout, adaptive);
+  system_trap (system, &adaptive_funcs, adaptive);
+}
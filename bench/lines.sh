@@ -0,0 +1,42 @@
+#!/bin/sh
+# How many lines/s pline splits out of task output, by line length.
+#
+# For each LENGTH, one task cats MB megabytes of LENGTH-byte lines
+# (with the newline), and pline prints them to /dev/null.  That is
+# with --mode=chunked, which still splits the lines but doesn't
+# format each one, so the splitting isn't hidden;  MODE=default
+# measures that as well.  Prints the lines, the seconds pline took,
+# and lines/s and MB/s.
+#
+# usage: bench/lines.sh [PLINE...]
+#        (MB=64, LENGTHS="8 32 128 1024 8192" and MODE=chunked by
+#        default;  with more than one PLINE, they take turns at each
+#        length)
+
+MB=${MB:-64}
+LENGTHS=${LENGTHS:-8 32 128 1024 8192}
+MODE=${MODE:-chunked}
+[ $# -gt 0 ] || set -- ./pline
+
+tmp=$(mktemp -d) || exit 1
+trap 'rm -rf "$tmp"' EXIT
+
+printf "%-24s %7s %10s %8s %12s %8s\n" \
+       "pline" "length" "lines" "secs" "lines/s" "MB/s"
+for len in $LENGTHS
+do
+  yes "$(printf "%0$((len - 1))d" 0)" | head -c $((MB * 1000000)) > "$tmp/data"
+  n_lines=$((MB * 1000000 / len))
+  echo "cat $tmp/data" > "$tmp/input"
+  for pline in "$@"
+  do
+    start=$(date +%s%N)
+    "$pline" --mode=$MODE -i "$tmp/input" > /dev/null 2>&1
+    end=$(date +%s%N)
+    awk -v p="$pline" -v len="$len" -v n="$n_lines" -v mb="$MB" \
+        -v ns=$((end - start)) 'BEGIN {
+          secs = ns / 1e9
+          printf "%-24s %7d %10d %8.3f %12.0f %8.1f\n",
+                 p, len, n, secs, n / secs, mb / secs }'
+  done
+done
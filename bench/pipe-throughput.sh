@@ -0,0 +1,38 @@
+#!/bin/sh
+# How fast pline drains its tasks' pipes:  TASKS tasks at once cat
+# MB megabytes between them, of 1000-byte lines, as fast as they can,
+# and pline takes them with --mode=chunked (so that the reads, rather
+# than the formatting, take the time) to /dev/null.  Prints MB/s over
+# the run.
+#
+# usage: bench/pipe-throughput.sh [PLINE...]
+#        (MB=1024 and TASKS="1 8" by default;  ARGS are passed to
+#        each pline as well, eg ARGS=--grow-pipes)
+
+MB=${MB:-1024}
+TASKS=${TASKS:-1 8}
+[ $# -gt 0 ] || set -- ./pline
+
+tmp=$(mktemp -d) || exit 1
+trap 'rm -rf "$tmp"' EXIT
+
+printf "%-24s %6s %8s %8s\n" "pline" "tasks" "secs" "MB/s"
+for n in $TASKS
+do
+  yes "$(printf "%0999d" 0)" | head -c $((MB * 1000000 / n)) > "$tmp/data"
+  i=0
+  while [ $i -lt "$n" ]
+  do
+    echo "cat $tmp/data"
+    i=$((i + 1))
+  done > "$tmp/input"
+  for pline in "$@"
+  do
+    start=$(date +%s%N)
+    "$pline" --mode=chunked -n "$n" $ARGS -i "$tmp/input" > /dev/null 2>&1
+    end=$(date +%s%N)
+    awk -v p="$pline" -v n="$n" -v mb="$MB" -v ns=$((end - start)) 'BEGIN {
+          secs = ns / 1e9
+          printf "%-24s %6d %8.3f %8.1f\n", p, n, secs, mb / secs }'
+  done
+done
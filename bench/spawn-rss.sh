@@ -0,0 +1,49 @@
+#!/bin/sh
+# How fast pline starts tasks as it grows, for each --spawn method:
+# fork() copies the parent's page tables, so it slows down as the
+# parent gets bigger;  vfork() and posix_spawn() shouldn't.
+#
+# The parent is grown with --mode=chunked:  the first task holds up
+# the output, so the next one's (MB megabytes of zeros) is kept in
+# pline while N_TASKS "true"s run;  the last task lets the first end.
+# Prints, from --stats:  the parent's max-rss, the average time
+# spent spawning a task, and tasks/s over the whole run.
+#
+# usage: bench/spawn-rss.sh [PLINE]
+#        (N_TASKS=2000 and SIZES="0 250 500 1000", in MB, by default)
+
+PLINE=${1:-./pline}
+N_TASKS=${N_TASKS:-2000}
+SIZES=${SIZES:-0 250 500 1000}
+METHODS="fork vfork posix_spawn"
+
+tmp=$(mktemp -d) || exit 1
+trap 'rm -rf "$tmp"' EXIT
+
+printf "%8s %-12s %14s %12s %10s\n" \
+       "size" "spawn" "parent-rss" "spawn-time" "tasks/s"
+for mb in $SIZES
+do
+  {
+    echo "while [ ! -e $tmp/done ]; do sleep 0.01; done"
+    [ "$mb" -gt 0 ] && echo "head -c ${mb}000000 /dev/zero"
+    i=0
+    while [ $i -lt "$N_TASKS" ]
+    do
+      echo true
+      i=$((i + 1))
+    done
+    echo "touch $tmp/done"
+  } > "$tmp/input"
+  for method in $METHODS
+  do
+    rm -f "$tmp/done"
+    "$PLINE" --mode=chunked --spawn=$method --stats -i "$tmp/input" \
+      2>&1 >/dev/null \
+    | awk -v mb="$mb" -v method="$method" '
+        / tasks in / { rate = $6; sub (/^\(/, "", rate) }
+        /average spawn time/ { spawn = $(NF - 3) }
+        /parent max-rss/ { rss = $4 }
+        END { printf "%6sMB %-12s %14s %12s %10s\n", mb, method, rss, spawn, rate }'
+  done
+done
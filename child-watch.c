@@ -0,0 +1,138 @@
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "child-watch.h"
+#include "g-source-fd.h"
+
+#if 1
+# define DEBUG_ONLY(x)
+#else
+# define DEBUG_ONLY(x) x
+#endif
+
+/* not in older headers */
+#ifndef P_PIDFD
+# define P_PIDFD                3
+#endif
+
+typedef struct _ChildWatch ChildWatch;
+struct _ChildWatch
+{
+  GPid pid;
+  int pidfd;                    /* -1 if using g_child_watch_add() */
+  GSourceFD *source;
+  ChildWatchFunc func;
+  gpointer data;
+};
+
+static gboolean has_pidfd = TRUE;
+
+static int
+do_pidfd_open (GPid pid)
+{
+#ifdef SYS_pidfd_open
+  return syscall (SYS_pidfd_open, pid, 0);
+#else
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+/* glibc's waitid() has no rusage argument, but the syscall does */
+static int
+do_waitid (int pidfd, siginfo_t *info, struct rusage *usage)
+{
+  return syscall (SYS_waitid, P_PIDFD, pidfd, info, WEXITED, usage);
+}
+
+/* convert to waitpid()'s encoding */
+static gint
+siginfo_to_wait_status (const siginfo_t *info)
+{
+  switch (info->si_code)
+    {
+    case CLD_EXITED:
+      return (info->si_status & 0xff) << 8;
+    case CLD_DUMPED:
+      return info->si_status | 0x80;
+    default:
+      return info->si_status;
+    }
+}
+
+static gboolean
+handle_pidfd_readable (void *data)
+{
+  ChildWatch *watch = data;
+  siginfo_t info;
+  struct rusage usage;
+  gint status;
+  memset (&info, 0, sizeof (info));
+  if (do_waitid (watch->pidfd, &info, &usage) == 0)
+    status = siginfo_to_wait_status (&info);
+  else if (errno == EINTR)
+    return TRUE;
+  else if (errno == EINVAL)
+    {
+      /* linux 5.3 has pidfd_open() but not P_PIDFD;
+         the child has exited, so this won't block */
+      if (wait4 (watch->pid, &status, 0, &usage) < 0)
+        g_error ("error waiting for process %d: %s",
+                 (int) watch->pid, g_strerror (errno));
+    }
+  else
+    g_error ("error waiting for process %d: %s",
+             (int) watch->pid, g_strerror (errno));
+  DEBUG_ONLY (g_message ("reaped %d: status=%d", (int) watch->pid, status));
+
+  g_source_fd_destroy (watch->source);
+  close (watch->pidfd);
+  watch->func (watch->pid, status, &usage, watch->data);
+  g_slice_free (ChildWatch, watch);
+  return FALSE;
+}
+
+static void
+handle_child_watch (GPid     pid,
+                    gint     status,
+                    gpointer data)
+{
+  ChildWatch *watch = data;
+  watch->func (pid, status, NULL, watch->data);
+  g_slice_free (ChildWatch, watch);
+}
+
+void
+child_watch_add (GPid           pid,
+                 ChildWatchFunc func,
+                 gpointer       data)
+{
+  ChildWatch *watch = g_slice_new (ChildWatch);
+  watch->pid = pid;
+  watch->func = func;
+  watch->data = data;
+  watch->pidfd = -1;
+  watch->source = NULL;
+  if (has_pidfd)
+    {
+      watch->pidfd = do_pidfd_open (pid);
+      if (watch->pidfd < 0)
+        {
+          if (errno != ENOSYS)
+            g_error ("error calling pidfd_open on process %d: %s",
+                     (int) pid, g_strerror (errno));
+          has_pidfd = FALSE;
+        }
+      else
+        {
+          /* pidfds are always close-on-exec */
+          watch->source = g_source_fd_new (watch->pidfd, G_IO_IN,
+                                           handle_pidfd_readable, watch);
+          return;
+        }
+    }
+  g_child_watch_add (pid, handle_child_watch, watch);
+}
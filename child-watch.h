@@ -0,0 +1,20 @@
+#include <glib.h>
+#include <sys/resource.h>
+
+/* Wait for a child process to terminate.
+
+   Where the kernel has pidfd_open() (linux 5.3), the child is
+   watched through a pidfd in the same epoll set as the pipes,
+   and reaped with waitid(P_PIDFD), which also gives us its rusage.
+   Otherwise we fall back to g_child_watch_add(), and 'usage' is NULL.
+
+   'status' is encoded like waitpid()'s.  The watch is freed after
+   func returns;  there is no way to cancel it. */
+typedef void (*ChildWatchFunc) (GPid                 pid,
+                                gint                 status,
+                                const struct rusage *usage,
+                                gpointer             data);
+
+void child_watch_add (GPid           pid,
+                      ChildWatchFunc func,
+                      gpointer       data);
@@ -0,0 +1,417 @@
+#include <string.h>
+#include "cmd-template.h"
+
+typedef enum
+{
+  PIECE_LITERAL,
+  PIECE_ARG,                    /* {} */
+  PIECE_NO_EXT,                 /* {.} */
+  PIECE_BASENAME,               /* {/} */
+  PIECE_DIRNAME,                /* {//} */
+  PIECE_BASENAME_NO_EXT,        /* {/.} */
+  PIECE_SEQNO,                  /* {#} */
+  PIECE_VAR                     /* {NAME} */
+} PieceType;
+
+typedef struct _Piece Piece;
+struct _Piece
+{
+  PieceType type;
+  unsigned offset, len;         /* of a literal, in 'text' */
+  unsigned var;                 /* of a PIECE_VAR */
+
+  /* which word of the template the piece is in (-1 for the spaces
+     between words), and whether that word has an argument in it */
+  int word;
+  gboolean in_arg_word;
+};
+
+struct _CmdTemplate
+{
+  char *text;
+  unsigned n_pieces;
+  Piece *pieces;
+  unsigned literal_len;         /* total, to size the output */
+  unsigned n_arg_pieces;        /* placeholders other than {#} */
+  unsigned arg_word_literal_len; /* repeated for each argument */
+};
+
+static const struct
+{
+  const char *name;
+  PieceType type;
+} placeholders[] =
+{
+  { "{}",   PIECE_ARG },
+  { "{.}",  PIECE_NO_EXT },
+  { "{/}",  PIECE_BASENAME },
+  { "{//}", PIECE_DIRNAME },
+  { "{/.}", PIECE_BASENAME_NO_EXT },
+  { "{#}",  PIECE_SEQNO },
+};
+
+/* the length of the placeholder at 'at', or 0 */
+static unsigned
+match_placeholder (const char         *at,
+                   unsigned            n_vars,
+                   const char * const *var_names,
+                   PieceType          *type_out,
+                   unsigned           *var_out)
+{
+  unsigned p;
+  for (p = 0; p < G_N_ELEMENTS (placeholders); p++)
+    {
+      unsigned len = strlen (placeholders[p].name);
+      if (strncmp (at, placeholders[p].name, len) == 0)
+        {
+          *type_out = placeholders[p].type;
+          return len;
+        }
+    }
+  for (p = 0; p < n_vars; p++)
+    {
+      unsigned len = strlen (var_names[p]);
+      if (strncmp (at + 1, var_names[p], len) == 0 && at[len + 1] == '}')
+        {
+          *type_out = PIECE_VAR;
+          *var_out = p;
+          return len + 2;
+        }
+    }
+  return 0;
+}
+
+static void
+add_piece (GArray   *pieces,
+           PieceType type,
+           unsigned  offset,
+           unsigned  len)
+{
+  Piece piece;
+  if (type == PIECE_LITERAL && len == 0)
+    return;
+  piece.type = type;
+  piece.offset = offset;
+  piece.len = len;
+  piece.var = 0;
+  piece.word = -1;
+  piece.in_arg_word = FALSE;
+  g_array_append_val (pieces, piece);
+}
+
+/* Split the literals at spaces, and number the words,
+   so that a batch can repeat each word that has an argument. */
+static GArray *
+split_words (const char *text,
+             GArray     *pieces)
+{
+  GArray *rv = g_array_new (FALSE, FALSE, sizeof (Piece));
+  int word = -1;
+  gboolean in_word = FALSE;
+  unsigned i, start = 0;
+  for (i = 0; i < pieces->len; i++)
+    {
+      Piece *piece = &g_array_index (pieces, Piece, i);
+      if (piece->type == PIECE_LITERAL)
+        {
+          unsigned at = piece->offset, end = piece->offset + piece->len;
+          while (at < end)
+            {
+              gboolean is_space = g_ascii_isspace (text[at]);
+              unsigned run = at;
+              while (run < end && g_ascii_isspace (text[run]) == is_space)
+                run++;
+              add_piece (rv, PIECE_LITERAL, at, run - at);
+              if (is_space)
+                in_word = FALSE;
+              else if (!in_word)
+                {
+                  word++;
+                  in_word = TRUE;
+                }
+              g_array_index (rv, Piece, rv->len - 1).word = in_word ? word : -1;
+              at = run;
+            }
+        }
+      else
+        {
+          if (!in_word)
+            {
+              word++;
+              in_word = TRUE;
+            }
+          add_piece (rv, piece->type, 0, 0);
+          g_array_index (rv, Piece, rv->len - 1).word = word;
+          g_array_index (rv, Piece, rv->len - 1).var = piece->var;
+        }
+    }
+
+  /* mark the words with arguments */
+  for (i = 0; i < rv->len; i++)
+    {
+      Piece *piece = &g_array_index (rv, Piece, i);
+      if (piece->type != PIECE_LITERAL
+       && piece->type != PIECE_SEQNO
+       && piece->type != PIECE_VAR)
+        {
+          for (start = i; start > 0; start--)
+            if (g_array_index (rv, Piece, start - 1).word != piece->word)
+              break;
+          for (; start < rv->len
+                 && g_array_index (rv, Piece, start).word == piece->word;
+               start++)
+            g_array_index (rv, Piece, start).in_arg_word = TRUE;
+        }
+    }
+  g_array_free (pieces, TRUE);
+  return rv;
+}
+
+CmdTemplate *
+cmd_template_new (const char *text)
+{
+  return cmd_template_new_with_vars (text, 0, NULL);
+}
+
+CmdTemplate *
+cmd_template_new_with_vars (const char         *text,
+                            unsigned            n_vars,
+                            const char * const *var_names)
+{
+  CmdTemplate *tmpl = g_slice_new (CmdTemplate);
+  GArray *pieces = g_array_new (FALSE, FALSE, sizeof (Piece));
+  unsigned literal_start = 0;
+  unsigned i = 0;
+  gboolean has_placeholder = FALSE;
+
+  tmpl->literal_len = 0;
+  tmpl->n_arg_pieces = 0;
+  while (text[i] != 0)
+    {
+      PieceType type;
+      unsigned var = 0;
+      unsigned len = 0;
+      if (text[i] == '{')
+        len = match_placeholder (text + i, n_vars, var_names, &type, &var);
+      if (len == 0)
+        {
+          i++;
+          continue;
+        }
+      add_piece (pieces, PIECE_LITERAL, literal_start, i - literal_start);
+      tmpl->literal_len += i - literal_start;
+      add_piece (pieces, type, 0, 0);
+      g_array_index (pieces, Piece, pieces->len - 1).var = var;
+      if (type != PIECE_SEQNO && type != PIECE_VAR)
+        tmpl->n_arg_pieces++;
+      has_placeholder = TRUE;
+      i += len;
+      literal_start = i;
+    }
+  add_piece (pieces, PIECE_LITERAL, literal_start, i - literal_start);
+  tmpl->literal_len += i - literal_start;
+
+  if (has_placeholder)
+    tmpl->text = g_strdup (text);
+  else
+    {
+      tmpl->text = g_strdup_printf ("%s ", text);
+      add_piece (pieces, PIECE_LITERAL, i, 1);
+      tmpl->literal_len += 1;
+      add_piece (pieces, PIECE_ARG, 0, 0);
+      tmpl->n_arg_pieces++;
+    }
+  pieces = split_words (tmpl->text, pieces);
+  tmpl->arg_word_literal_len = 0;
+  for (i = 0; i < pieces->len; i++)
+    if (g_array_index (pieces, Piece, i).in_arg_word)
+      tmpl->arg_word_literal_len += g_array_index (pieces, Piece, i).len;
+  tmpl->n_pieces = pieces->len;
+  tmpl->pieces = (Piece *) g_array_free (pieces, FALSE);
+  return tmpl;
+}
+
+static gboolean
+is_shell_safe (const char *str, unsigned len)
+{
+  unsigned i;
+  if (len == 0)
+    return FALSE;
+  for (i = 0; i < len; i++)
+    if (!g_ascii_isalnum (str[i]) && strchr ("%+,-./:=@_", str[i]) == NULL)
+      return FALSE;
+  return TRUE;
+}
+
+static void
+append_quoted (GString *out, const char *str, unsigned len)
+{
+  unsigned i;
+  if (is_shell_safe (str, len))
+    {
+      g_string_append_len (out, str, len);
+      return;
+    }
+  g_string_append_c (out, '\'');
+  for (i = 0; i < len; i++)
+    if (str[i] == '\'')
+      g_string_append (out, "'\\''");
+    else
+      g_string_append_c (out, str[i]);
+  g_string_append_c (out, '\'');
+}
+
+/* the length of 'str' without an extension
+   (a dot in its last component that isn't the first character) */
+static unsigned
+strip_extension (const char *str, unsigned len)
+{
+  unsigned i = len;
+  while (i > 0 && str[i - 1] != '/')
+    {
+      i--;
+      if (str[i] == '.')
+        return (i == 0 || str[i - 1] == '/') ? len : i;
+    }
+  return len;
+}
+
+static unsigned
+basename_offset (const char *str, unsigned len)
+{
+  unsigned i = len;
+  while (i > 0 && str[i - 1] != '/')
+    i--;
+  return i;
+}
+
+static void
+append_arg (GString    *out,
+            PieceType   type,
+            const char *arg,
+            unsigned    arg_len)
+{
+  unsigned base;
+  switch (type)
+    {
+    case PIECE_ARG:
+      append_quoted (out, arg, arg_len);
+      break;
+    case PIECE_NO_EXT:
+      append_quoted (out, arg, strip_extension (arg, arg_len));
+      break;
+    case PIECE_BASENAME:
+      base = basename_offset (arg, arg_len);
+      append_quoted (out, arg + base, arg_len - base);
+      break;
+    case PIECE_DIRNAME:
+      base = basename_offset (arg, arg_len);
+      if (base == 0)
+        g_string_append_c (out, '.');
+      else if (base == 1)
+        g_string_append_c (out, '/');
+      else
+        append_quoted (out, arg, base - 1);
+      break;
+    case PIECE_BASENAME_NO_EXT:
+      base = basename_offset (arg, arg_len);
+      append_quoted (out, arg + base,
+                     strip_extension (arg + base, arg_len - base));
+      break;
+    default:
+      g_assert_not_reached ();
+    }
+}
+
+static void
+append_piece (GString        *out,
+              CmdTemplate    *tmpl,
+              const Piece    *piece,
+              const char     *arg,
+              unsigned        arg_len,
+              const char    **args,
+              const unsigned *arg_lens,
+              unsigned        seqno)
+{
+  char seqno_buf[16];
+  switch (piece->type)
+    {
+    case PIECE_LITERAL:
+      g_string_append_len (out, tmpl->text + piece->offset, piece->len);
+      break;
+    case PIECE_VAR:
+      append_quoted (out, args[piece->var], arg_lens[piece->var]);
+      break;
+    case PIECE_SEQNO:
+      g_snprintf (seqno_buf, sizeof (seqno_buf), "%u", seqno);
+      g_string_append (out, seqno_buf);
+      break;
+    default:
+      append_arg (out, piece->type, arg, arg_len);
+      break;
+    }
+}
+
+char *
+cmd_template_expand (CmdTemplate    *tmpl,
+                     unsigned        n_args,
+                     const char    **args,
+                     const unsigned *arg_lens,
+                     unsigned        seqno)
+{
+  GString *out;
+  gsize total_arg_len = 0;
+  unsigned i, end, a, p;
+  for (a = 0; a < n_args; a++)
+    total_arg_len += arg_lens[a];
+  out = g_string_sized_new (cmd_template_estimate_len (tmpl, n_args, total_arg_len));
+  for (i = 0; i < tmpl->n_pieces; i = end)
+    {
+      const Piece *piece = tmpl->pieces + i;
+      if (!piece->in_arg_word)
+        {
+          append_piece (out, tmpl, piece, NULL, 0, args, arg_lens, seqno);
+          end = i + 1;
+          continue;
+        }
+
+      /* a word with an argument:  once per argument */
+      for (end = i + 1; end < tmpl->n_pieces; end++)
+        if (tmpl->pieces[end].word != piece->word)
+          break;
+      for (a = 0; a < n_args; a++)
+        {
+          if (a > 0)
+            g_string_append_c (out, ' ');
+          for (p = i; p < end; p++)
+            append_piece (out, tmpl, tmpl->pieces + p,
+                          args[a], arg_lens[a], args, arg_lens, seqno);
+        }
+    }
+  return g_string_free (out, FALSE);
+}
+
+/* assumes each argument is quoted */
+gsize
+cmd_template_estimate_len (CmdTemplate *tmpl,
+                           unsigned     n_args,
+                           gsize        total_arg_len)
+{
+  return tmpl->literal_len
+       + tmpl->arg_word_literal_len * (n_args > 0 ? n_args - 1 : 0)
+       + tmpl->n_arg_pieces * (total_arg_len + n_args * 4);
+}
+
+const char *
+cmd_template_get_text (CmdTemplate *tmpl)
+{
+  return tmpl->text;
+}
+
+void
+cmd_template_free (CmdTemplate *tmpl)
+{
+  g_free (tmpl->text);
+  g_free (tmpl->pieces);
+  g_slice_free (CmdTemplate, tmpl);
+}
@@ -0,0 +1,45 @@
+#include <glib.h>
+
+/* A command template, like xargs or GNU parallel take:  each input
+ * line is an argument that replaces the placeholders:
+ *     {}     the argument
+ *     {.}    the argument without its extension
+ *     {/}    the argument's basename
+ *     {//}   the argument's dirname
+ *     {/.}   the basename without its extension
+ *     {#}    the task's sequence number, starting at 1
+ * Anything else in braces is left alone.  If there are no
+ * placeholders, " {}" is appended.
+ *
+ * The template is shell text;  the substituted values are
+ * quoted if they contain anything but safe characters.
+ * The template is parsed once, by cmd_template_new().
+ *
+ * With several arguments (a batch, see system_set_batch()), each
+ * space-separated word of the template that has a placeholder is
+ * repeated for each of them, like GNU parallel's -X:
+ *     "cc -o {.}.o {}"  with a.c b.c  =>  "cc -o a.o b.o a.c b.c"
+ * (Words are split at spaces without regard to shell quoting.)
+ */
+typedef struct _CmdTemplate CmdTemplate;
+
+CmdTemplate *cmd_template_new    (const char  *text);
+
+/* Also {NAME} for each of 'var_names':  the value of that
+   argument, by position (see generator_source_new()). */
+CmdTemplate *cmd_template_new_with_vars (const char         *text,
+                                         unsigned            n_vars,
+                                         const char * const *var_names);
+char        *cmd_template_expand (CmdTemplate *tmpl,
+                                  unsigned     n_args,
+                                  const char **args,
+                                  const unsigned *arg_lens,
+                                  unsigned     seqno);
+
+/* roughly how long an expansion will be */
+gsize        cmd_template_estimate_len (CmdTemplate *tmpl,
+                                        unsigned     n_args,
+                                        gsize        total_arg_len);
+/* the text it was made from */
+const char  *cmd_template_get_text (CmdTemplate *tmpl);
+void         cmd_template_free   (CmdTemplate *tmpl);
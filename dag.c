@@ -0,0 +1,424 @@
+#include <string.h>
+#include "parallelizer-private.h"
+
+typedef enum
+{
+  DAG_NODE_WAITING,             /* for its dependencies */
+  DAG_NODE_QUEUED,              /* its task is queued or running */
+  DAG_NODE_DONE                 /* its task ended, or was skipped */
+} DagNodeState;
+
+typedef struct _Dag Dag;
+typedef struct _DagNode DagNode;
+
+struct _DagNode
+{
+  Dag *dag;
+  unsigned index;
+  char *id;
+  char *cmdline;
+  char **dependency_ids;        /* only while parsing */
+  GPtrArray *dependents;        /* DagNodes */
+  unsigned n_waiting_for;       /* dependencies that haven't succeeded */
+  guint64 cost;                 /* how long it is expected to take, in ms */
+  guint64 path;                 /* the cost of the longest chain from it */
+  DagNodeState state;
+};
+
+struct _Dag
+{
+  System *system;
+  InputQueue *queue;
+  GPtrArray *nodes;
+  unsigned n_unresolved;        /* nodes that aren't DONE */
+};
+
+static void
+dag_free (Dag *dag)
+{
+  unsigned i;
+  for (i = 0; i < dag->nodes->len; i++)
+    {
+      DagNode *node = dag->nodes->pdata[i];
+      g_free (node->id);
+      g_free (node->cmdline);
+      g_strfreev (node->dependency_ids);
+      g_ptr_array_free (node->dependents, TRUE);
+      g_slice_free (DagNode, node);
+    }
+  g_ptr_array_free (dag->nodes, TRUE);
+  g_slice_free (Dag, dag);
+}
+
+/* the words of 'str', split at blanks */
+static char **
+split_words (const char *str)
+{
+  GPtrArray *words = g_ptr_array_new ();
+  const char *at = str;
+  for (;;)
+    {
+      const char *end;
+      while (*at == ' ' || *at == '\t')
+        at++;
+      if (*at == 0)
+        break;
+      end = at;
+      while (*end != 0 && *end != ' ' && *end != '\t')
+        end++;
+      g_ptr_array_add (words, g_strndup (at, end - at));
+      at = end;
+    }
+  g_ptr_array_add (words, NULL);
+  return (char **) g_ptr_array_free (words, FALSE);
+}
+
+static gboolean
+parse_dag (Dag        *dag,
+           const char *filename,
+           char       *contents,
+           GError    **error)
+{
+  GHashTable *by_id = g_hash_table_new (g_str_hash, g_str_equal);
+  char **lines = g_strsplit (contents, "\n", 0);
+  gboolean rv = FALSE;
+  unsigned i, j;
+
+  for (i = 0; lines[i] != NULL; i++)
+    {
+      char *line = g_strstrip (lines[i]);
+      char *colon, *command;
+      char **words;
+      DagNode *node;
+      if (*line == 0 || *line == '#')
+        continue;
+      colon = strchr (line, ':');
+      command = colon == NULL ? NULL : g_strchug (colon + 1);
+      if (colon == NULL || *command == 0)
+        {
+          g_set_error (error, PARALLELIZER_ERROR_DOMAIN_QUARK,
+                       PARALLELIZER_ERROR_PARSE,
+                       "%s:%u: expected ID [DEPENDENCY...]: COMMAND",
+                       filename, i + 1);
+          goto out;
+        }
+      *colon = 0;
+      words = split_words (line);
+      if (words[0] == NULL || g_hash_table_lookup (by_id, words[0]) != NULL)
+        {
+          g_set_error (error, PARALLELIZER_ERROR_DOMAIN_QUARK,
+                       PARALLELIZER_ERROR_PARSE,
+                       words[0] == NULL ? "%s:%u: missing task ID"
+                                        : "%s:%u: task ID used twice",
+                       filename, i + 1);
+          g_strfreev (words);
+          goto out;
+        }
+
+      node = g_slice_new (DagNode);
+      node->dag = dag;
+      node->index = dag->nodes->len;
+      node->id = g_strdup (words[0]);
+      node->cmdline = g_strdup (command);
+      node->dependency_ids = g_strdupv (words + 1);
+      node->dependents = g_ptr_array_new ();
+      node->n_waiting_for = 0;
+      node->cost = 1;
+      node->path = 0;
+      node->state = DAG_NODE_WAITING;
+      g_ptr_array_add (dag->nodes, node);
+      g_hash_table_insert (by_id, node->id, node);
+      g_strfreev (words);
+    }
+
+  for (i = 0; i < dag->nodes->len; i++)
+    {
+      DagNode *node = dag->nodes->pdata[i];
+      for (j = 0; node->dependency_ids[j] != NULL; j++)
+        {
+          DagNode *dep = g_hash_table_lookup (by_id, node->dependency_ids[j]);
+          if (dep == NULL)
+            {
+              g_set_error (error, PARALLELIZER_ERROR_DOMAIN_QUARK,
+                           PARALLELIZER_ERROR_PARSE,
+                           "%s: task %s depends on %s, which isn't there",
+                           filename, node->id, node->dependency_ids[j]);
+              goto out;
+            }
+          g_ptr_array_add (dep->dependents, node);
+          node->n_waiting_for++;
+        }
+      g_strfreev (node->dependency_ids);
+      node->dependency_ids = NULL;
+    }
+  rv = TRUE;
+
+out:
+  g_strfreev (lines);
+  g_hash_table_destroy (by_id);
+  return rv;
+}
+
+/* From the runtime history, if there is one;  a node the history
+   knows nothing about is assumed to take as long as the average of
+   those it knows.  Without a history, each node costs the same. */
+static void
+estimate_costs (Dag *dag)
+{
+  System *system = dag->system;
+  guint64 total = 0;
+  unsigned n_known = 0;
+  unsigned i;
+  if (system->history == NULL)
+    return;
+  for (i = 0; i < dag->nodes->len; i++)
+    {
+      DagNode *node = dag->nodes->pdata[i];
+      guint64 keys[2];
+      guint64 usecs = history_lookup (system, node->cmdline,
+                                      strlen (node->cmdline), keys);
+      node->cost = usecs == 0 ? 0 : MAX (usecs / 1000, 1);
+      if (usecs != 0)
+        {
+          total += node->cost;
+          n_known++;
+        }
+    }
+  for (i = 0; i < dag->nodes->len; i++)
+    {
+      DagNode *node = dag->nodes->pdata[i];
+      if (node->cost == 0)
+        node->cost = n_known == 0 ? 1 : MAX (total / n_known, 1);
+    }
+}
+
+/* The nodes that Kahn's algorithm couldn't sort ('n_left' isn't 0)
+   each need one of the others:  follow what they need from one of
+   them until a node comes round again, and name the nodes from
+   there, eg "a needs b, which needs c, which needs a". */
+static char *
+describe_cycle (Dag            *dag,
+                const unsigned *n_left)
+{
+  unsigned n = dag->nodes->len;
+  DagNode **needs = g_new0 (DagNode *, n);
+  guint8 *seen = g_new0 (guint8, n);
+  GString *str = g_string_new ("");
+  DagNode *node = NULL;
+  DagNode *at;
+  unsigned i, j;
+  for (i = 0; i < n; i++)
+    {
+      DagNode *dep = dag->nodes->pdata[i];
+      if (n_left[i] == 0)
+        continue;
+      node = dep;
+      for (j = 0; j < dep->dependents->len; j++)
+        {
+          DagNode *dependent = dep->dependents->pdata[j];
+          if (n_left[dependent->index] != 0)
+            needs[dependent->index] = dep;
+        }
+    }
+  while (!seen[node->index])
+    {
+      seen[node->index] = 1;
+      node = needs[node->index];
+    }
+  g_string_append_printf (str, "%s needs %s", node->id,
+                          needs[node->index]->id);
+  for (at = needs[node->index]; at != node; at = needs[at->index])
+    g_string_append_printf (str, ", which needs %s", needs[at->index]->id);
+  g_free (needs);
+  g_free (seen);
+  return g_string_free (str, FALSE);
+}
+
+/* Sort the nodes (Kahn's algorithm) to find cycles, then work out
+   each node's longest path, from its dependents' first. */
+static gboolean
+compute_paths (Dag        *dag,
+               const char *filename,
+               GError    **error)
+{
+  unsigned n = dag->nodes->len;
+  unsigned *n_left = g_new (unsigned, n);
+  GPtrArray *order = g_ptr_array_sized_new (n);
+  unsigned i, j;
+  for (i = 0; i < n; i++)
+    {
+      DagNode *node = dag->nodes->pdata[i];
+      n_left[i] = node->n_waiting_for;
+      if (n_left[i] == 0)
+        g_ptr_array_add (order, node);
+    }
+  for (i = 0; i < order->len; i++)
+    {
+      DagNode *node = order->pdata[i];
+      for (j = 0; j < node->dependents->len; j++)
+        {
+          DagNode *dependent = node->dependents->pdata[j];
+          if (--n_left[dependent->index] == 0)
+            g_ptr_array_add (order, dependent);
+        }
+    }
+  if (order->len < n)
+    {
+      char *cycle = describe_cycle (dag, n_left);
+      g_set_error (error, PARALLELIZER_ERROR_DOMAIN_QUARK,
+                   PARALLELIZER_ERROR_PARSE,
+                   "%s: dependency cycle: %s", filename, cycle);
+      g_free (cycle);
+      g_free (n_left);
+      g_ptr_array_free (order, TRUE);
+      return FALSE;
+    }
+
+  for (i = n; i-- > 0; )
+    {
+      DagNode *node = order->pdata[i];
+      guint64 longest = 0;
+      for (j = 0; j < node->dependents->len; j++)
+        {
+          DagNode *dependent = node->dependents->pdata[j];
+          longest = MAX (longest, dependent->path);
+        }
+      node->path = node->cost + longest;
+    }
+  g_free (n_left);
+  g_ptr_array_free (order, TRUE);
+  return TRUE;
+}
+
+static void
+queue_node (DagNode *node)
+{
+  Task *task = system_queue_task (node->dag->queue, node->cmdline, node->path);
+  task->dag_node = node;
+  node->state = DAG_NODE_QUEUED;
+}
+
+/* All the nodes that depend on 'failed' can't run now. */
+static void
+skip_dependents (DagNode *failed,
+                 Task    *failed_task)
+{
+  Dag *dag = failed->dag;
+  GPtrArray *stack = g_ptr_array_new ();
+  unsigned i;
+  g_ptr_array_add (stack, failed);
+  while (stack->len > 0)
+    {
+      DagNode *node = stack->pdata[stack->len - 1];
+      g_ptr_array_set_size (stack, stack->len - 1);
+      for (i = 0; i < node->dependents->len; i++)
+        {
+          DagNode *dependent = node->dependents->pdata[i];
+          if (dependent->state != DAG_NODE_WAITING)
+            continue;
+          dependent->state = DAG_NODE_DONE;
+          dag->n_unresolved--;
+          system_skip_task (dag->system, dependent->cmdline,
+                            failed_task->task_index);
+          g_ptr_array_add (stack, dependent);
+        }
+    }
+  g_ptr_array_free (stack, TRUE);
+}
+
+/* Called by task_done(), after the task's ended traps. */
+void
+dag_task_done (Task *task)
+{
+  DagNode *node = task->dag_node;
+  Dag *dag = node->dag;
+  unsigned i;
+  task->dag_node = NULL;
+  node->state = DAG_NODE_DONE;
+  dag->n_unresolved--;
+  if (task->info.terminated.termination_type == TASK_TERMINATION_EXIT
+   && task->info.terminated.termination_info == 0)
+    {
+      for (i = 0; i < node->dependents->len; i++)
+        {
+          DagNode *dependent = node->dependents->pdata[i];
+
+          /* it may have been skipped, for another dependency */
+          if (--dependent->n_waiting_for == 0
+           && dependent->state == DAG_NODE_WAITING)
+            queue_node (dependent);
+        }
+    }
+  else
+    skip_dependents (node, task);
+
+  if (dag->n_unresolved == 0)
+    {
+      InputQueue *queue = dag->queue;
+      dag_free (dag);
+      system_close_input_queue (queue);
+    }
+}
+
+static gboolean
+handle_empty_dag_idle (gpointer data)
+{
+  system_close_input_queue (data);
+  return FALSE;
+}
+
+gboolean
+system_add_input_dag (System     *system,
+                      const char *filename,
+                      GError    **error)
+{
+  GError *file_error = NULL;
+  char *contents;
+  Dag *dag;
+  unsigned i;
+
+  if (!g_file_get_contents (filename, &contents, NULL, &file_error))
+    {
+      g_set_error (error, PARALLELIZER_ERROR_DOMAIN_QUARK,
+                   PARALLELIZER_ERROR_OPEN,
+                   "could not read %s: %s", filename, file_error->message);
+      g_error_free (file_error);
+      return FALSE;
+    }
+  dag = g_slice_new (Dag);
+  dag->system = system;
+  dag->queue = NULL;
+  dag->nodes = g_ptr_array_new ();
+  if (!parse_dag (dag, filename, contents, error))
+    {
+      g_free (contents);
+      dag_free (dag);
+      return FALSE;
+    }
+  estimate_costs (dag);
+  if (!compute_paths (dag, filename, error))
+    {
+      g_free (contents);
+      dag_free (dag);
+      return FALSE;
+    }
+  g_free (contents);
+  dag->queue = system_open_input_queue (system, TRUE);
+  if (dag->nodes->len == 0)
+    {
+      /* from the main loop, so that the other inputs are open by then */
+      g_idle_add (handle_empty_dag_idle, dag->queue);
+      dag_free (dag);
+      return TRUE;
+    }
+
+  dag->n_unresolved = dag->nodes->len;
+  for (i = 0; i < dag->nodes->len; i++)
+    {
+      DagNode *node = dag->nodes->pdata[i];
+      if (node->n_waiting_for == 0)
+        queue_node (node);
+    }
+  system_refill_slots (system);
+  return TRUE;
+}
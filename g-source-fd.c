@@ -1,3 +1,6 @@
+#include <sys/epoll.h>
+#include <errno.h>
+#include <unistd.h>
 #include "g-source-fd.h"
 
 #if 1
@@ -6,75 +9,284 @@
 # define DEBUG_ONLY(x) x
 #endif
 
+/* All GSourceFDs share one GSource, which polls an epoll fd.
+   glib only sees that one fd, and each dispatch only visits
+   the fds that are ready, so the cost of a main-loop iteration
+   does not grow with the number of fds we are watching. */
+
+#define INITIAL_MAX_EVENTS      64
+#define MAX_MAX_EVENTS          4096
+
 struct _GSourceFD
+{
+  int fd;
+  GIOCondition revents;
+  GSourceFunc func;
+  void *data;
+  gboolean is_always_ready;
+  gboolean is_still_ready;
+  gboolean is_destroyed;
+  GSourceFD *next_destroyed;
+};
+
+typedef struct _EpollSource EpollSource;
+struct _EpollSource
 {
   GSource base;
-  GPollFD poll_fd;
-  gboolean has_poll;
+  GPollFD poll_fd;              /* the epoll fd */
+  unsigned n_fds;
+
+  /* fds that epoll refuses (regular files, /dev/null):
+     as with poll(), they are always ready. */
+  GPtrArray *always_ready;
+
+  /* edge-triggered fds whose func stopped before EAGAIN:
+     dispatched again on the next iteration */
+  GPtrArray *still_ready;
+
+  struct epoll_event *events;
+  unsigned max_events;
+
+  /* GSourceFDs destroyed while dispatching:  there may
+     still be events for them in 'events', so we free
+     them when dispatch is done. */
+  gboolean in_dispatch;
+  GSourceFD *destroyed;
 };
 
-static gboolean g_source_fd_prepare  (GSource    *source,
-                                      gint       *timeout_)
+static EpollSource *epoll_source = NULL;
+
+static guint32
+events_to_epoll (GIOCondition events)
+{
+  guint32 rv = 0;
+  if (events & G_IO_IN)
+    rv |= EPOLLIN;
+  if (events & G_IO_PRI)
+    rv |= EPOLLPRI;
+  if (events & G_IO_OUT)
+    rv |= EPOLLOUT;
+  return rv;
+}
+
+static GIOCondition
+events_from_epoll (guint32 events)
+{
+  GIOCondition rv = 0;
+  if (events & EPOLLIN)
+    rv |= G_IO_IN;
+  if (events & EPOLLPRI)
+    rv |= G_IO_PRI;
+  if (events & EPOLLOUT)
+    rv |= G_IO_OUT;
+  if (events & EPOLLERR)
+    rv |= G_IO_ERR;
+  if (events & EPOLLHUP)
+    rv |= G_IO_HUP;
+  return rv;
+}
+
+static gboolean epoll_source_prepare  (GSource    *source,
+                                       gint       *timeout_)
 {
+  EpollSource *es = (EpollSource *) source;
   *timeout_ = -1;
-  return FALSE;
+  return es->always_ready->len > 0
+      || es->still_ready->len > 0;
 }
 
-static gboolean g_source_fd_check    (GSource    *source)
+static gboolean epoll_source_check    (GSource    *source)
 {
-  GSourceFD *sfd = (GSourceFD *) source;
-  DEBUG_ONLY (g_message ("g_source_fd_check: fd=%u, revents=%u", sfd->poll_fd.fd, sfd->poll_fd.revents));
-  return sfd->poll_fd.revents != 0;
+  EpollSource *es = (EpollSource *) source;
+  return es->poll_fd.revents != 0
+      || es->always_ready->len > 0
+      || es->still_ready->len > 0;
 }
 
-static gboolean g_source_fd_dispatch (GSource    *source,
-                                      GSourceFunc callback,
-                                      gpointer    user_data)
+static void
+run_callback (GSourceFD   *sfd,
+              GIOCondition revents)
 {
-  GSourceFD *sfd = (GSourceFD *) source;
-  if (callback != NULL
-   && !callback (user_data))
+  if (sfd->is_destroyed)
+    return;
+  sfd->revents = revents;
+  if (!sfd->func (sfd->data) && !sfd->is_destroyed)
+    g_source_fd_destroy (sfd);
+}
+
+static gboolean epoll_source_dispatch (GSource    *source,
+                                       GSourceFunc callback,
+                                       gpointer    user_data)
+{
+  EpollSource *es = (EpollSource *) source;
+  int n_events, i;
+  GSourceFD **always_ready = NULL;
+  unsigned n_always_ready = es->always_ready->len;
+  GPtrArray *still_ready = NULL;
+
+  n_events = epoll_wait (es->poll_fd.fd, es->events, es->max_events, 0);
+  if (n_events < 0)
+    {
+      if (errno == EINTR)
+        return TRUE;
+      g_error ("error calling epoll_wait: %s", g_strerror (errno));
+    }
+  DEBUG_ONLY (g_message ("epoll_source_dispatch: %d events", n_events));
+
+  es->in_dispatch = TRUE;
+  if (es->still_ready->len > 0)
+    {
+      /* swap in an empty list:  callbacks may re-add themselves */
+      still_ready = es->still_ready;
+      es->still_ready = g_ptr_array_new ();
+      for (i = 0; i < (int) still_ready->len; i++)
+        {
+          GSourceFD *sfd = still_ready->pdata[i];
+          sfd->is_still_ready = FALSE;
+          run_callback (sfd, G_IO_IN);
+        }
+      g_ptr_array_free (still_ready, TRUE);
+    }
+  for (i = 0; i < n_events; i++)
+    run_callback (es->events[i].data.ptr,
+                  events_from_epoll (es->events[i].events));
+  if (n_always_ready > 0)
+    {
+      /* callbacks may modify the array */
+      always_ready = g_memdup (es->always_ready->pdata,
+                               n_always_ready * sizeof (GSourceFD *));
+      for (i = 0; i < (int) n_always_ready; i++)
+        run_callback (always_ready[i], G_IO_IN | G_IO_OUT);
+      g_free (always_ready);
+    }
+  es->in_dispatch = FALSE;
+
+  while (es->destroyed != NULL)
     {
-      g_source_remove_poll (source, &sfd->poll_fd);
-      sfd->has_poll = FALSE;
-      return FALSE;
+      GSourceFD *sfd = es->destroyed;
+      es->destroyed = sfd->next_destroyed;
+      g_slice_free (GSourceFD, sfd);
+    }
+
+  /* a full batch:  fetch more events next time, if there are more fds */
+  if ((unsigned) n_events == es->max_events
+   && es->max_events < es->n_fds
+   && es->max_events < MAX_MAX_EVENTS)
+    {
+      es->max_events *= 2;
+      es->events = g_renew (struct epoll_event, es->events, es->max_events);
     }
   return TRUE;
 }
 
-static void g_source_fd_finalize (GSource *source)
+static GSourceFuncs epoll_source_funcs =
 {
-  GSourceFD *sfd = (GSourceFD *) source;
-  if (sfd->has_poll)
-    g_source_remove_poll (source, &sfd->poll_fd);
-}
+  epoll_source_prepare,
+  epoll_source_check,
+  epoll_source_dispatch,
+  NULL
+};
 
-static GSourceFuncs source_fd_funcs =
+static EpollSource *
+get_epoll_source (void)
 {
-  g_source_fd_prepare,
-  g_source_fd_check,
-  g_source_fd_dispatch,
-  g_source_fd_finalize
-};
+  if (epoll_source == NULL)
+    {
+      GSource *source = g_source_new (&epoll_source_funcs, sizeof (EpollSource));
+      EpollSource *es = (EpollSource *) source;
+      es->poll_fd.fd = epoll_create1 (EPOLL_CLOEXEC);
+      if (es->poll_fd.fd < 0)
+        g_error ("error creating epoll fd: %s", g_strerror (errno));
+      es->poll_fd.events = G_IO_IN;
+      es->n_fds = 0;
+      es->always_ready = g_ptr_array_new ();
+      es->still_ready = g_ptr_array_new ();
+      es->max_events = INITIAL_MAX_EVENTS;
+      es->events = g_new (struct epoll_event, es->max_events);
+      es->in_dispatch = FALSE;
+      es->destroyed = NULL;
+      g_source_add_poll (source, &es->poll_fd);
+      g_source_attach (source, g_main_context_default ());
+      epoll_source = es;
+    }
+  return epoll_source;
+}
 
 GSourceFD    *g_source_fd_new         (int          fd,
                                        GIOCondition events,
                                        GSourceFunc  func,
                                        void        *data)
 {
-  GSource *source = g_source_new (&source_fd_funcs, sizeof (GSourceFD));
-  GSourceFD *sfd = (GSourceFD *) source;
-  sfd->poll_fd.fd = fd;
-  sfd->poll_fd.events = events;
-  g_source_add_poll (source, &sfd->poll_fd);
-  g_source_attach (source, g_main_context_default ());
-  g_source_set_callback (source, func, data, NULL);
-  sfd->has_poll = TRUE;
+  return g_source_fd_new_full (fd, events, 0, func, data);
+}
+
+GSourceFD    *g_source_fd_new_full    (int          fd,
+                                       GIOCondition events,
+                                       GSourceFDFlags flags,
+                                       GSourceFunc  func,
+                                       void        *data)
+{
+  EpollSource *es = get_epoll_source ();
+  GSourceFD *sfd = g_slice_new (GSourceFD);
+  struct epoll_event event;
+  sfd->fd = fd;
+  sfd->revents = 0;
+  sfd->func = func;
+  sfd->data = data;
+  sfd->is_always_ready = FALSE;
+  sfd->is_still_ready = FALSE;
+  sfd->is_destroyed = FALSE;
+  sfd->next_destroyed = NULL;
+
+  event.events = events_to_epoll (events);
+  if (flags & G_SOURCE_FD_EDGE_TRIGGERED)
+    event.events |= EPOLLET;
+  event.data.ptr = sfd;
+  if (epoll_ctl (es->poll_fd.fd, EPOLL_CTL_ADD, fd, &event) < 0)
+    {
+      if (errno != EPERM)
+        g_error ("error adding fd %d to epoll set: %s", fd, g_strerror (errno));
+      sfd->is_always_ready = TRUE;
+      g_ptr_array_add (es->always_ready, sfd);
+    }
+  es->n_fds++;
   return sfd;
 }
 
+void          g_source_fd_destroy     (GSourceFD   *source)
+{
+  EpollSource *es = epoll_source;
+  g_assert (!source->is_destroyed);
+  if (source->is_still_ready)
+    g_ptr_array_remove_fast (es->still_ready, source);
+  if (source->is_always_ready)
+    g_ptr_array_remove (es->always_ready, source);
+  else if (epoll_ctl (es->poll_fd.fd, EPOLL_CTL_DEL, source->fd, NULL) < 0)
+    g_warning ("error removing fd %d from epoll set: %s",
+               source->fd, g_strerror (errno));
+  es->n_fds--;
+  source->is_destroyed = TRUE;
+  if (es->in_dispatch)
+    {
+      source->next_destroyed = es->destroyed;
+      es->destroyed = source;
+    }
+  else
+    g_slice_free (GSourceFD, source);
+}
+
+void          g_source_fd_still_ready (GSourceFD   *source)
+{
+  EpollSource *es = epoll_source;
+  g_return_if_fail (!source->is_destroyed);
+  if (!source->is_still_ready && !source->is_always_ready)
+    {
+      source->is_still_ready = TRUE;
+      g_ptr_array_add (es->still_ready, source);
+    }
+}
 
 GIOCondition  g_source_fd_get_revents (GSourceFD   *source)
 {
-  return ((GSourceFD *) source)->poll_fd.revents;
+  return source->revents;
 }
@@ -1,10 +1,29 @@
 
 #include <glib.h>
 
+/* Watch an fd from the default main-context.
+   If 'func' returns FALSE, the GSourceFD is destroyed.
+
+   The GSourceFD must be destroyed (or its func must return FALSE)
+   before the fd is closed. */
 typedef struct _GSourceFD GSourceFD;
 
+typedef enum
+{
+  /* func is only called when the fd becomes ready, so it must
+     read until EAGAIN, or call g_source_fd_still_ready() */
+  G_SOURCE_FD_EDGE_TRIGGERED = (1<<0)
+} GSourceFDFlags;
+
 GSourceFD    *g_source_fd_new         (int          fd,
                                        GIOCondition events,
                                        GSourceFunc  func,
                                        void        *data);
+GSourceFD    *g_source_fd_new_full    (int          fd,
+                                       GIOCondition events,
+                                       GSourceFDFlags flags,
+                                       GSourceFunc  func,
+                                       void        *data);
+void          g_source_fd_still_ready (GSourceFD   *source);
+void          g_source_fd_destroy     (GSourceFD   *source);
 GIOCondition  g_source_fd_get_revents (GSourceFD   *source);
@@ -0,0 +1,226 @@
+#include <string.h>
+#include "parallelizer.h"
+#include "cmd-template.h"
+
+#if 1
+# define DEBUG_ONLY(x)
+#else
+# define DEBUG_ONLY(x) x
+#endif
+
+#define ITEMS_PER_IDLE          4096
+
+typedef struct _GeneratorVar GeneratorVar;
+struct _GeneratorVar
+{
+  char *name;
+
+  /* a range if 'values' is NULL */
+  gint64 start, step;
+  char **values;
+
+  guint64 n_values;
+  guint64 index;                /* of the current value */
+  char buf[24];                 /* a range's current value */
+};
+
+typedef struct _SourceGenerator SourceGenerator;
+struct _SourceGenerator
+{
+  Source base;
+  char *template_text;
+  CmdTemplate *tmpl;            /* compiled when first trapped */
+  GPtrArray *vars;
+  unsigned seqno;
+  gboolean is_done;
+
+  /* the current values */
+  const char **args;
+  unsigned *arg_lens;
+};
+
+static void
+generator_emit_current (SourceGenerator *gen)
+{
+  unsigned i;
+  char *cmdline;
+  for (i = 0; i < gen->vars->len; i++)
+    {
+      GeneratorVar *var = gen->vars->pdata[i];
+      if (var->values != NULL)
+        gen->args[i] = var->values[var->index];
+      else
+        {
+          g_snprintf (var->buf, sizeof (var->buf), "%" G_GINT64_FORMAT,
+                      var->start + (gint64) var->index * var->step);
+          gen->args[i] = var->buf;
+        }
+      gen->arg_lens[i] = strlen (gen->args[i]);
+    }
+  cmdline = cmd_template_expand (gen->tmpl, gen->vars->len,
+                                 gen->args, gen->arg_lens, ++gen->seqno);
+  DEBUG_ONLY (g_message ("generator: %s", cmdline));
+  gen->base.callback (&gen->base, cmdline, strlen (cmdline),
+                      gen->base.trap_data);
+  g_free (cmdline);
+}
+
+/* like an odometer:  returns FALSE after the last combination */
+static gboolean
+generator_advance (SourceGenerator *gen)
+{
+  unsigned i = gen->vars->len;
+  while (i-- > 0)
+    {
+      GeneratorVar *var = gen->vars->pdata[i];
+      if (++var->index < var->n_values)
+        return TRUE;
+      var->index = 0;
+    }
+  return FALSE;
+}
+
+static gboolean
+do_idle_generator (gpointer data)
+{
+  SourceGenerator *gen = data;
+  unsigned n = 0;
+  while (gen->base.callback != NULL && n++ < ITEMS_PER_IDLE)
+    {
+      if (gen->is_done)
+        {
+          gen->base.callback (&gen->base, NULL, 0, gen->base.trap_data);
+          break;
+        }
+      generator_emit_current (gen);
+      if (!generator_advance (gen))
+        gen->is_done = TRUE;
+    }
+  return TRUE;
+}
+
+static void
+generator_trap (Source *source)
+{
+  SourceGenerator *gen = (SourceGenerator *) source;
+  if (gen->tmpl == NULL)
+    {
+      const char **names = g_new (const char *, gen->vars->len);
+      unsigned i;
+      for (i = 0; i < gen->vars->len; i++)
+        {
+          GeneratorVar *var = gen->vars->pdata[i];
+          names[i] = var->name;
+          if (var->n_values == 0)
+            gen->is_done = TRUE;
+        }
+      gen->tmpl = cmd_template_new_with_vars (gen->template_text,
+                                              gen->vars->len, names);
+      g_free (names);
+      gen->args = g_new (const char *, gen->vars->len);
+      gen->arg_lens = g_new (unsigned, gen->vars->len);
+      if (gen->vars->len == 0)
+        gen->is_done = TRUE;
+    }
+  g_idle_add (do_idle_generator, source);
+}
+
+static void
+generator_untrap (Source *source)
+{
+  g_idle_remove_by_data (source);
+}
+
+static void
+generator_destroy (Source *source)
+{
+  SourceGenerator *gen = (SourceGenerator *) source;
+  unsigned i;
+  for (i = 0; i < gen->vars->len; i++)
+    {
+      GeneratorVar *var = gen->vars->pdata[i];
+      g_free (var->name);
+      g_strfreev (var->values);
+      g_slice_free (GeneratorVar, var);
+    }
+  g_ptr_array_free (gen->vars, TRUE);
+  if (gen->tmpl != NULL)
+    cmd_template_free (gen->tmpl);
+  g_free (gen->template_text);
+  g_free (gen->args);
+  g_free (gen->arg_lens);
+  g_slice_free (SourceGenerator, gen);
+}
+
+Source *
+generator_source_new (void)
+{
+  SourceGenerator *gen = g_slice_new (SourceGenerator);
+  gen->base.trap = generator_trap;
+  gen->base.untrap = generator_untrap;
+  gen->base.destroy = generator_destroy;
+  gen->base.callback = NULL;
+  gen->base.trap_data = NULL;
+  gen->base.has_stable_strs = FALSE;
+  gen->template_text = NULL;
+  gen->tmpl = NULL;
+  gen->vars = g_ptr_array_new ();
+  gen->seqno = 0;
+  gen->is_done = FALSE;
+  gen->args = NULL;
+  gen->arg_lens = NULL;
+  return &gen->base;
+}
+
+void
+generator_source_set_template (Source     *source,
+                               const char *command_template)
+{
+  SourceGenerator *gen = (SourceGenerator *) source;
+  g_assert (gen->tmpl == NULL);
+  g_free (gen->template_text);
+  gen->template_text = g_strdup (command_template);
+}
+
+static GeneratorVar *
+add_var (Source     *source,
+         const char *name)
+{
+  SourceGenerator *gen = (SourceGenerator *) source;
+  GeneratorVar *var = g_slice_new (GeneratorVar);
+  g_assert (gen->tmpl == NULL);
+  var->name = g_strdup (name);
+  var->start = var->step = 0;
+  var->values = NULL;
+  var->n_values = 0;
+  var->index = 0;
+  g_ptr_array_add (gen->vars, var);
+  return var;
+}
+
+void
+generator_source_add_range (Source     *source,
+                            const char *name,
+                            gint64      start,
+                            gint64      end,
+                            gint64      step)
+{
+  GeneratorVar *var = add_var (source, name);
+  g_assert (step != 0);
+  var->start = start;
+  var->step = step;
+  if (step > 0 && end > start)
+    var->n_values = ((guint64) (end - start) + step - 1) / step;
+  else if (step < 0 && end < start)
+    var->n_values = ((guint64) (start - end) - step - 1) / -step;
+}
+
+void
+generator_source_add_list (Source     *source,
+                           const char *name,
+                           char      **values)
+{
+  GeneratorVar *var = add_var (source, name);
+  var->values = g_strdupv (values);
+  var->n_values = g_strv_length (values);
+}
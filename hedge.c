@@ -0,0 +1,407 @@
+#include <signal.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "parallelizer-private.h"
+#include "child-watch.h"
+
+#define CHECK_INTERVAL_MS       1000
+
+/* a class's median isn't trusted until this many of its tasks have succeeded */
+#define MIN_SAMPLES             3
+
+#define READ_SIZE               65536
+
+typedef struct _Hedge Hedge;
+typedef struct _HedgeClass HedgeClass;
+typedef struct _HedgeTask HedgeTask;
+typedef struct _HedgeCopy HedgeCopy;
+
+struct _Hedge
+{
+  System *system;
+  double factor;
+  guint timeout_id;
+  GHashTable *classes;          /* by key */
+  GPtrArray *running;           /* HedgeTasks */
+  unsigned n_copies;            /* that haven't been reaped */
+};
+
+struct _HedgeClass
+{
+  guint64 key;                  /* see history_get_class_key() */
+  GArray *durations;            /* doubles:  seconds, of its successes */
+  gboolean is_sorted;
+};
+
+struct _HedgeTask
+{
+  Hedge *hedge;
+  Task *task;
+  HedgeClass *class;
+  GByteArray *output;
+  HedgeCopy *copy;              /* or NULL */
+};
+
+struct _HedgeCopy
+{
+  Hedge *hedge;
+
+  /* NULL once it has lost */
+  HedgeTask *ht;
+
+  gint64 start_time;
+  int slot;
+  pid_t pid;                    /* -1 once reaped */
+  int stdin_fd;                 /* left open, like a task's */
+  int stdout_fd;
+  GSourceFD *stdout_source;
+  int stderr_fd;
+  GSourceFD *stderr_source;
+  GByteArray *output;
+
+  TaskTerminationType termination_type;
+  int termination_info;
+  guint64 cpu_usecs;
+  long max_rss;
+};
+
+static int
+compare_doubles (gconstpointer a,
+                 gconstpointer b)
+{
+  double da = * (const double *) a;
+  double db = * (const double *) b;
+  return da < db ? -1 : da > db ? 1 : 0;
+}
+
+static double
+get_median (HedgeClass *class)
+{
+  if (!class->is_sorted)
+    {
+      g_array_sort (class->durations, compare_doubles);
+      class->is_sorted = TRUE;
+    }
+  return g_array_index (class->durations, double, class->durations->len / 2);
+}
+
+static void
+add_duration (HedgeClass         *class,
+              TaskTerminationType type,
+              int                 info,
+              gint64              start_time)
+{
+  double duration;
+  if (type != TASK_TERMINATION_EXIT || info != 0)
+    return;
+  duration = (g_get_monotonic_time () - start_time) / 1e6;
+  g_array_append_val (class->durations, duration);
+  class->is_sorted = FALSE;
+}
+
+static void
+hedge_task_free (HedgeTask *ht)
+{
+  g_ptr_array_remove_fast (ht->hedge->running, ht);
+  g_byte_array_free (ht->output, TRUE);
+  g_slice_free (HedgeTask, ht);
+}
+
+void
+hedge_capture_output (Task         *task,
+                      gboolean      is_stderr,
+                      const guint8 *data,
+                      unsigned      len)
+{
+  output_records_add (task->hedge->output, is_stderr, data, len);
+}
+
+void
+hedge_task_finished (Task *task)
+{
+  HedgeTask *ht = task->hedge;
+  task->hedge = NULL;
+  add_duration (ht->class,
+                task->info.running.termination_type,
+                task->info.running.termination_info,
+                task->start_time);
+  if (ht->copy != NULL)
+    {
+      /* it is reaped, and freed, in the usual way */
+      ht->copy->ht = NULL;
+      if (ht->copy->pid > 0)
+        kill (ht->copy->pid, SIGKILL);
+    }
+  task_replay_output (task, ht->output->data, ht->output->len);
+  hedge_task_free (ht);
+}
+
+/* The copy has finished first:  it takes the task's place. */
+static void
+copy_wins (HedgeCopy *copy)
+{
+  HedgeTask *ht = copy->ht;
+  Task *task = ht->task;
+  copy->ht = NULL;
+  if (task->info.running.pid > 0)
+    kill (task->info.running.pid, SIGKILL);
+  task_abandon_process (task);
+  task->hedge = NULL;
+  task->cpu_usecs = copy->cpu_usecs;
+  task->max_rss = copy->max_rss;
+  add_duration (ht->class, copy->termination_type, copy->termination_info,
+                copy->start_time);
+  copy->hedge->system->stats.n_hedge_wins++;
+  task_replay_output (task, copy->output->data, copy->output->len);
+  hedge_task_free (ht);
+  task_done (task, copy->termination_type, copy->termination_info);
+}
+
+static void
+check_if_copy_done (HedgeCopy *copy)
+{
+  Hedge *hedge = copy->hedge;
+  if (copy->pid >= 0 || copy->stdout_fd >= 0 || copy->stderr_fd >= 0)
+    return;
+  close (copy->stdin_fd);
+  slots_release (hedge->system, copy->slot);
+  hedge->n_copies--;
+  if (copy->ht != NULL)
+    copy_wins (copy);
+  g_byte_array_free (copy->output, TRUE);
+  g_slice_free (HedgeCopy, copy);
+}
+
+/* Returns FALSE at end-of-file. */
+static gboolean
+read_copy_output (HedgeCopy *copy,
+                  int        fd,
+                  gboolean   is_stderr)
+{
+  guint8 buf[READ_SIZE];
+  ssize_t read_rv;
+  do
+    read_rv = read (fd, buf, sizeof (buf));
+  while (read_rv < 0 && errno == EINTR);
+  if (read_rv < 0)
+    {
+      if (errno == EAGAIN)
+        return TRUE;
+      g_error ("error reading from a copy's %s file-descriptor: %s",
+               is_stderr ? "stderr" : "stdout", g_strerror (errno));
+    }
+  if (read_rv == 0)
+    return FALSE;
+
+  /* a copy that has lost is merely drained */
+  if (copy->ht != NULL)
+    output_records_add (copy->output, is_stderr, buf, read_rv);
+  return TRUE;
+}
+
+static gboolean
+handle_copy_stdout_readable (void *data)
+{
+  HedgeCopy *copy = data;
+  if (!read_copy_output (copy, copy->stdout_fd, FALSE))
+    {
+      g_source_fd_destroy (copy->stdout_source);
+      copy->stdout_source = NULL;
+      close (copy->stdout_fd);
+      copy->stdout_fd = -1;
+      check_if_copy_done (copy);
+      return FALSE;
+    }
+  return TRUE;
+}
+
+static gboolean
+handle_copy_stderr_readable (void *data)
+{
+  HedgeCopy *copy = data;
+  if (!read_copy_output (copy, copy->stderr_fd, TRUE))
+    {
+      g_source_fd_destroy (copy->stderr_source);
+      copy->stderr_source = NULL;
+      close (copy->stderr_fd);
+      copy->stderr_fd = -1;
+      check_if_copy_done (copy);
+      return FALSE;
+    }
+  return TRUE;
+}
+
+static void
+handle_copy_terminated (GPid                 pid,
+                        gint                 status,
+                        const struct rusage *usage,
+                        gpointer             data)
+{
+  HedgeCopy *copy = data;
+  if (usage != NULL)
+    {
+      SystemStats *stats = &copy->hedge->system->stats;
+      copy->cpu_usecs = usage->ru_utime.tv_sec * G_GUINT64_CONSTANT (1000000)
+                      + usage->ru_utime.tv_usec
+                      + usage->ru_stime.tv_sec * G_GUINT64_CONSTANT (1000000)
+                      + usage->ru_stime.tv_usec;
+      copy->max_rss = usage->ru_maxrss;
+      stats->child_cpu_usecs += copy->cpu_usecs;
+      if (copy->max_rss > stats->child_max_rss)
+        stats->child_max_rss = copy->max_rss;
+    }
+  decode_wait_status (status, &copy->termination_type, &copy->termination_info);
+  copy->pid = -1;
+  check_if_copy_done (copy);
+}
+
+static void
+start_copy (Hedge     *hedge,
+            HedgeTask *ht)
+{
+  System *system = hedge->system;
+  HedgeCopy *copy = g_slice_new0 (HedgeCopy);
+  int stdin_pipe[2], stdout_pipe[2], stderr_pipe[2];
+
+  system_make_pipe (stdin_pipe);
+  system_make_pipe (stdout_pipe);
+  system_make_pipe (stderr_pipe);
+  fcntl (stdout_pipe[0], F_SETFL, fcntl (stdout_pipe[0], F_GETFL) | O_NONBLOCK);
+  fcntl (stderr_pipe[0], F_SETFL, fcntl (stderr_pipe[0], F_GETFL) | O_NONBLOCK);
+
+  copy->hedge = hedge;
+  copy->ht = ht;
+  copy->start_time = g_get_monotonic_time ();
+  copy->slot = slots_acquire (system, ht->task);
+  copy->pid = system_spawn_process (system, ht->task->str,
+                                    stdin_pipe[0], stdout_pipe[1],
+                                    stderr_pipe[1], -1, copy->slot);
+  system->stats.n_spawned++;
+  close (stdin_pipe[0]);
+  close (stdout_pipe[1]);
+  close (stderr_pipe[1]);
+  copy->stdin_fd = stdin_pipe[1];
+  copy->stdout_fd = stdout_pipe[0];
+  copy->stderr_fd = stderr_pipe[0];
+  copy->output = g_byte_array_new ();
+  copy->stdout_source = g_source_fd_new (copy->stdout_fd, G_IO_IN,
+                                         handle_copy_stdout_readable, copy);
+  copy->stderr_source = g_source_fd_new (copy->stderr_fd, G_IO_IN,
+                                         handle_copy_stderr_readable, copy);
+  child_watch_add (copy->pid, handle_copy_terminated, copy);
+  ht->copy = copy;
+  hedge->n_copies++;
+  system->stats.n_hedged++;
+}
+
+static gboolean
+handle_hedge_timeout (gpointer data)
+{
+  Hedge *hedge = data;
+  System *system = hedge->system;
+  gint64 now;
+  unsigned i;
+
+  /* only slots that nothing else could use */
+  if (system->n_unstarted_tasks > 0
+   || system->batch_items->len > 0
+   || system->n_open_sources > 0)
+    return TRUE;
+  now = g_get_monotonic_time ();
+  for (i = 0; i < hedge->running->len; i++)
+    {
+      HedgeTask *ht = hedge->running->pdata[i];
+      double elapsed, median;
+      if (system->n_running_tasks + hedge->n_copies >= system->max_running_tasks)
+        break;
+      if (ht->copy != NULL || ht->class->durations->len < MIN_SAMPLES)
+        continue;
+      elapsed = (now - ht->task->start_time) / 1e6;
+      median = get_median (ht->class);
+      if (elapsed <= hedge->factor * median)
+        continue;
+      g_message ("hedge: task %u has run %.1fs (its class's median is %.1fs):  "
+                 "starting a copy",
+                 ht->task->task_index, elapsed, median);
+      start_copy (hedge, ht);
+    }
+  return TRUE;
+}
+
+static void
+hedge__handle_started (Task           *task,
+                       const GTimeVal *current_time,
+                       const char     *cmdline,
+                       gpointer        handler_data)
+{
+  Hedge *hedge = handler_data;
+  HedgeClass *class;
+  HedgeTask *ht;
+  guint64 key;
+
+  /* its output isn't held back, since it won't be copied */
+  if (task->info.running.worker != NULL || task->needs != NULL
+   || task->from_cache)
+    return;
+
+  key = history_get_class_key (hedge->system, cmdline);
+  class = g_hash_table_lookup (hedge->classes, &key);
+  if (class == NULL)
+    {
+      class = g_slice_new (HedgeClass);
+      class->key = key;
+      class->durations = g_array_new (FALSE, FALSE, sizeof (double));
+      class->is_sorted = TRUE;
+      g_hash_table_insert (hedge->classes, &class->key, class);
+    }
+  ht = g_slice_new (HedgeTask);
+  ht->hedge = hedge;
+  ht->task = task;
+  ht->class = class;
+  ht->output = g_byte_array_new ();
+  ht->copy = NULL;
+  g_ptr_array_add (hedge->running, ht);
+  task->hedge = ht;
+}
+
+static void
+hedge__all_done (System         *system,
+                 const GTimeVal *current_time,
+                 gpointer        handler_data)
+{
+  Hedge *hedge = handler_data;
+  if (hedge->timeout_id != 0)
+    {
+      g_source_remove (hedge->timeout_id);
+      hedge->timeout_id = 0;
+    }
+}
+
+static SystemTrapFuncs hedge_funcs =
+{
+  hedge__handle_started,
+  NULL,
+  NULL,
+  NULL,
+  hedge__all_done
+};
+
+void
+system_set_hedge (System *system,
+                  double  factor)
+{
+  Hedge *hedge;
+  g_return_if_fail (system->hedge == NULL);
+  hedge = g_slice_new (Hedge);
+  hedge->system = system;
+  hedge->factor = factor;
+  hedge->classes = g_hash_table_new (g_int64_hash, g_int64_equal);
+  hedge->running = g_ptr_array_new ();
+  hedge->n_copies = 0;
+  hedge->timeout_id = g_timeout_add (CHECK_INTERVAL_MS,
+                                     handle_hedge_timeout, hedge);
+  system->hedge = hedge;
+  system_trap (system, &hedge_funcs, hedge);
+}
@@ -0,0 +1,417 @@
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "parallelizer-private.h"
+#include "cmd-template.h"
+
+#define HISTORY_MAGIC           "plinehs1"
+#define INITIAL_N_SLOTS         4096
+
+/* grow the table once it is 3/4 full, to keep the probes short */
+#define MAX_LOAD(n_slots)       ((n_slots) / 4 * 3)
+
+/* the weight of each new run in the averages */
+#define EWMA_ALPHA              0.3
+
+/* FNV-1a;  the classes' keys start from a different basis,
+   so that a command that is just a program has two keys */
+#define COMMAND_HASH_INIT       G_GUINT64_CONSTANT (0xcbf29ce484222325)
+#define CLASS_HASH_INIT         G_GUINT64_CONSTANT (0x84222325cbf29ce4)
+#define HASH_PRIME              G_GUINT64_CONSTANT (0x100000001b3)
+
+typedef struct _HistoryHeader HistoryHeader;
+struct _HistoryHeader
+{
+  char magic[8];
+  guint32 n_slots;              /* a power of 2 */
+  guint32 n_used;
+};
+
+/* the file is the header, then the slots */
+typedef struct _HistoryEntry HistoryEntry;
+struct _HistoryEntry
+{
+  guint64 key;                  /* 0 if the slot is free */
+  float duration;               /* seconds */
+  float peak_rss;               /* kilobytes;  0 if unknown */
+  guint32 n_runs;
+  guint32 reserved;
+};
+
+typedef struct _History History;
+struct _History
+{
+  char *filename;
+  int fd;
+  HistoryHeader *header;        /* the mapping, or NULL if it failed */
+  gsize map_size;
+  guint32 n_slots;              /* as mapped */
+};
+
+#define HISTORY_ENTRIES(header)  ((HistoryEntry *) ((header) + 1))
+
+static gsize
+get_file_size (guint32 n_slots)
+{
+  return sizeof (HistoryHeader) + (gsize) n_slots * sizeof (HistoryEntry);
+}
+
+static guint64
+hash_bytes (guint64     hash,
+            const char *data,
+            gsize       len)
+{
+  gsize i;
+  for (i = 0; i < len; i++)
+    {
+      hash ^= (guchar) data[i];
+      hash *= HASH_PRIME;
+    }
+  return hash;
+}
+
+static void
+unmap_history (History *history)
+{
+  if (history->header != NULL)
+    munmap (history->header, history->map_size);
+  history->header = NULL;
+}
+
+/* Map the file as it is now;  FALSE if it isn't a history file. */
+static gboolean
+map_history (History *history)
+{
+  struct stat stat_buf;
+  HistoryHeader *header;
+  guint32 n_slots;
+  unmap_history (history);
+  if (fstat (history->fd, &stat_buf) < 0
+   || stat_buf.st_size < (off_t) sizeof (HistoryHeader))
+    return FALSE;
+  header = mmap (NULL, stat_buf.st_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                 history->fd, 0);
+  if (header == MAP_FAILED)
+    return FALSE;
+  n_slots = header->n_slots;
+  if (memcmp (header->magic, HISTORY_MAGIC, sizeof (header->magic)) != 0
+   || n_slots == 0
+   || (n_slots & (n_slots - 1)) != 0
+   || get_file_size (n_slots) != (gsize) stat_buf.st_size)
+    {
+      munmap (header, stat_buf.st_size);
+      return FALSE;
+    }
+  history->header = header;
+  history->map_size = stat_buf.st_size;
+  history->n_slots = n_slots;
+  return TRUE;
+}
+
+/* Make the file the size of a table of 'n_slots', and write
+   its header.  The file is never shrunk:  other runs may have
+   it mapped, and would crash touching what was cut off. */
+static gboolean
+init_history_file (int     fd,
+                   guint32 n_slots)
+{
+  HistoryHeader header;
+  memcpy (header.magic, HISTORY_MAGIC, sizeof (header.magic));
+  header.n_slots = n_slots;
+  header.n_used = 0;
+  return ftruncate (fd, get_file_size (n_slots)) == 0
+      && pwrite (fd, &header, sizeof (header), 0) == sizeof (header);
+}
+
+/* Runs sharing the file take turns changing it, with flock():
+   growing the table rewrites all of it, and two runs adding to it
+   at once could take the same free slot.  Lookups don't lock:
+   the file is never shrunk, so the worst they can see is a table
+   being rehashed, and miss. */
+static gboolean
+lock_history (History *history)
+{
+  while (flock (history->fd, LOCK_EX) < 0)
+    if (errno != EINTR)
+      {
+        g_warning ("history %s: error locking: %s;  not updating it",
+                   history->filename, g_strerror (errno));
+        return FALSE;
+      }
+  return TRUE;
+}
+
+static void
+unlock_history (History *history)
+{
+  flock (history->fd, LOCK_UN);
+}
+
+/* Another run may have grown the table since we mapped it. */
+static gboolean
+check_mapping (History *history)
+{
+  if (history->header == NULL)
+    return FALSE;
+  if (history->header->n_slots == history->n_slots)
+    return TRUE;
+  if (map_history (history))
+    return TRUE;
+  g_warning ("history %s: the file has been corrupted;  not using it",
+             history->filename);
+  return FALSE;
+}
+
+/* The slot for 'key', or the free slot where it would go. */
+static HistoryEntry *
+probe (History *history,
+       guint64  key)
+{
+  HistoryEntry *entries = HISTORY_ENTRIES (history->header);
+  guint32 mask = history->n_slots - 1;
+  guint32 at = (guint32) (key ^ (key >> 32)) & mask;
+  while (entries[at].key != 0 && entries[at].key != key)
+    at = (at + 1) & mask;
+  return entries + at;
+}
+
+/* Double the table, and rehash what it had. */
+static gboolean
+grow_history (History *history)
+{
+  guint32 old_n_slots = history->n_slots;
+  HistoryEntry *old = g_new (HistoryEntry, old_n_slots);
+  guint32 n_used = 0;
+  guint32 i;
+  memcpy (old, HISTORY_ENTRIES (history->header),
+          old_n_slots * sizeof (HistoryEntry));
+  unmap_history (history);
+  if (!init_history_file (history->fd, old_n_slots * 2)
+   || !map_history (history))
+    {
+      g_warning ("history %s: error growing the table: %s;  not using it",
+                 history->filename, g_strerror (errno));
+      g_free (old);
+      unmap_history (history);
+      return FALSE;
+    }
+  memset (HISTORY_ENTRIES (history->header), 0,
+          history->n_slots * sizeof (HistoryEntry));
+  for (i = 0; i < old_n_slots; i++)
+    if (old[i].key != 0)
+      {
+        *probe (history, old[i].key) = old[i];
+        n_used++;
+      }
+  history->header->n_used = n_used;
+  g_free (old);
+  return TRUE;
+}
+
+static HistoryEntry *
+lookup_entry (History *history,
+              guint64  key)
+{
+  HistoryEntry *entry = probe (history, key);
+  return entry->key == 0 ? NULL : entry;
+}
+
+static HistoryEntry *
+lookup_or_add_entry (History *history,
+                     guint64  key)
+{
+  HistoryEntry *entry = probe (history, key);
+  if (entry->key != 0)
+    return entry;
+  if (history->header->n_used + 1 > MAX_LOAD (history->n_slots))
+    {
+      if (!grow_history (history))
+        return NULL;
+      entry = probe (history, key);
+    }
+  memset (entry, 0, sizeof (HistoryEntry));
+  entry->key = key;
+  history->header->n_used++;
+  return entry;
+}
+
+/* With a command template, the command is the template and the
+   argument, and its class is the template;  otherwise the command
+   is the command-line, and its class is the program. */
+static void
+get_keys (System     *system,
+          const char *input,
+          unsigned    len,
+          guint64     keys_out[2])
+{
+  unsigned i;
+  if (system->command_template != NULL)
+    {
+      const char *text = cmd_template_get_text (system->command_template);
+
+      /* with the NUL, so that the argument can't run into it */
+      gsize text_len = strlen (text) + 1;
+      keys_out[0] = hash_bytes (hash_bytes (COMMAND_HASH_INIT, text, text_len),
+                                input, len);
+      keys_out[1] = hash_bytes (CLASS_HASH_INIT, text, text_len);
+    }
+  else
+    {
+      while (len > 0 && (*input == ' ' || *input == '\t'))
+        {
+          input++;
+          len--;
+        }
+      for (i = 0; i < len && input[i] != ' ' && input[i] != '\t'; i++)
+        ;
+      keys_out[0] = hash_bytes (COMMAND_HASH_INIT, input, len);
+      keys_out[1] = hash_bytes (CLASS_HASH_INIT, input, i);
+    }
+
+  /* 0 is a free slot */
+  for (i = 0; i < 2; i++)
+    if (keys_out[i] == 0)
+      keys_out[i] = 1;
+}
+
+guint64
+history_lookup (System     *system,
+                const char *input,
+                unsigned    len,
+                guint64     keys_out[2])
+{
+  History *history = system->history;
+  HistoryEntry *entry;
+  unsigned i;
+  get_keys (system, input, len, keys_out);
+  if (!check_mapping (history))
+    return 0;
+  for (i = 0; i < 2; i++)
+    if ((entry = lookup_entry (history, keys_out[i])) != NULL)
+      return MAX ((guint64) (entry->duration * 1e6), 1);
+  return 0;
+}
+
+guint64
+history_get_class_key (System     *system,
+                       const char *cmdline)
+{
+  guint64 keys[2];
+  get_keys (system, cmdline, strlen (cmdline), keys);
+  return keys[1];
+}
+
+static void
+update_average (float  *average,
+                double  value)
+{
+  if (*average == 0)
+    *average = value;
+  else
+    *average += EWMA_ALPHA * (value - *average);
+}
+
+/* Failures are left out:  they tend to be quick;
+   and so are results from the result cache. */
+static void
+history__ended (Task               *task,
+                const GTimeVal     *current_time,
+                TaskTerminationType termination_type,
+                int                 termination_info,
+                gpointer            handler_data)
+{
+  History *history = handler_data;
+  double duration;
+  unsigned i;
+  if (task->history_keys[0] == 0
+   || task->from_cache
+   || termination_type != TASK_TERMINATION_EXIT
+   || termination_info != 0
+   || history->header == NULL
+   || !lock_history (history))
+    return;
+  duration = (g_get_monotonic_time () - task->start_time) / 1e6;
+  for (i = 0; i < 2 && check_mapping (history); i++)
+    {
+      HistoryEntry *entry = lookup_or_add_entry (history, task->history_keys[i]);
+      if (entry == NULL)
+        break;
+      update_average (&entry->duration, MAX (duration, 1e-6));
+      if (task->max_rss > 0)
+        update_average (&entry->peak_rss, task->max_rss);
+      if (entry->n_runs < G_MAXUINT32)
+        entry->n_runs++;
+    }
+  unlock_history (history);
+}
+
+static void
+history__all_done (System         *system,
+                   const GTimeVal *current_time,
+                   gpointer        handler_data)
+{
+  History *history = handler_data;
+  unmap_history (history);
+}
+
+static SystemTrapFuncs history_funcs =
+{
+  NULL,
+  NULL,
+  NULL,
+  history__ended,
+  history__all_done
+};
+
+gboolean
+system_set_history (System     *system,
+                    const char *filename,
+                    GError    **error)
+{
+  History *history;
+  struct stat stat_buf;
+  int fd;
+  g_return_val_if_fail (system->history == NULL, FALSE);
+  fd = open (filename, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (fd < 0 || fstat (fd, &stat_buf) < 0)
+    {
+      g_set_error (error, PARALLELIZER_ERROR_DOMAIN_QUARK,
+                   PARALLELIZER_ERROR_OPEN,
+                   "could not open %s: %s", filename, g_strerror (errno));
+      if (fd >= 0)
+        close (fd);
+      return FALSE;
+    }
+  history = g_slice_new (History);
+  history->filename = g_strdup (filename);
+  history->fd = fd;
+  history->header = NULL;
+  history->map_size = 0;
+  history->n_slots = 0;
+
+  /* a new file is made a table;  anything else is left alone.
+     Check the size again once we hold the lock:  another run
+     may have just made it one. */
+  if (!lock_history (history)
+   || fstat (fd, &stat_buf) < 0
+   || (stat_buf.st_size == 0 && !init_history_file (fd, INITIAL_N_SLOTS))
+   || !map_history (history))
+    {
+      unlock_history (history);
+      g_set_error (error, PARALLELIZER_ERROR_DOMAIN_QUARK,
+                   PARALLELIZER_ERROR_OPEN,
+                   "%s is not a history file", filename);
+      close (fd);
+      g_free (history->filename);
+      g_slice_free (History, history);
+      return FALSE;
+    }
+  unlock_history (history);
+  system->history = history;
+  system_trap (system, &history_funcs, history);
+  return TRUE;
+}
@@ -0,0 +1,109 @@
+#include <string.h>
+#include "line-buffer.h"
+
+#define MIN_ALLOC       4096
+
+LineBuffer *
+line_buffer_new (char separator)
+{
+  LineBuffer *buffer = g_slice_new (LineBuffer);
+  buffer->data = NULL;
+  buffer->alloced = 0;
+  buffer->start = buffer->scan = buffer->end = 0;
+  buffer->separator = separator;
+  return buffer;
+}
+
+void
+line_buffer_free (LineBuffer *buffer)
+{
+  g_free (buffer->data);
+  g_slice_free (LineBuffer, buffer);
+}
+
+guint8 *
+line_buffer_get_write_space (LineBuffer *buffer,
+                             unsigned    min_space,
+                             unsigned   *space_out)
+{
+  if (buffer->start == buffer->end)
+    {
+      /* empty:  rewinding is free */
+      buffer->start = buffer->scan = buffer->end = 0;
+    }
+  if (buffer->alloced - buffer->end < min_space)
+    {
+      unsigned used = buffer->end - buffer->start;
+      if (buffer->start > 0 && buffer->alloced - used >= min_space)
+        {
+          /* compact */
+          memmove (buffer->data, buffer->data + buffer->start, used);
+          buffer->scan -= buffer->start;
+          buffer->end = used;
+          buffer->start = 0;
+        }
+      else
+        {
+          unsigned new_alloced = MAX (buffer->alloced, MIN_ALLOC);
+          while (new_alloced - buffer->end < min_space)
+            new_alloced *= 2;
+          buffer->data = g_realloc (buffer->data, new_alloced);
+          buffer->alloced = new_alloced;
+        }
+    }
+  *space_out = buffer->alloced - buffer->end;
+  return buffer->data + buffer->end;
+}
+
+void
+line_buffer_commit (LineBuffer *buffer,
+                    unsigned    len)
+{
+  g_assert (buffer->end + len <= buffer->alloced);
+  buffer->end += len;
+}
+
+void
+line_buffer_append (LineBuffer   *buffer,
+                    const guint8 *data,
+                    unsigned      len)
+{
+  unsigned space;
+  guint8 *at = line_buffer_get_write_space (buffer, len, &space);
+  memcpy (at, data, len);
+  buffer->end += len;
+}
+
+gboolean
+line_buffer_has_line (LineBuffer *buffer)
+{
+  guint8 *sep;
+  if (buffer->scan == buffer->end)
+    return FALSE;
+  sep = memchr (buffer->data + buffer->scan, buffer->separator,
+                buffer->end - buffer->scan);
+  if (sep == NULL)
+    {
+      buffer->scan = buffer->end;
+      return FALSE;
+    }
+  buffer->scan = sep - buffer->data;
+  return TRUE;
+}
+
+char *
+line_buffer_next_line (LineBuffer *buffer,
+                       unsigned   *len_out)
+{
+  char *line;
+  if (!line_buffer_has_line (buffer))
+    return NULL;
+
+  /* buffer->scan is at the separator */
+  line = (char *) buffer->data + buffer->start;
+  buffer->data[buffer->scan] = 0;
+  if (len_out)
+    *len_out = buffer->scan - buffer->start;
+  buffer->start = buffer->scan = buffer->scan + 1;
+  return line;
+}
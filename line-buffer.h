@@ -0,0 +1,42 @@
+
+#include <glib.h>
+
+/* A buffer that data is appended to and separator-terminated lines
+ * are taken from.  Taking a line only advances a cursor;  the data
+ * is moved to the front of the buffer only when more space is needed.
+ * Searching for the separator resumes where the last search stopped,
+ * so each byte is scanned once however it arrives.
+ */
+typedef struct _LineBuffer LineBuffer;
+struct _LineBuffer
+{
+  guint8 *data;
+  unsigned alloced;
+  unsigned start;               /* first unconsumed byte */
+  unsigned scan;                /* no separator in [start, scan) */
+  unsigned end;                 /* end of valid data */
+  char separator;
+};
+
+LineBuffer *line_buffer_new             (char          separator);
+void        line_buffer_free            (LineBuffer   *buffer);
+
+/* To read directly into the buffer:  get space for at least
+   'min_space' bytes, then commit however many were filled. */
+guint8     *line_buffer_get_write_space (LineBuffer   *buffer,
+                                         unsigned      min_space,
+                                         unsigned     *space_out);
+void        line_buffer_commit          (LineBuffer   *buffer,
+                                         unsigned      len);
+void        line_buffer_append          (LineBuffer   *buffer,
+                                         const guint8 *data,
+                                         unsigned      len);
+
+/* Returns the next complete line, with its separator replaced by NUL,
+   or NULL.  The line is valid until the buffer is next written to. */
+char       *line_buffer_next_line       (LineBuffer   *buffer,
+                                         unsigned     *len_out);
+gboolean    line_buffer_has_line        (LineBuffer   *buffer);
+
+/* bytes of an incomplete line */
+#define line_buffer_get_pending_len(buffer) ((buffer)->end - (buffer)->start)
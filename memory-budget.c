@@ -0,0 +1,536 @@
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <linux/magic.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "parallelizer-private.h"
+
+#define CGROUP_ROOT             "/sys/fs/cgroup"
+
+/* the prediction is the largest of the last N_PEAKS peaks */
+#define N_PEAKS                 32
+
+/* until a task has finished, each is assumed
+   to need 1/UNKNOWN_PEAK_DIVISOR of the budget */
+#define UNKNOWN_PEAK_DIVISOR    8
+
+/* while a task is held back, how often to see
+   whether the running tasks' memory has come down */
+#define RECHECK_INTERVAL_MS     250
+
+/* when we are interrupted, how long the tasks get to leave their
+   cgroups after the signal, and then after SIGKILL */
+#define SIGNAL_GRACE_MS         500
+
+typedef struct _MemoryBudget MemoryBudget;
+struct _MemoryBudget
+{
+  System *system;
+  guint64 budget;               /* bytes */
+
+  /* with cgroups:  the parent of the tasks' cgroups, and
+     where we were, if we had to move out of its way (or NULL) */
+  char *cgroup_path;
+  int cgroup_fd;                /* -1 without cgroups */
+  char *orig_cgroup_path;
+  gboolean moved_to_self;       /* into cgroup_path/self */
+  gboolean enabled_in_orig;     /* we enabled the controller there */
+  GPtrArray *cgroup_tasks;      /* running tasks that have a cgroup */
+
+  guint64 peaks[N_PEAKS];       /* bytes, a ring */
+  unsigned n_peaks;
+  unsigned next_peak;
+
+  guint recheck_id;
+  GSourceFD *signal_source;     /* with cgroups:  see catch_signals() */
+};
+
+/* written to by the handler of SIGINT and SIGTERM */
+static int signal_pipe[2] = { -1, -1 };
+
+static gboolean
+read_u64_at (int         dir_fd,
+             const char *name,
+             guint64    *value_out)
+{
+  char buf[64];
+  char *end;
+  ssize_t n;
+  int fd = openat (dir_fd, name, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return FALSE;
+  n = read (fd, buf, sizeof (buf) - 1);
+  close (fd);
+  if (n <= 0)
+    return FALSE;
+  buf[n] = 0;
+  *value_out = g_ascii_strtoull (buf, &end, 10);
+  return end != buf;
+}
+
+static gboolean
+write_cgroup_file (const char *dir,
+                   const char *name,
+                   const char *str)
+{
+  char *filename = g_strdup_printf ("%s/%s", dir, name);
+  int fd = open (filename, O_WRONLY | O_CLOEXEC);
+  int saved_errno;
+  gboolean rv = FALSE;
+  g_free (filename);
+  if (fd < 0)
+    return FALSE;
+  rv = write (fd, str, strlen (str)) >= 0;
+
+  /* for the caller's message */
+  saved_errno = errno;
+  close (fd);
+  errno = saved_errno;
+  return rv;
+}
+
+/* Our cgroup's directory, from the "0::PATH" line of /proc/self/cgroup;
+   NULL unless we are on cgroup v2. */
+static char *
+find_own_cgroup (void)
+{
+  struct statfs statfs_buf;
+  char *contents;
+  char **lines;
+  char *rv = NULL;
+  unsigned i;
+  if (!g_file_get_contents ("/proc/self/cgroup", &contents, NULL, NULL))
+    return NULL;
+  lines = g_strsplit (contents, "\n", 0);
+  for (i = 0; lines[i] != NULL; i++)
+    if (g_str_has_prefix (lines[i], "0::/"))
+      {
+        /* the root is "/", which would give "...cgroup/" */
+        const char *path = lines[i] + 3;
+        rv = strcmp (path, "/") == 0 ? g_strdup (CGROUP_ROOT)
+                                     : g_strconcat (CGROUP_ROOT, path, NULL);
+        break;
+      }
+  g_strfreev (lines);
+  g_free (contents);
+
+  /* on a hybrid system, CGROUP_ROOT may be a tmpfs of v1 hierarchies */
+  if (rv != NULL
+   && (statfs (rv, &statfs_buf) < 0 || statfs_buf.f_type != CGROUP2_SUPER_MAGIC))
+    {
+      g_free (rv);
+      rv = NULL;
+    }
+  return rv;
+}
+
+static gboolean
+has_memory_controller (const char *dir)
+{
+  char *filename = g_strdup_printf ("%s/cgroup.subtree_control", dir);
+  char *contents;
+  char **words;
+  gboolean rv = FALSE;
+  unsigned i;
+  if (g_file_get_contents (filename, &contents, NULL, NULL))
+    {
+      words = g_strsplit_set (contents, " \n", 0);
+      for (i = 0; words[i] != NULL; i++)
+        if (strcmp (words[i], "memory") == 0)
+          rv = TRUE;
+      g_strfreev (words);
+      g_free (contents);
+    }
+  g_free (filename);
+  return rv;
+}
+
+static gboolean
+enable_memory_controller (const char *dir)
+{
+  return has_memory_controller (dir)
+      || write_cgroup_file (dir, "cgroup.subtree_control", "+memory");
+}
+
+static void
+remove_cgroups (MemoryBudget *mb)
+{
+  if (mb->cgroup_fd >= 0)
+    {
+      close (mb->cgroup_fd);
+      mb->cgroup_fd = -1;
+    }
+  if (mb->orig_cgroup_path != NULL)
+    {
+      /* A cgroup with a controller enabled for its children can't
+         have processes of its own:  so before moving back, we take
+         back what we enabled, from the bottom up. */
+      char *self_path = g_strdup_printf ("%s/self", mb->cgroup_path);
+      if (has_memory_controller (mb->cgroup_path)
+       && !write_cgroup_file (mb->cgroup_path, "cgroup.subtree_control", "-memory"))
+        g_warning ("memory budget: error disabling the memory controller in %s: %s",
+                   mb->cgroup_path, g_strerror (errno));
+      if (mb->enabled_in_orig
+       && !write_cgroup_file (mb->orig_cgroup_path, "cgroup.subtree_control", "-memory"))
+        g_warning ("memory budget: error disabling the memory controller in %s: %s",
+                   mb->orig_cgroup_path, g_strerror (errno));
+      if (mb->moved_to_self
+       && !write_cgroup_file (mb->orig_cgroup_path, "cgroup.procs", "0"))
+        g_warning ("memory budget: error moving back to %s: %s",
+                   mb->orig_cgroup_path, g_strerror (errno));
+      else if (rmdir (self_path) < 0 && errno != ENOENT)
+        g_warning ("memory budget: error removing %s: %s",
+                   self_path, g_strerror (errno));
+      g_free (self_path);
+      g_free (mb->orig_cgroup_path);
+      mb->orig_cgroup_path = NULL;
+      mb->moved_to_self = FALSE;
+      mb->enabled_in_orig = FALSE;
+    }
+  if (mb->cgroup_path != NULL)
+    {
+      if (rmdir (mb->cgroup_path) < 0 && errno != ENOENT)
+        g_warning ("memory budget: error removing %s: %s",
+                   mb->cgroup_path, g_strerror (errno));
+      g_free (mb->cgroup_path);
+      mb->cgroup_path = NULL;
+    }
+}
+
+/* Send 'signo' to the processes in a task's cgroup (0 just counts
+   them);  returns how many there were. */
+static unsigned
+signal_cgroup (int dir_fd,
+               int signo)
+{
+  int fd = openat (dir_fd, "cgroup.procs", O_RDONLY | O_CLOEXEC);
+  FILE *fp = fd < 0 ? NULL : fdopen (fd, "r");
+  unsigned n = 0;
+  int pid;
+  if (fp == NULL)
+    {
+      if (fd >= 0)
+        close (fd);
+      return 0;
+    }
+  while (fscanf (fp, "%d", &pid) == 1)
+    {
+      if (signo != 0)
+        kill (pid, signo);
+      n++;
+    }
+  fclose (fp);
+  return n;
+}
+
+/* Pass 'signo' on to the running tasks, and wait a little for them
+   to go:  a cgroup can't be removed while it has processes in it. */
+static gboolean
+signal_tasks (MemoryBudget *mb,
+              int           signo)
+{
+  unsigned i, n_procs = 0;
+  int waited;
+  for (i = 0; i < mb->cgroup_tasks->len; i++)
+    {
+      Task *task = mb->cgroup_tasks->pdata[i];
+      signal_cgroup (task->cgroup_fd, signo);
+    }
+  for (waited = 0; waited <= SIGNAL_GRACE_MS; waited += 10)
+    {
+      n_procs = 0;
+      for (i = 0; i < mb->cgroup_tasks->len; i++)
+        {
+          Task *task = mb->cgroup_tasks->pdata[i];
+          n_procs += signal_cgroup (task->cgroup_fd, 0);
+        }
+      if (n_procs == 0)
+        break;
+      g_usleep (10000);
+    }
+  return n_procs == 0;
+}
+
+static void
+handle_signal (int signo)
+{
+  unsigned char c = signo;
+  int saved_errno = errno;
+
+  /* (if the pipe is full, a signal is already waiting) */
+  while (write (signal_pipe[1], &c, 1) < 0 && errno == EINTR)
+    ;
+  errno = saved_errno;
+}
+
+/* We were told to stop:  take the tasks, and then our cgroups, with us,
+   rather than leave pline.PID behind;  and then die of the signal. */
+static gboolean
+handle_signal_readable (gpointer data)
+{
+  MemoryBudget *mb = data;
+  unsigned char c;
+  int signo;
+  if (read (signal_pipe[0], &c, 1) != 1)
+    return TRUE;
+  signo = c;
+  if (!signal_tasks (mb, signo))
+    signal_tasks (mb, SIGKILL);
+  while (mb->cgroup_tasks->len > 0)
+    {
+      Task *task = mb->cgroup_tasks->pdata[0];
+      char name[32];
+      close (task->cgroup_fd);
+      task->cgroup_fd = -1;
+      g_ptr_array_remove_index_fast (mb->cgroup_tasks, 0);
+      g_snprintf (name, sizeof (name), "task.%u", task->task_index);
+      unlinkat (mb->cgroup_fd, name, AT_REMOVEDIR);
+    }
+  remove_cgroups (mb);
+  signal (signo, SIG_DFL);
+  raise (signo);
+  return FALSE;
+}
+
+/* The tasks' cgroups outlive us unless we remove them:  so while
+   we have them, SIGINT and SIGTERM are handled from the main loop,
+   through a pipe.  (The handlers are reset in the tasks by exec.) */
+static void
+catch_signals (MemoryBudget *mb)
+{
+  struct sigaction action;
+  system_make_pipe (signal_pipe);
+  fcntl (signal_pipe[1], F_SETFL,
+         fcntl (signal_pipe[1], F_GETFL, 0) | O_NONBLOCK);
+  mb->signal_source = g_source_fd_new (signal_pipe[0], G_IO_IN,
+                                       handle_signal_readable, mb);
+  memset (&action, 0, sizeof (action));
+  action.sa_handler = handle_signal;
+  action.sa_flags = SA_RESTART;
+  sigemptyset (&action.sa_mask);
+  sigaction (SIGINT, &action, NULL);
+  sigaction (SIGTERM, &action, NULL);
+}
+
+static void
+uncatch_signals (MemoryBudget *mb)
+{
+  if (mb->signal_source == NULL)
+    return;
+  signal (SIGINT, SIG_DFL);
+  signal (SIGTERM, SIG_DFL);
+  g_source_fd_destroy (mb->signal_source);
+  mb->signal_source = NULL;
+  close (signal_pipe[0]);
+  close (signal_pipe[1]);
+  signal_pipe[0] = signal_pipe[1] = -1;
+}
+
+/* Make our cgroup, with the memory controller enabled for its
+   children (the tasks'). */
+static gboolean
+setup_cgroups (MemoryBudget *mb)
+{
+  char *parent = find_own_cgroup ();
+  if (parent == NULL)
+    {
+      g_message ("memory budget: no cgroup v2, using rusage");
+      return FALSE;
+    }
+  mb->cgroup_path = g_strdup_printf ("%s/pline.%d", parent, (int) getpid ());
+  if (mkdir (mb->cgroup_path, 0755) < 0)
+    {
+      g_message ("memory budget: cannot create %s (%s), using rusage",
+                 mb->cgroup_path, g_strerror (errno));
+      g_free (mb->cgroup_path);
+      mb->cgroup_path = NULL;
+      g_free (parent);
+      return FALSE;
+    }
+
+  if (!enable_memory_controller (parent))
+    {
+      /* a cgroup with processes in it can't enable controllers for its
+         children, and we are in it:  move to a leaf of our own and retry */
+      char *self_path = g_strdup_printf ("%s/self", mb->cgroup_path);
+      mb->moved_to_self = mkdir (self_path, 0755) == 0
+                       && write_cgroup_file (self_path, "cgroup.procs", "0");
+      g_free (self_path);
+      mb->orig_cgroup_path = parent;
+      parent = NULL;
+      if (!mb->moved_to_self || !enable_memory_controller (mb->orig_cgroup_path))
+        goto no_controller;
+      mb->enabled_in_orig = TRUE;
+    }
+  g_free (parent);
+  if (!enable_memory_controller (mb->cgroup_path))
+    goto no_controller;
+
+  mb->cgroup_fd = open (mb->cgroup_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (mb->cgroup_fd < 0)
+    goto no_controller;
+  catch_signals (mb);
+  return TRUE;
+
+no_controller:
+  g_message ("memory budget: the memory controller isn't delegated to us, using rusage");
+  remove_cgroups (mb);
+  return FALSE;
+}
+
+static guint64
+predict_peak (MemoryBudget *mb)
+{
+  guint64 rv = 0;
+  unsigned i;
+  if (mb->n_peaks == 0)
+    rv = mb->budget / UNKNOWN_PEAK_DIVISOR;
+  for (i = 0; i < mb->n_peaks; i++)
+    if (mb->peaks[i] > rv)
+      rv = mb->peaks[i];
+  mb->system->stats.memory_peak_estimate = rv;
+  return rv;
+}
+
+static gboolean
+handle_recheck_timeout (gpointer data)
+{
+  MemoryBudget *mb = data;
+  mb->recheck_id = 0;
+  system_refill_slots (mb->system);
+  return FALSE;
+}
+
+/* A task that is still below the prediction is counted
+   as needing all of it:  it hasn't got to its peak yet. */
+gboolean
+memory_budget_admit (System *system)
+{
+  MemoryBudget *mb = system->memory_budget;
+  guint64 predicted = predict_peak (mb);
+  guint64 in_use;
+  unsigned i;
+  if (system->n_running_tasks == 0)
+    return TRUE;
+  in_use = system->n_running_tasks > mb->cgroup_tasks->len
+         ? (guint64) (system->n_running_tasks - mb->cgroup_tasks->len) * predicted
+         : 0;
+  for (i = 0; i < mb->cgroup_tasks->len; i++)
+    {
+      Task *task = mb->cgroup_tasks->pdata[i];
+      guint64 current;
+      if (!read_u64_at (task->cgroup_fd, "memory.current", &current))
+        current = 0;
+      in_use += MAX (current, predicted);
+    }
+  if (in_use + predicted <= mb->budget)
+    return TRUE;
+
+  system->stats.n_memory_waits++;
+  if (mb->recheck_id == 0)
+    mb->recheck_id = g_timeout_add (RECHECK_INTERVAL_MS,
+                                    handle_recheck_timeout, mb);
+  return FALSE;
+}
+
+int
+memory_budget_new_task_cgroup (System *system,
+                               Task   *task)
+{
+  MemoryBudget *mb = system->memory_budget;
+  char name[32];
+  int fd;
+  if (mb->cgroup_fd < 0)
+    return -1;
+  g_snprintf (name, sizeof (name), "task.%u", task->task_index);
+  if (mkdirat (mb->cgroup_fd, name, 0755) < 0 && errno != EEXIST)
+    {
+      g_warning ("error creating cgroup %s/%s: %s",
+                 mb->cgroup_path, name, g_strerror (errno));
+      return -1;
+    }
+  fd = openat (mb->cgroup_fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd >= 0)
+    g_ptr_array_add (mb->cgroup_tasks, task);
+  return fd;
+}
+
+static void
+memory_budget__ended (Task               *task,
+                      const GTimeVal     *current_time,
+                      TaskTerminationType termination_type,
+                      int                 termination_info,
+                      gpointer            handler_data)
+{
+  MemoryBudget *mb = handler_data;
+  guint64 peak = 0;
+  if (task->cgroup_fd >= 0)
+    {
+      char name[32];
+
+      /* memory.peak is new in linux 5.19 */
+      if (!read_u64_at (task->cgroup_fd, "memory.peak", &peak))
+        peak = 0;
+      close (task->cgroup_fd);
+      task->cgroup_fd = -1;
+      g_ptr_array_remove_fast (mb->cgroup_tasks, task);
+
+      /* fails if the task left processes behind:  leave it to them */
+      g_snprintf (name, sizeof (name), "task.%u", task->task_index);
+      unlinkat (mb->cgroup_fd, name, AT_REMOVEDIR);
+    }
+  if (peak == 0)
+    peak = (guint64) task->max_rss * 1024;
+  if (peak == 0)
+    return;
+  mb->peaks[mb->next_peak] = peak;
+  mb->next_peak = (mb->next_peak + 1) % N_PEAKS;
+  if (mb->n_peaks < N_PEAKS)
+    mb->n_peaks++;
+}
+
+static void
+memory_budget__all_done (System         *system,
+                         const GTimeVal *current_time,
+                         gpointer        handler_data)
+{
+  MemoryBudget *mb = handler_data;
+  if (mb->recheck_id != 0)
+    {
+      g_source_remove (mb->recheck_id);
+      mb->recheck_id = 0;
+    }
+  uncatch_signals (mb);
+  remove_cgroups (mb);
+}
+
+static SystemTrapFuncs memory_budget_funcs =
+{
+  NULL,
+  NULL,
+  NULL,
+  memory_budget__ended,
+  memory_budget__all_done
+};
+
+void
+system_set_memory_budget (System  *system,
+                          guint64  budget,
+                          gboolean use_cgroups)
+{
+  MemoryBudget *mb;
+  g_return_if_fail (system->memory_budget == NULL);
+  mb = g_slice_new0 (MemoryBudget);
+  mb->system = system;
+  mb->budget = budget;
+  mb->cgroup_fd = -1;
+  mb->cgroup_tasks = g_ptr_array_new ();
+  if (use_cgroups)
+    setup_cgroups (mb);
+  system->memory_budget = mb;
+  system_trap (system, &memory_budget_funcs, mb);
+}
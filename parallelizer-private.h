@@ -0,0 +1,169 @@
+/* Internals shared by the files that implement the System.
+   Not for use by the frontends. */
+#include <sched.h>
+#include "parallelizer.h"
+
+struct _SystemTrap
+{
+  System *system;
+  SystemTrap *prev, *next;
+  SystemTrapFuncs *funcs;
+  void *trap_data;
+};
+
+typedef struct _InputQueue InputQueue;
+
+/* --- parallelizer.c --- */
+void  system_make_pipe     (int        *pipe_fds);
+pid_t system_spawn_process (System     *system,
+                            const char *cmdline,
+                            int         stdin_fd,
+                            int         stdout_fd,
+                            int         stderr_fd,
+                            int         cgroup_fd,
+                            int         slot);
+void  decode_wait_status   (int                  status,
+                            TaskTerminationType *type_out,
+                            int                 *info_out);
+
+void  task_run_started_traps (Task           *task);
+void  task_run_data_traps    (Task           *task,
+                              const GTimeVal *cur_time,
+                              gboolean        is_stderr,
+                              unsigned        len,
+                              const guint8   *data);
+void  task_run_lines_traps   (Task           *task,
+                              const GTimeVal *cur_time,
+                              gboolean        is_stderr,
+                              unsigned        n_lines,
+                              const TaskLine *lines);
+void  task_done              (Task               *task,
+                              TaskTerminationType type,
+                              int                 info);
+
+/* Pass output that was just appended to 'buffer' to the traps. */
+void  task_handle_output     (Task               *task,
+                              struct _LineBuffer *buffer,
+                              const guint8       *data,
+                              unsigned            len,
+                              gboolean            is_stderr,
+                              const GTimeVal     *cur_time);
+
+/* Output that is kept, to be passed on later, is kept as records:
+   a byte that is 1 for stderr, the length as a guint32, then the data. */
+#define OUTPUT_RECORD_HEADER_SIZE       5
+void     output_records_add       (GByteArray         *records,
+                                   gboolean            is_stderr,
+                                   const guint8       *data,
+                                   guint32             len);
+gboolean output_records_are_valid (const guint8       *records,
+                                   gsize               len);
+
+/* Give the traps the output in 'records', as if it had just been read. */
+void  task_replay_output     (Task               *task,
+                              const guint8       *records,
+                              gsize               len);
+
+/* for a task whose process has been killed:  see hedge.c */
+void  task_abandon_process   (Task               *task);
+
+/* start what can be started, as after a task ends */
+void  system_refill_slots    (System             *system);
+
+/* A queue of tasks that don't come from a source:  it shares the
+   slots like a source's, using the current input schedule.
+   Tasks given to a ranked queue start highest-rank first.
+   The system can't finish until the queue is closed. */
+InputQueue *system_open_input_queue  (System     *system,
+                                      gboolean    is_ranked);
+Task       *system_queue_task        (InputQueue *queue,
+                                      const char *cmdline,
+                                      guint64     rank);
+void        system_close_input_queue (InputQueue *queue);
+
+/* give a task that won't be run to the ended traps */
+void        system_skip_task         (System     *system,
+                                      const char *cmdline,
+                                      int         info);
+
+/* --- worker-pool.c --- */
+void  worker_pool_start_task (System *system,
+                              Task   *task);
+void  worker_pool_shutdown   (System *system);
+
+/* --- memory-budget.c --- */
+gboolean memory_budget_admit           (System *system);
+int      memory_budget_new_task_cgroup (System *system,
+                                        Task   *task);
+
+/* --- history.c --- */
+/* How long the command from 'input' is expected to take, in
+   microseconds, or 0 if unknown;  also its keys, for the Task. */
+guint64  history_lookup                (System     *system,
+                                        const char *input,
+                                        unsigned    len,
+                                        guint64     keys_out[2]);
+
+/* The class of a command-line, as above;  without a history, too. */
+guint64  history_get_class_key         (System     *system,
+                                        const char *cmdline);
+
+/* --- slots.c --- */
+/* A task gets the lowest free slot when it starts (in task->slot),
+   and gives it back when it ends;  task->slot is left alone,
+   for the ended traps.  (A hedged task's copy has a slot too.) */
+int      slots_acquire                 (System     *system,
+                                        Task       *task);
+void     slots_release                 (System     *system,
+                                        int         slot);
+
+/* The environment for a task in 'slot':  ours, with PLINE_SLOT. */
+char   **slots_get_environ             (System     *system,
+                                        int         slot);
+
+/* The cpus a task in 'slot' is pinned to;  FALSE if it isn't. */
+gboolean slots_get_cpus                (System     *system,
+                                        int         slot,
+                                        cpu_set_t  *cpus_out);
+
+/* --- resources.c --- */
+/* The needs of a task from 'str':  from its "{NAME=AMOUNT,...} "
+   prefix, which is skipped in *str_inout and *len_inout;  otherwise
+   a copy of 'default_needs'.  NULL if it needs nothing. */
+guint64       *resources_parse_prefix    (System         *system,
+                                          const char    **str_inout,
+                                          unsigned       *len_inout,
+                                          const guint64  *default_needs);
+const guint64 *resources_get_input_needs (System         *system);
+
+/* Whether a task may start:  see system_add_resource().  Looking
+   through the waiting tasks in order, 'blocked_inout' gathers
+   the resources that the tasks passed over are short of. */
+gboolean       resources_may_start       (System         *system,
+                                          const Task     *task,
+                                          guint64        *blocked_inout);
+void           resources_acquire         (Task           *task);
+
+/* also frees task->needs */
+void           resources_release         (Task           *task);
+
+/* --- hedge.c --- */
+/* While task->hedge is set, its output is kept, not passed on. */
+void     hedge_capture_output          (Task         *task,
+                                        gboolean      is_stderr,
+                                        const guint8 *data,
+                                        unsigned      len);
+
+/* The task's process has ended (before its copy's):  kill the copy,
+   and pass the task's output on.  Called before task_done(). */
+void     hedge_task_finished           (Task         *task);
+
+/* --- result-cache.c --- */
+/* If the task's result is in the cache, it is passed to the traps
+   from an idle callback, and this returns TRUE (and sets
+   task->from_cache);  otherwise the result may be stored. */
+gboolean result_cache_lookup           (System       *system,
+                                        Task         *task);
+
+/* --- dag.c --- */
+void     dag_task_done                 (Task   *task);
@@ -1,41 +1,223 @@
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <unistd.h>
 #include <string.h>
-#include "parallelizer.h"
+#include <signal.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <sched.h>
+#include "parallelizer-private.h"
+#include "uring-reader.h"
+#include "line-buffer.h"
+#include "child-watch.h"
+#include "cmd-template.h"
 
-static void do_input_source_trap (System *system);
-static void do_input_source_untrap (System *system);
-static void start_next_task (System *system);
+static void trap_input_sources (System *system);
+static void start_task (System *system,
+                        Task   *task);
 static void check_if_task_done (Task *task);
+static void handle_source (Source     *source,
+                           const char *str,
+                           unsigned    len,
+                           void       *trap_data);
 
 #define DEFAULT_MAX_UNSTARTED_TASKS     500
 #define DEFAULT_MAX_RUNNING_TASKS       32
 
+/* reading task output */
+#define MIN_READ_SIZE                   4096
+#define MAX_READ_SIZE                   (1024*1024)
+#define READ_BUDGET                     (1024*1024)
+#define DEFAULT_PIPE_SIZE               65536
+#define MAX_PIPE_SIZE                   (1024*1024)
+#define FULL_PIPES_BEFORE_GROWING       4
+
+/* room left for the environment, and slop, in a batch's command-line */
+#define BATCH_ARG_SLOP                  4096
+#define MAX_BATCH_BACKLOG               (1024*1024)
+
+/* how far into a queue to look for a task whose needs fit */
+#define RESOURCE_LOOKAHEAD              64
+
 #if 1
 # define DEBUG_ONLY(x)
 #else
 # define DEBUG_ONLY(x) x
 #endif
 
-struct _SystemTrap
+/* An input source (or the like), and its tasks that are waiting
+   for a slot:  see SourceSchedule. */
+struct _InputQueue
 {
   System *system;
-  SystemTrap *prev, *next;
-  SystemTrapFuncs *funcs;
-  void *trap_data;
+  Source *source;               /* NULL once it has given its last line */
+  gboolean is_open;             /* it may get more tasks */
+  gboolean is_trapped;
+  SourceSchedule schedule;
+
+  /* the waiting tasks:  in the order they came, or if 'is_ranked',
+     a heap with the highest-ranked first */
+  gboolean is_ranked;
+  GQueue tasks;
+  GPtrArray *heap;
+
+  /* what its tasks need, unless they say (see system_add_resource()) */
+  const guint64 *needs;
+
+  unsigned n_running;
+  unsigned deficit;             /* how many more it may start this turn */
 };
 
+static InputQueue *
+input_queue_new (System  *system,
+                 Source  *source,
+                 gboolean is_ranked)
+{
+  InputQueue *queue = g_slice_new (InputQueue);
+  queue->system = system;
+  queue->source = source;
+  queue->is_open = TRUE;
+  queue->is_trapped = FALSE;
+  queue->schedule = system->input_schedule;
+  queue->is_ranked = is_ranked;
+  g_queue_init (&queue->tasks);
+  queue->heap = is_ranked ? g_ptr_array_new () : NULL;
+  queue->needs = resources_get_input_needs (system);
+  queue->n_running = 0;
+  queue->deficit = 0;
+  return queue;
+}
+
+static unsigned
+input_queue_length (InputQueue *queue)
+{
+  return queue->is_ranked ? queue->heap->len : queue->tasks.length;
+}
+
+/* highest rank first;  then in the order they came */
+static gboolean
+task_goes_before (Task *a,
+                  Task *b)
+{
+  if (a->rank != b->rank)
+    return a->rank > b->rank;
+  return a->task_index < b->task_index;
+}
+
+static void
+input_queue_push (InputQueue *queue,
+                  Task       *task)
+{
+  GPtrArray *heap = queue->heap;
+  unsigned at;
+  if (!queue->is_ranked)
+    {
+      g_queue_push_tail (&queue->tasks, task);
+      return;
+    }
+  g_ptr_array_add (heap, task);
+  at = heap->len - 1;
+  while (at > 0 && task_goes_before (task, heap->pdata[(at - 1) / 2]))
+    {
+      heap->pdata[at] = heap->pdata[(at - 1) / 2];
+      at = (at - 1) / 2;
+    }
+  heap->pdata[at] = task;
+}
+
+/* Take the task at 'at':  in a ranked queue, its place in the heap. */
+static Task *
+input_queue_take (InputQueue *queue,
+                  unsigned    at)
+{
+  GPtrArray *heap = queue->heap;
+  Task *rv, *last;
+  if (!queue->is_ranked)
+    return g_queue_pop_nth (&queue->tasks, at);
+  rv = heap->pdata[at];
+  last = heap->pdata[heap->len - 1];
+  g_ptr_array_set_size (heap, heap->len - 1);
+  if (at == heap->len)
+    return rv;
+
+  /* put 'last' in the hole:  it may need to go up, or down */
+  while (at > 0 && task_goes_before (last, heap->pdata[(at - 1) / 2]))
+    {
+      heap->pdata[at] = heap->pdata[(at - 1) / 2];
+      at = (at - 1) / 2;
+    }
+  for (;;)
+    {
+      unsigned child = 2 * at + 1;
+      if (child >= heap->len)
+        break;
+      if (child + 1 < heap->len
+       && task_goes_before (heap->pdata[child + 1], heap->pdata[child]))
+        child++;
+      if (!task_goes_before (heap->pdata[child], last))
+        break;
+      heap->pdata[at] = heap->pdata[child];
+      at = child;
+    }
+  heap->pdata[at] = last;
+  return rv;
+}
+
+static Task *
+input_queue_pop (InputQueue *queue)
+{
+  return input_queue_take (queue, 0);
+}
+
+/* Where the first task is that may start now, or -1.  With
+   resources (see system_add_resource()), that is the first of the
+   next RESOURCE_LOOKAHEAD tasks whose needs fit, and that doesn't
+   take what an earlier task is short of:  so that a task that needs
+   a lot isn't passed over for ever.  A ranked queue is looked
+   through in heap order, which is roughly by rank. */
+static int
+input_queue_find_startable (InputQueue *queue)
+{
+  System *system = queue->system;
+  unsigned n = MIN (input_queue_length (queue), RESOURCE_LOOKAHEAD);
+  GList *link = queue->tasks.head;
+  guint64 blocked = 0;
+  unsigned i;
+  if (system->resources == NULL)
+    return n > 0 ? 0 : -1;
+  for (i = 0; i < n; i++)
+    {
+      Task *task;
+      if (queue->is_ranked)
+        task = queue->heap->pdata[i];
+      else
+        {
+          task = link->data;
+          link = link->next;
+        }
+      if (resources_may_start (system, task, &blocked))
+        return i;
+    }
+  return -1;
+}
+
 System *
 system_new (void)
 {
   System *system = g_slice_new (System);
   system->tasks = g_ptr_array_new ();
+  system->n_tasks = 0;
   system->next_unstarted_task = 0;
-  system->input_sources = g_ptr_array_new ();
-  system->cur_input_source = 0;
-  system->is_input_source_trapped = FALSE;
+  system->input_queues = g_ptr_array_new ();
+  system->n_open_sources = 0;
+  system->drr_cursor = 0;
+  system->input_schedule.weight = 1;
+  system->input_schedule.priority = 0;
+  system->input_schedule.max_running = 0;
+  system->is_all_done = FALSE;
+  system->keep_running = FALSE;
   system->first_message = system->last_message = NULL;
   system->log_fd = -1;
   system->max_unstarted_tasks = DEFAULT_MAX_UNSTARTED_TASKS;
@@ -44,120 +226,529 @@ system_new (void)
   system->n_running_tasks = 0;
   system->n_finished_tasks = 0;
   system->trap_list = NULL;
+  system->spawn_method = SYSTEM_SPAWN_POSIX_SPAWN;
+  system->direct_exec = TRUE;
+  system->worker_mode = SYSTEM_WORKERS_ONESHOT;
+  system->worker_pool = NULL;
+  system->io_engine = SYSTEM_IO_ENGINE_IO_URING;
+  system->batch_max_items = 0;
+  system->batch_max_bytes = 0;
+  system->batch_items = g_ptr_array_new ();
+  system->batch_items_len = 0;
+  system->tmp_lines = g_array_new (FALSE, FALSE, sizeof (TaskLine));
+  system->grow_pipes = FALSE;
+  system->input_separator = '\n';
+  system->command_template = NULL;
+  system->memory_budget = NULL;
+  system->history = NULL;
+  system->task_order = SYSTEM_TASK_ORDER_FIFO;
+  system->slots = NULL;
+  system->resources = NULL;
+  system->hedge = NULL;
+  system->result_cache = NULL;
+  memset (&system->stats, 0, sizeof (system->stats));
+
+  /* after the resources:  a queue takes their default needs */
+  system->batch_queue = input_queue_new (system, NULL, FALSE);
   return system;
 }
 
 static void
-set_close_on_exec (int fd)
+set_nonblocking (int fd)
 {
-  fcntl (fd, F_SETFL, fcntl (fd, F_GETFL, 0) | FD_CLOEXEC);
+  fcntl (fd, F_SETFL, fcntl (fd, F_GETFL, 0) | O_NONBLOCK);
 }
 
 static void
-do_pipe (int *pipe_fds)
+init_read_state (TaskReadState *state)
+{
+  state->read_size = MIN_READ_SIZE;
+  state->pipe_size = DEFAULT_PIPE_SIZE;
+  state->n_full_pipes = 0;
+}
+
+/* Both ends are close-on-exec:  the child only keeps
+   the ends that are dup2()d onto its stdin/stdout/stderr. */
+void
+system_make_pipe (int *pipe_fds)
 {
 retry_pipe:
-  if (pipe (pipe_fds) < 0)
+  if (pipe2 (pipe_fds, O_CLOEXEC) < 0)
     {
       if (errno == EINTR)
         goto retry_pipe;
       g_error ("error creating pipe: %s", g_strerror (errno));
     }
-  set_close_on_exec (pipe_fds[0]);
-  set_close_on_exec (pipe_fds[1]);
 }
 
 static void
-do_exec (const char *cmdline)
+init_shell_args (char **args, const char *cmdline)
 {
-  char *args[4];
   args[0] = "sh";
   args[1] = "-c";
   args[2] = (char *) cmdline;
   args[3] = NULL;
-  execv ("/bin/sh", args);
 }
 
+/* --- direct-exec fast path --- */
+
+/* Words that mean something different (or only exist)
+   when the shell runs them. */
+static const char *shell_words[] =
+{
+  "!", ".", ":", "[[", "alias", "bg", "break", "case", "cd", "command",
+  "continue", "do", "done", "elif", "else", "esac", "eval", "exec", "exit",
+  "export", "fc", "fg", "fi", "for", "function", "getopts", "hash", "if",
+  "in", "jobs", "local", "read", "readonly", "return", "select", "set",
+  "shift", "source", "then", "time", "times", "trap", "type", "ulimit",
+  "umask", "unalias", "unset", "until", "wait", "while"
+};
+
 static gboolean
-handle_stdouterr_readable (Task       *task,
-                           int         fd,
-                           GByteArray *buffer,
-                           gboolean    is_stderr)
+is_shell_word (const char *word)
 {
-  char *newline = memchr (buffer->data, '\n', buffer->len);
-  gboolean got_eof = FALSE;
-  GTimeVal cur_time;
-  g_get_current_time (&cur_time);
-  if (newline == NULL)
+  unsigned i;
+  for (i = 0; i < G_N_ELEMENTS (shell_words); i++)
+    if (strcmp (word, shell_words[i]) == 0)
+      return TRUE;
+  return FALSE;
+}
+
+/* Characters that make the shell do something besides
+   splitting words, when they occur outside of quotes. */
+static gboolean
+is_shell_metachar (char c)
+{
+  return strchr ("|&;<>()$`\\\"'*?[]#~={}!\n\r", c) != NULL;
+}
+
+/* Split a command-line that the shell would merely split into words
+   (plain words, plus '...' and "..." without expansions in them).
+   Returns NULL if the command-line needs /bin/sh;
+   otherwise the argv, to be freed with g_strfreev(). */
+static char **
+parse_simple_cmdline (const char *cmdline)
+{
+  GPtrArray *words = g_ptr_array_new ();
+  GString *word = NULL;
+  const char *at = cmdline;
+
+  for (;;)
     {
-      unsigned old_len = buffer->len;
-      ssize_t read_rv;
-      g_byte_array_set_size (buffer, old_len + 4096);
-      read_rv = read (fd, buffer->data + old_len, buffer->len - old_len);
-      if (read_rv < 0)
+      if (*at == ' ' || *at == '\t' || *at == 0)
         {
-          g_error ("error reading from process %s file-descriptor: %s",
-                   is_stderr ? "stderr" : "stdin", g_strerror (errno));
+          if (word != NULL)
+            {
+              g_ptr_array_add (words, g_string_free (word, FALSE));
+              word = NULL;
+            }
+          if (*at == 0)
+            break;
+          at++;
+          continue;
         }
-      else if (read_rv == 0)
+      if (word == NULL)
+        word = g_string_new ("");
+      if (*at == '\'')
+        {
+          const char *end = strchr (at + 1, '\'');
+          if (end == NULL)
+            goto needs_shell;
+          g_string_append_len (word, at + 1, end - (at + 1));
+          at = end + 1;
+        }
+      else if (*at == '"')
         {
-          got_eof = TRUE;
-          g_byte_array_set_size (buffer, old_len);
+          const char *end = at + 1 + strcspn (at + 1, "\"$`\\!");
+          if (*end != '"')
+            goto needs_shell;
+          g_string_append_len (word, at + 1, end - (at + 1));
+          at = end + 1;
         }
+      else if (is_shell_metachar (*at))
+        goto needs_shell;
       else
+        g_string_append_c (word, *at++);
+    }
+
+  if (words->len == 0 || is_shell_word (words->pdata[0]))
+    goto needs_shell_no_word;
+  g_ptr_array_add (words, NULL);
+  return (char **) g_ptr_array_free (words, FALSE);
+
+needs_shell:
+  if (word != NULL)
+    g_string_free (word, TRUE);
+needs_shell_no_word:
+  g_ptr_array_add (words, NULL);
+  g_strfreev ((char **) g_ptr_array_free (words, FALSE));
+  return NULL;
+}
+
+/* Move the calling process into the cgroup whose directory is 'cgroup_fd'.
+   Only async-signal-safe calls:  do_child() uses it. */
+static void
+join_cgroup (int cgroup_fd)
+{
+  int fd = openat (cgroup_fd, "cgroup.procs", O_WRONLY | O_CLOEXEC);
+  if (fd >= 0)
+    {
+      if (write (fd, "0", 1) < 0)
         {
-          /* invoke traps */
-          SystemTrap *trap;
-          g_byte_array_set_size (buffer, old_len + read_rv);
-          for (trap = task->system->trap_list; trap; trap = trap->next)
-            {
-              if (trap->funcs->handle_data)
-                trap->funcs->handle_data (task, &cur_time,
-                                          is_stderr,
-                                          buffer->len - old_len,
-                                          buffer->data + old_len,
-                                          trap->trap_data);
-            }
+          /* stay where we are:  the task is merely unaccounted */
         }
+      close (fd);
+    }
+}
+
+/* Only async-signal-safe calls here:  after vfork()
+   this runs on the parent's stack.
+
+   If 'direct_args' is non-NULL, we try to exec it first;
+   if that fails, the shell gets to report the error. */
+static void
+do_child (int stdin_fd, int stdout_fd, int stderr_fd, int cgroup_fd,
+          char **direct_args, char **shell_args, char **envp)
+{
+  if (cgroup_fd >= 0)
+    join_cgroup (cgroup_fd);
+  dup2 (stdin_fd, STDIN_FILENO);
+  dup2 (stdout_fd, STDOUT_FILENO);
+  dup2 (stderr_fd, STDERR_FILENO);
+
+  /* we ignore SIGPIPE, but our children should not inherit that */
+  signal (SIGPIPE, SIG_DFL);
+
+  if (direct_args != NULL)
+    execvpe (direct_args[0], direct_args, envp);
+  execve ("/bin/sh", shell_args, envp);
+  _exit (127);
+}
+
+/* After the fact, for spawners that can't start the child in its cgroup:
+   whatever the child allocated before this stays charged to ours. */
+static void
+move_to_cgroup (pid_t pid,
+                int   cgroup_fd)
+{
+  char buf[32];
+  int len = g_snprintf (buf, sizeof (buf), "%d", (int) pid);
+  int fd = openat (cgroup_fd, "cgroup.procs", O_WRONLY | O_CLOEXEC);
+  if (fd < 0)
+    return;
+  if (write (fd, buf, len) < 0)
+    g_warning ("error moving process %d to its cgroup: %s",
+               (int) pid, g_strerror (errno));
+  close (fd);
+}
+
+static pid_t
+do_posix_spawn (int stdin_fd, int stdout_fd, int stderr_fd, int cgroup_fd,
+                char **direct_args, char **shell_args, char **envp)
+{
+  posix_spawn_file_actions_t actions;
+  posix_spawnattr_t attr;
+  sigset_t default_signals;
+  pid_t pid;
+  int rv = -1;
+
+  posix_spawn_file_actions_init (&actions);
+  posix_spawn_file_actions_adddup2 (&actions, stdin_fd, STDIN_FILENO);
+  posix_spawn_file_actions_adddup2 (&actions, stdout_fd, STDOUT_FILENO);
+  posix_spawn_file_actions_adddup2 (&actions, stderr_fd, STDERR_FILENO);
+
+  posix_spawnattr_init (&attr);
+  sigemptyset (&default_signals);
+  sigaddset (&default_signals, SIGPIPE);
+  posix_spawnattr_setsigdefault (&attr, &default_signals);
+#ifdef POSIX_SPAWN_SETCGROUP
+  /* glibc 2.41:  clone3(CLONE_INTO_CGROUP) */
+  if (cgroup_fd >= 0)
+    {
+      posix_spawnattr_setcgroup_np (&attr, cgroup_fd);
+      posix_spawnattr_setflags (&attr, POSIX_SPAWN_SETSIGDEF
+                                     | POSIX_SPAWN_SETCGROUP);
     }
+  else
+#endif
+  posix_spawnattr_setflags (&attr, POSIX_SPAWN_SETSIGDEF);
+
+  if (direct_args != NULL)
+    rv = posix_spawnp (&pid, direct_args[0], &actions, &attr,
+                       direct_args, envp);
 
-  if (newline == NULL)
-    newline = memchr (buffer->data, '\n', buffer->len);
+  /* if the program couldn't be run directly,
+     let the shell produce the usual error message and exit status. */
+  if (rv != 0)
+    rv = posix_spawn (&pid, "/bin/sh", &actions, &attr, shell_args, envp);
+  posix_spawnattr_destroy (&attr);
+  posix_spawn_file_actions_destroy (&actions);
+  if (rv != 0)
+    g_error ("error spawning process: %s", g_strerror (rv));
+#ifndef POSIX_SPAWN_SETCGROUP
+  if (cgroup_fd >= 0)
+    move_to_cgroup (pid, cgroup_fd);
+#endif
+  return pid;
+}
 
-  /* invoke traps */
-  while (newline != NULL)
+/* Start a process running 'cmdline' (or, if NULL, a shell reading
+   commands from stdin) with the given fds as its stdin, stdout and stderr.
+   The fds must be close-on-exec.  If 'cgroup_fd' isn't -1, it is the
+   directory of the cgroup the process is to run in.  If 'slot' isn't -1,
+   the process gets PLINE_SLOT, and is pinned to the slot's cpus. */
+pid_t
+system_spawn_process (System     *system,
+                      const char *cmdline,
+                      int         stdin_fd,
+                      int         stdout_fd,
+                      int         stderr_fd,
+                      int         cgroup_fd,
+                      int         slot)
+{
+  extern char **environ;
+  char *shell_args[4];
+  char **direct_args = NULL;
+  char **envp = slot < 0 ? environ : slots_get_environ (system, slot);
+  cpu_set_t slot_cpus, our_cpus;
+  gboolean is_pinned = FALSE;
+  pid_t pid;
+  if (cmdline == NULL)
     {
-      SystemTrap *trap;
-      *newline = 0;
+      /* a shell that reads commands from its stdin */
+      shell_args[0] = "sh";
+      shell_args[1] = NULL;
+    }
+  else
+    init_shell_args (shell_args, cmdline);
+  if (cmdline != NULL && system->direct_exec)
+    direct_args = parse_simple_cmdline (cmdline);
+  if (direct_args != NULL)
+    system->stats.n_direct_exec++;
+  else if (cmdline != NULL)
+    system->stats.n_shell_exec++;
 
-      for (trap = task->system->trap_list; trap; trap = trap->next)
+  /* The child inherits our affinity:  so it starts on its cpus,
+     and its first allocations are on their node.  (Setting it
+     from here afterwards would race with the child.) */
+  if (slot >= 0 && slots_get_cpus (system, slot, &slot_cpus))
+    is_pinned = sched_getaffinity (0, sizeof (our_cpus), &our_cpus) == 0
+             && sched_setaffinity (0, sizeof (slot_cpus), &slot_cpus) == 0;
+
+  if (system->spawn_method == SYSTEM_SPAWN_POSIX_SPAWN)
+    pid = do_posix_spawn (stdin_fd, stdout_fd, stderr_fd, cgroup_fd,
+                          direct_args, shell_args, envp);
+  else
+    {
+retry_fork:
+      if (system->spawn_method == SYSTEM_SPAWN_VFORK)
+        pid = vfork ();
+      else
+        pid = fork ();
+      if (pid < 0)
+        {
+          if (errno == EINTR)
+            goto retry_fork;
+          g_error ("error forking: %s", g_strerror (errno));
+        }
+      else if (pid == 0)
         {
-          if (trap->funcs->handle_line)
-            trap->funcs->handle_line (task, &cur_time,
-                                      is_stderr,
-                                      (char*) buffer->data,
-                                      trap->trap_data);
+          /* child process */
+          do_child (stdin_fd, stdout_fd, stderr_fd, cgroup_fd,
+                    direct_args, shell_args, envp);
         }
+    }
+  if (is_pinned)
+    sched_setaffinity (0, sizeof (our_cpus), &our_cpus);
+  g_strfreev (direct_args);
+  return pid;
+}
 
-      g_byte_array_remove_range (buffer, 0, (newline+1) - (char*)buffer->data);
-      newline = memchr (buffer->data, '\n', buffer->len);
+/* Pass output that was just appended to 'buffer'
+   to the traps, then any complete lines. */
+void
+task_handle_output (Task           *task,
+                    LineBuffer     *buffer,
+                    const guint8   *data,
+                    unsigned        len,
+                    gboolean        is_stderr,
+                    const GTimeVal *cur_time)
+{
+  GArray *lines = task->system->tmp_lines;
+  TaskLine line;
+  if (task->hedge != NULL)
+    {
+      /* held back until we know whether its copy wins */
+      hedge_capture_output (task, is_stderr, data, len);
+      while (line_buffer_next_line (buffer, &line.len) != NULL)
+        ;
+      return;
     }
+  task_run_data_traps (task, cur_time, is_stderr, len, data);
+
+  /* the lines stay valid until the buffer is written to */
+  g_array_set_size (lines, 0);
+  while ((line.text = line_buffer_next_line (buffer, &line.len)) != NULL)
+    g_array_append_val (lines, line);
+  if (lines->len > 0)
+    task_run_lines_traps (task, cur_time, is_stderr,
+                          lines->len, (TaskLine *) lines->data);
+}
+
+void
+output_records_add (GByteArray   *records,
+                    gboolean      is_stderr,
+                    const guint8 *data,
+                    guint32       len)
+{
+  guint8 header[OUTPUT_RECORD_HEADER_SIZE];
+  header[0] = is_stderr ? 1 : 0;
+  memcpy (header + 1, &len, sizeof (len));
+  g_byte_array_append (records, header, sizeof (header));
+  g_byte_array_append (records, data, len);
+}
 
-  if (got_eof)
+gboolean
+output_records_are_valid (const guint8 *records,
+                          gsize         len)
+{
+  gsize at = 0;
+  while (at < len)
     {
-      return FALSE;
+      guint32 record_len;
+      if (len - at < OUTPUT_RECORD_HEADER_SIZE || records[at] > 1)
+        return FALSE;
+      memcpy (&record_len, records + at + 1, sizeof (record_len));
+      at += OUTPUT_RECORD_HEADER_SIZE;
+      if (len - at < record_len)
+        return FALSE;
+      at += record_len;
     }
   return TRUE;
 }
 
+void
+task_replay_output (Task         *task,
+                    const guint8 *records,
+                    gsize         len)
+{
+  LineBuffer *buffers[2];
+  GTimeVal cur_time;
+  gsize at = 0;
+  buffers[0] = line_buffer_new ('\n');
+  buffers[1] = line_buffer_new ('\n');
+  g_get_current_time (&cur_time);
+  while (at < len)
+    {
+      gboolean is_stderr = records[at];
+      guint32 record_len;
+      memcpy (&record_len, records + at + 1, sizeof (record_len));
+      at += OUTPUT_RECORD_HEADER_SIZE;
+      line_buffer_append (buffers[is_stderr], records + at, record_len);
+      task_handle_output (task, buffers[is_stderr], records + at, record_len,
+                          is_stderr, &cur_time);
+      at += record_len;
+    }
+  line_buffer_free (buffers[0]);
+  line_buffer_free (buffers[1]);
+}
+
+static void
+maybe_grow_pipe (int            fd,
+                 TaskReadState *state)
+{
+  int new_size;
+  if (state->pipe_size >= MAX_PIPE_SIZE)
+    return;
+  new_size = fcntl (fd, F_SETPIPE_SZ, state->pipe_size * 2);
+  if (new_size > 0)
+    state->pipe_size = new_size;
+  else
+    state->pipe_size = MAX_PIPE_SIZE;   /* not allowed: don't try again */
+}
+
+/* Read until EAGAIN, or until we have read READ_BUDGET bytes
+   so that one chatty task can't starve the others.
+   Returns FALSE at end-of-file. */
+static gboolean
+handle_stdouterr_readable (Task          *task,
+                           int            fd,
+                           GSourceFD     *source,
+                           LineBuffer    *buffer,
+                           TaskReadState *state,
+                           gboolean       is_stderr)
+{
+  unsigned total = 0;
+  GTimeVal cur_time;
+  g_get_current_time (&cur_time);
+  for (;;)
+    {
+      unsigned space;
+      guint8 *at = line_buffer_get_write_space (buffer, state->read_size, &space);
+      ssize_t read_rv = read (fd, at, state->read_size);
+      if (read_rv < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          if (errno == EAGAIN)
+            return TRUE;
+          g_error ("error reading from process %s file-descriptor: %s",
+                   is_stderr ? "stderr" : "stdout", g_strerror (errno));
+        }
+      else if (read_rv == 0)
+        return FALSE;
+      line_buffer_commit (buffer, read_rv);
+      task_handle_output (task, buffer, at, read_rv, is_stderr, &cur_time);
+
+      /* its traps may have paused the task's output (see
+         task_set_output_paused()):  then 'source' is destroyed */
+      if ((is_stderr ? task->info.running.stderr_source
+                     : task->info.running.stdout_source) != source)
+        return TRUE;
+
+      /* a chatty task gets bigger reads; a quiet one, smaller */
+      if ((unsigned) read_rv == state->read_size)
+        {
+          if (state->read_size < MAX_READ_SIZE)
+            state->read_size *= 2;
+        }
+      else if ((unsigned) read_rv < state->read_size / 4
+            && state->read_size > MIN_READ_SIZE)
+        state->read_size /= 2;
+
+      /* the task filled its pipe: it was probably blocked on us */
+      if ((unsigned) read_rv >= state->pipe_size)
+        {
+          if (++state->n_full_pipes >= FULL_PIPES_BEFORE_GROWING
+           && task->system->grow_pipes)
+            {
+              maybe_grow_pipe (fd, state);
+              state->n_full_pipes = 0;
+            }
+        }
+      else
+        state->n_full_pipes = 0;
+
+      total += read_rv;
+      if (total >= READ_BUDGET)
+        {
+          g_source_fd_still_ready (source);
+          return TRUE;
+        }
+    }
+}
+
 static gboolean
 handle_stdout_readable (void *data)
 {
   Task *task = data;
   if (!handle_stdouterr_readable (task, task->info.running.stdout_fd,
+                                  task->info.running.stdout_source,
                                   task->info.running.stdout_input_buffer,
+                                  &task->info.running.stdout_read_state,
                                   FALSE))
     {
+      g_source_fd_destroy (task->info.running.stdout_source);
       task->info.running.stdout_source = NULL;
       close (task->info.running.stdout_fd);
       task->info.running.stdout_fd = -1;
@@ -172,9 +763,12 @@ handle_stderr_readable (void *data)
 {
   Task *task = data;
   if (!handle_stdouterr_readable (task, task->info.running.stderr_fd,
+                                  task->info.running.stderr_source,
                                   task->info.running.stderr_input_buffer,
+                                  &task->info.running.stderr_read_state,
                                   TRUE))
     {
+      g_source_fd_destroy (task->info.running.stderr_source);
       task->info.running.stderr_source = NULL;
       close (task->info.running.stderr_fd);
       task->info.running.stderr_fd = -1;
@@ -183,16 +777,416 @@ handle_stderr_readable (void *data)
     }
   return TRUE;
 }
+
+/* io_uring engine: the reads have already been done for us */
+static void
+handle_uring_data (Task         *task,
+                   const guint8 *data,
+                   unsigned      len,
+                   gboolean      is_stderr)
+{
+  LineBuffer *buffer = is_stderr ? task->info.running.stderr_input_buffer
+                                 : task->info.running.stdout_input_buffer;
+  GTimeVal cur_time;
+  g_get_current_time (&cur_time);
+  line_buffer_append (buffer, data, len);
+  task_handle_output (task, buffer, data, len, is_stderr, &cur_time);
+}
+
+static void
+handle_stdout_uring_data (const guint8 *data,
+                          unsigned      len,
+                          void         *func_data)
+{
+  Task *task = func_data;
+  if (len == 0)
+    {
+      uring_reader_destroy (task->info.running.stdout_reader);
+      task->info.running.stdout_reader = NULL;
+      close (task->info.running.stdout_fd);
+      task->info.running.stdout_fd = -1;
+      check_if_task_done (task);
+    }
+  else
+    handle_uring_data (task, data, len, FALSE);
+}
+
+static void
+handle_stderr_uring_data (const guint8 *data,
+                          unsigned      len,
+                          void         *func_data)
+{
+  Task *task = func_data;
+  if (len == 0)
+    {
+      uring_reader_destroy (task->info.running.stderr_reader);
+      task->info.running.stderr_reader = NULL;
+      close (task->info.running.stderr_fd);
+      task->info.running.stderr_fd = -1;
+      check_if_task_done (task);
+    }
+  else
+    handle_uring_data (task, data, len, TRUE);
+}
+
+void
+task_run_data_traps (Task           *task,
+                     const GTimeVal *cur_time,
+                     gboolean        is_stderr,
+                     unsigned        len,
+                     const guint8   *data)
+{
+  SystemTrap *trap;
+  for (trap = task->system->trap_list; trap; trap = trap->next)
+    if (trap->funcs->handle_data)
+      trap->funcs->handle_data (task, cur_time, is_stderr, len, data,
+                                trap->trap_data);
+}
+
+void
+task_run_lines_traps (Task           *task,
+                      const GTimeVal *cur_time,
+                      gboolean        is_stderr,
+                      unsigned        n_lines,
+                      const TaskLine *lines)
+{
+  SystemTrap *trap;
+  unsigned i;
+  for (trap = task->system->trap_list; trap; trap = trap->next)
+    if (trap->funcs->handle_lines)
+      trap->funcs->handle_lines (task, cur_time, is_stderr, n_lines, lines,
+                                 trap->trap_data);
+    else if (trap->funcs->handle_line)
+      for (i = 0; i < n_lines; i++)
+        trap->funcs->handle_line (task, cur_time, is_stderr, lines[i].text,
+                                  trap->trap_data);
+}
+
+/* How much input has been read but not started,
+   and how much we let accumulate before we stop reading.
+   In batch mode, enough for two full batches per slot. */
+static unsigned
+get_backlog (System *system)
+{
+  return system->n_unstarted_tasks + system->batch_items->len;
+}
+
+static unsigned
+get_max_backlog (System *system)
+{
+  guint64 batching = (guint64) system->batch_max_items
+                   * system->max_running_tasks * 2;
+  return MAX (system->max_unstarted_tasks, MIN (batching, MAX_BATCH_BACKLOG));
+}
+
+/* The same for one input source:  the sources being read share
+   the backlog equally, except that batches are made from them all. */
+static unsigned
+get_queue_backlog (InputQueue *queue)
+{
+  System *system = queue->system;
+  return system->batch_max_items > 0 ? get_backlog (system)
+                                     : input_queue_length (queue);
+}
+
+static unsigned
+get_queue_max_backlog (InputQueue *queue)
+{
+  System *system = queue->system;
+  if (system->batch_max_items > 0 || system->n_open_sources <= 1)
+    return get_max_backlog (system);
+  return MAX (get_max_backlog (system) / system->n_open_sources, 1);
+}
+
+static Task *
+new_task (System *system)
+{
+  Task *task = g_slice_new (Task);
+  task->system = system;
+  task->task_index = system->n_tasks++;
+  task->str = NULL;
+  task->source = NULL;
+  task->queue = NULL;
+  task->rank = 0;
+  task->dag_node = NULL;
+  task->history_keys[0] = task->history_keys[1] = 0;
+  task->needs = NULL;
+  task->slice = NULL;
+  task->slice_len = 0;
+  task->batch_items = NULL;
+  task->n_batch_items = 0;
+  task->first_message = task->last_message = NULL;
+  task->state = TASK_WAITING;
+  task->slot = -1;
+  task->hedge = NULL;
+  task->from_cache = FALSE;
+  task->start_time = 0;
+  task->cpu_usecs = 0;
+  task->max_rss = 0;
+  task->cgroup_fd = -1;
+  if (!system->keep_running)
+    g_ptr_array_add (system->tasks, task);
+  return task;
+}
+
+/* A system that keeps running doesn't keep its tasks:
+   each is freed once its ended traps have run. */
+static void
+task_free (Task *task)
+{
+  g_free (task->str);
+  g_slice_free (Task, task);
+}
+
+/* Ranked queues need the task's rank set first. */
+static void
+queue_task (InputQueue *queue,
+            Task       *task)
+{
+  task->queue = queue;
+  input_queue_push (queue, task);
+  queue->system->n_unstarted_tasks += 1;
+}
+
+static gsize
+estimate_batch_len (System *system,
+                    unsigned n_items,
+                    gsize    items_len)
+{
+  if (system->command_template != NULL)
+    return cmd_template_estimate_len (system->command_template,
+                                      n_items, items_len);
+  else
+    return items_len + n_items;           /* newline-separated */
+}
+
+/* Make a task of the first of the batch_items, if it's time:
+   see system_set_batch(). */
+static gboolean
+maybe_queue_batch (System *system)
+{
+  unsigned n_pending = system->batch_items->len;
+  unsigned n_free = system->n_running_tasks < system->max_running_tasks
+                  ? system->max_running_tasks - system->n_running_tasks : 0;
+  unsigned max_n, n;
+  gsize len;
+  Task *task;
+
+  if (n_pending == 0 || n_free == 0)
+    return FALSE;
+  if (system->n_open_sources == 0)
+    max_n = (n_pending + n_free - 1) / n_free;
+  else if (n_pending >= system->batch_max_items
+        || estimate_batch_len (system, n_pending, system->batch_items_len)
+             >= system->batch_max_bytes
+        || system->n_running_tasks == 0)
+    max_n = n_pending;
+  else
+    return FALSE;
+  if (max_n > system->batch_max_items)
+    max_n = system->batch_max_items;
+
+  /* as many as fit, but at least one */
+  len = strlen (system->batch_items->pdata[0]);
+  for (n = 1; n < max_n; n++)
+    {
+      gsize item_len = strlen (system->batch_items->pdata[n]);
+      if (estimate_batch_len (system, n + 1, len + item_len)
+            > system->batch_max_bytes)
+        break;
+      len += item_len;
+    }
+
+  task = new_task (system);
+  task->n_batch_items = n;
+  task->batch_items = g_new (char *, n + 1);
+  memcpy (task->batch_items, system->batch_items->pdata, n * sizeof (char *));
+  task->batch_items[n] = NULL;
+  queue_task (system->batch_queue, task);
+  g_ptr_array_remove_range (system->batch_items, 0, n);
+  system->batch_items_len -= len;
+  return TRUE;
+}
+
+/* Whether the memory budget (if any) has room for another task;
+   only asked once there is a free slot and a task to put in it. */
+static gboolean
+may_start_task (System *system)
+{
+  return system->memory_budget == NULL
+      || memory_budget_admit (system);
+}
+
+static gboolean
+input_queue_is_ready (InputQueue *queue)
+{
+  return (queue->schedule.max_running == 0
+       || queue->n_running < queue->schedule.max_running)
+      && input_queue_find_startable (queue) >= 0;
+}
+
+/* Take the task that gets the next free slot (see SourceSchedule),
+   or NULL if every queue with tasks is at its limit. */
+static Task *
+pick_next_task (System *system)
+{
+  GPtrArray *queues = system->input_queues;
+  InputQueue *queue;
+  gboolean found = FALSE;
+  int priority = 0;
+  unsigned i;
+  Task *task;
+
+  if (input_queue_length (system->batch_queue) > 0)
+    return input_queue_pop (system->batch_queue);
+  for (i = 0; i < queues->len; i++)
+    {
+      queue = queues->pdata[i];
+      if (input_queue_is_ready (queue)
+       && (!found || queue->schedule.priority > priority))
+        {
+          priority = queue->schedule.priority;
+          found = TRUE;
+        }
+    }
+  if (!found)
+    return NULL;
+
+  /* Deficit round-robin:  in its turn a queue may start 'weight'
+     tasks.  A queue that can't use its turn loses it, so this
+     finds a task within one round. */
+  for (;;)
+    {
+      queue = queues->pdata[system->drr_cursor];
+      if (input_queue_is_ready (queue) && queue->schedule.priority == priority)
+        break;
+      queue->deficit = 0;
+      system->drr_cursor = (system->drr_cursor + 1) % queues->len;
+    }
+  if (queue->deficit == 0)
+    queue->deficit = queue->schedule.weight;
+  queue->deficit--;
+  task = input_queue_take (queue, input_queue_find_startable (queue));
+  if (queue->deficit == 0 || input_queue_length (queue) == 0)
+    {
+      queue->deficit = 0;
+      system->drr_cursor = (system->drr_cursor + 1) % queues->len;
+    }
+  return task;
+}
+
+/* Once it can get no more tasks (eg its source has given its
+   last line) and its tasks have all ended, a queue is no longer needed. */
+static void
+maybe_free_input_queue (InputQueue *queue)
+{
+  System *system = queue->system;
+  unsigned i;
+  if (queue->is_open
+   || input_queue_length (queue) > 0
+   || queue->n_running > 0
+   || queue == system->batch_queue)
+    return;
+  for (i = 0; system->input_queues->pdata[i] != queue; i++)
+    ;
+  g_ptr_array_remove_index (system->input_queues, i);
+  if (i < system->drr_cursor)
+    system->drr_cursor--;
+  if (system->drr_cursor >= system->input_queues->len)
+    system->drr_cursor = 0;
+  if (queue->heap != NULL)
+    g_ptr_array_free (queue->heap, TRUE);
+  g_slice_free (InputQueue, queue);
+}
+
+static void
+close_input_queue (InputQueue *queue)
+{
+  g_assert (queue->is_open);
+  queue->is_open = FALSE;
+  queue->system->n_open_sources--;
+  maybe_free_input_queue (queue);
+}
+
+static void
+input_queue_trap (InputQueue *queue)
+{
+  g_assert (!queue->is_trapped);
+
+  /* before source_trap():  it may call handle_source(),
+     which may even free the queue */
+  queue->is_trapped = TRUE;
+  source_trap (queue->source, handle_source, queue);
+}
+
+static void
+input_queue_untrap (InputQueue *queue)
+{
+  g_assert (queue->is_trapped);
+  source_untrap (queue->source);
+  queue->is_trapped = FALSE;
+}
+
+/* Start queued tasks in any free slots. */
+static void
+fill_slots (System *system)
+{
+  Task *task;
+  while (system->n_running_tasks < system->max_running_tasks
+      && (system->n_unstarted_tasks > 0 || maybe_queue_batch (system))
+      && may_start_task (system)
+      && (task = pick_next_task (system)) != NULL)
+    start_task (system, task);
+}
+
+/* Resume reading the sources whose backlog has drained to half of
+   its maximum.  (Waiting for it to drain, instead of resuming as soon
+   as there is room, means we don't trap and untrap for every line.)
+   If a source ends as it is trapped, its queue may be freed, and the
+   next one skipped:  but then handle_source() has called us again. */
+static void
+trap_input_sources (System *system)
+{
+  unsigned i;
+  for (i = 0; i < system->input_queues->len; i++)
+    {
+      InputQueue *queue = system->input_queues->pdata[i];
+      if (queue->source != NULL
+       && !queue->is_trapped
+       && get_queue_backlog (queue) <= get_queue_max_backlog (queue) / 2)
+        input_queue_trap (queue);
+    }
+}
+
+static void
+refill_slots (System *system)
+{
+  fill_slots (system);
+  trap_input_sources (system);
+}
+
+void
+system_refill_slots (System *system)
+{
+  refill_slots (system);
+}
+
 static void check_if_all_done (System *system)
 {
-  DEBUG_ONLY (g_message ("check_if_all_done: n_running_tasks=%u, n_unstarted_tasks=%u, cur_input_source=%u, n_input_sources=%u", system->n_running_tasks, system->n_unstarted_tasks, system->cur_input_source, system->input_sources->len));
+  DEBUG_ONLY (g_message ("check_if_all_done: n_running_tasks=%u, n_unstarted_tasks=%u, n_open_sources=%u", system->n_running_tasks, system->n_unstarted_tasks, system->n_open_sources));
   if (system->n_running_tasks == 0
    && system->n_unstarted_tasks == 0
-   && system->cur_input_source >= system->input_sources->len)
+   && system->batch_items->len == 0
+   && system->n_open_sources == 0
+   && !system->keep_running
+   && !system->is_all_done)
     {
       DEBUG_ONLY (g_message ("all done (system trap=%p)", system->trap_list));
       SystemTrap *trap;
       GTimeVal cur_time;
+      system->is_all_done = TRUE;
+      if (system->worker_pool != NULL)
+        worker_pool_shutdown (system);
       g_get_current_time (&cur_time);
       for (trap = system->trap_list; trap; trap = trap->next)
         if (trap->funcs->all_done)
@@ -200,108 +1194,273 @@ static void check_if_all_done (System *system)
     }
 }
 
+/* Move a running task, whose process resources
+   have already been released, to TASK_DONE. */
+void
+task_done (Task               *task,
+           TaskTerminationType type,
+           int                 info)
+{
+  GTimeVal cur_time;
+  SystemTrap *trap;
+  InputQueue *queue = task->queue;
+
+  task->state = TASK_DONE;
+  task->info.terminated.termination_type = type;
+  task->info.terminated.termination_info = info;
+  task->system->n_running_tasks--;
+  task->system->n_finished_tasks++;
+  task->queue = NULL;
+  queue->n_running--;
+  maybe_free_input_queue (queue);
+  if (task->slot >= 0)
+    slots_release (task->system, task->slot);
+  if (task->system->resources != NULL)
+    resources_release (task);
+
+  g_get_current_time (&cur_time);
+  for (trap = task->system->trap_list; trap; trap = trap->next)
+    if (trap->funcs->ended)
+      trap->funcs->ended (task, &cur_time, type, info, trap->trap_data);
+
+  /* after its own ended traps:  its descendants may be skipped */
+  if (task->dag_node != NULL)
+    dag_task_done (task);
+  if (task->slice != NULL || task->batch_items != NULL)
+    {
+      g_free (task->str);
+      task->str = NULL;
+    }
+  if (task->batch_items != NULL)
+    {
+      g_strfreev (task->batch_items);
+      task->batch_items = NULL;
+      task->n_batch_items = 0;
+    }
+
+  DEBUG_ONLY (g_message ("n_unstarted,running,finished=%u,%u,%u",
+                         task->system->n_unstarted_tasks,
+                         task->system->n_running_tasks,
+                         task->system->n_finished_tasks));
+
+  refill_slots (task->system);
+  check_if_all_done (task->system);
+  if (task->system->keep_running)
+    task_free (task);
+}
+
+static void
+free_task_buffers (Task *task)
+{
+  if (task->info.running.stdin_source)
+    g_source_fd_destroy (task->info.running.stdin_source);
+  if (task->info.running.stdin_fd >= 0)
+    close (task->info.running.stdin_fd);
+  line_buffer_free (task->info.running.stdout_input_buffer);
+  line_buffer_free (task->info.running.stderr_input_buffer);
+  g_byte_array_free (task->info.running.stdin_output_buffer, TRUE);
+}
+
 static void
 check_if_task_done (Task *task)
 {
   g_assert (task->state == TASK_RUNNING);
   if (task->info.running.pid < 0
-   && task->info.running.stdout_source == NULL
-   && task->info.running.stderr_source == NULL)
+   && task->info.running.stdout_fd < 0
+   && task->info.running.stderr_fd < 0)
     {
-      TaskTerminationType type = task->info.running.termination_type;
-      int info = task->info.running.termination_info;
-      GTimeVal cur_time;
-
-      if (task->info.running.stdin_source)
-        g_source_destroy ((GSource *) task->info.running.stdin_source);
-      if (task->info.running.stdin_fd >= 0)
-        close (task->info.running.stdin_fd);
-      g_byte_array_free (task->info.running.stdout_input_buffer, TRUE);
-      g_byte_array_free (task->info.running.stderr_input_buffer, TRUE);
-      g_byte_array_free (task->info.running.stdin_output_buffer, TRUE);
-      
-      task->state = TASK_DONE;
-      task->info.terminated.termination_type = type;
-      task->info.terminated.termination_info = info;
-      task->system->n_running_tasks--;
-      task->system->n_finished_tasks++;
-
-      g_get_current_time (&cur_time);
-      SystemTrap *trap;
-      for (trap = task->system->trap_list; trap; trap = trap->next)
-        if (trap->funcs->ended)
-          trap->funcs->ended (task, &cur_time, type, info, trap->trap_data);
+      free_task_buffers (task);
+      if (task->hedge != NULL)
+        hedge_task_finished (task);
+      task_done (task,
+                 task->info.running.termination_type,
+                 task->info.running.termination_info);
+    }
+}
 
-      DEBUG_ONLY (g_message ("n_unstarted,running,finished=%u,%u,%u",
-                             task->system->n_unstarted_tasks,
-                             task->system->n_running_tasks,
-                             task->system->n_finished_tasks));
+/* Stop reading the output of a task whose process has been killed,
+   and release what it was run with, but for its pid:  when the
+   process is reaped, the task is done already, and it is ignored.
+   Then the caller gives the task to task_done(). */
+void
+task_abandon_process (Task *task)
+{
+  g_assert (task->state == TASK_RUNNING);
+  if (task->info.running.stdout_source != NULL)
+    g_source_fd_destroy (task->info.running.stdout_source);
+  if (task->info.running.stdout_reader != NULL)
+    uring_reader_destroy (task->info.running.stdout_reader);
+  if (task->info.running.stdout_fd >= 0)
+    close (task->info.running.stdout_fd);
+  if (task->info.running.stderr_source != NULL)
+    g_source_fd_destroy (task->info.running.stderr_source);
+  if (task->info.running.stderr_reader != NULL)
+    uring_reader_destroy (task->info.running.stderr_reader);
+  if (task->info.running.stderr_fd >= 0)
+    close (task->info.running.stderr_fd);
+  free_task_buffers (task);
+}
 
-      check_if_all_done (task->system);
+void
+decode_wait_status (int                  status,
+                    TaskTerminationType *type_out,
+                    int                 *info_out)
+{
+  if (WIFSIGNALED (status))
+    {
+      *type_out = TASK_TERMINATION_SIGNAL;
+      *info_out = WTERMSIG (status);
+    }
+  else
+    {
+      *type_out = TASK_TERMINATION_EXIT;
+      *info_out = WEXITSTATUS (status);
     }
 }
 
 static void
-handle_child_watch_terminated (GPid     pid,
-                               gint     status,
-                               gpointer data)
+handle_child_watch_terminated (GPid                 pid,
+                               gint                 status,
+                               const struct rusage *usage,
+                               gpointer             data)
 {
   Task *task = data;
-  if (status & 0xff)
-    {
-      /* signal */
-      task->info.running.termination_type = TASK_TERMINATION_SIGNAL;
-      task->info.running.termination_info = status;
-    }
-  else
+
+  /* abandoned:  see task_abandon_process() */
+  if (task->state != TASK_RUNNING)
+    return;
+  if (usage != NULL)
     {
-      /* exitted */
-      task->info.running.termination_type = TASK_TERMINATION_EXIT;
-      task->info.running.termination_info = status >> 8;
+      SystemStats *stats = &task->system->stats;
+      task->cpu_usecs = usage->ru_utime.tv_sec * G_GUINT64_CONSTANT (1000000)
+                      + usage->ru_utime.tv_usec
+                      + usage->ru_stime.tv_sec * G_GUINT64_CONSTANT (1000000)
+                      + usage->ru_stime.tv_usec;
+      task->max_rss = usage->ru_maxrss;
+      stats->child_cpu_usecs += task->cpu_usecs;
+      if (task->max_rss > stats->child_max_rss)
+        stats->child_max_rss = task->max_rss;
     }
+  decode_wait_status (status,
+                      &task->info.running.termination_type,
+                      &task->info.running.termination_info);
   task->info.running.pid = -1;
   check_if_task_done (task);
 }
 
+void
+task_run_started_traps (Task *task)
+{
+  GTimeVal cur_time;
+  SystemTrap *trap;
+  g_get_current_time (&cur_time);
+  for (trap = task->system->trap_list; trap; trap = trap->next)
+    if (trap->funcs->handle_started)
+      trap->funcs->handle_started (task, &cur_time, task->str, trap->trap_data);
+}
+
+static char *
+make_batch_cmdline (System *system,
+                    Task   *task)
+{
+  unsigned *lens;
+  unsigned i;
+  char *rv;
+  if (system->command_template == NULL)
+    return g_strjoinv ("\n", task->batch_items);
+  lens = g_new (unsigned, task->n_batch_items);
+  for (i = 0; i < task->n_batch_items; i++)
+    lens[i] = strlen (task->batch_items[i]);
+  rv = cmd_template_expand (system->command_template,
+                            task->n_batch_items,
+                            (const char **) task->batch_items, lens,
+                            task->task_index + 1);
+  g_free (lens);
+  return rv;
+}
+
 static void
-start_next_task (System *system)
+start_task (System *system,
+            Task   *task)
 {
-  unsigned task_index = system->n_finished_tasks + system->n_running_tasks;
   int stderr_pipe[2], stdout_pipe[2], stdin_pipe[2];
   int pid;
-  Task *task = system->tasks->pdata[task_index];
+  gint64 spawn_start;
   g_assert (task->state == TASK_WAITING);
+  task->queue->n_running++;
+  task->start_time = g_get_monotonic_time ();
+  task->slot = slots_acquire (system, task);
+  if (system->resources != NULL)
+    resources_acquire (task);
 
-  do_pipe (stdin_pipe);
-  do_pipe (stdout_pipe);
-  do_pipe (stderr_pipe);
+  if (task->batch_items != NULL)
+    task->str = make_batch_cmdline (system, task);
+  else if (system->command_template != NULL && task->dag_node == NULL)
+    {
+      /* the input line is an argument for the template
+         (a DAG's nodes are whole commands) */
+      const char *arg = task->str != NULL ? task->str : task->slice;
+      unsigned arg_len = task->str != NULL ? strlen (task->str) : task->slice_len;
+      char *cmdline = cmd_template_expand (system->command_template,
+                                           1, &arg, &arg_len,
+                                           task->task_index + 1);
+      g_free (task->str);
+      task->str = cmdline;
+    }
+  else if (task->str == NULL)
+    task->str = g_strndup (task->slice, task->slice_len);
 
-retry_fork:
-  pid = fork ();
-  if (pid < 0)
+  if (system->result_cache != NULL
+   && result_cache_lookup (system, task))
     {
-      if (errno == EINTR)
-        goto retry_fork;
-      else
-        g_error ("error forking");
+      /* its output is replayed from an idle callback:  when it is
+         done, the next task starts from there, not from here */
+      task->state = TASK_RUNNING;
+      system->n_unstarted_tasks--;
+      system->n_running_tasks++;
+      memset (&task->info.running, 0, sizeof (task->info.running));
+      task->info.running.pid = -1;
+      task->info.running.stdin_fd = -1;
+      task->info.running.stdout_fd = -1;
+      task->info.running.stderr_fd = -1;
+      task_run_started_traps (task);
+      return;
     }
-  else if (pid == 0)
+
+  if (system->worker_mode == SYSTEM_WORKERS_PERSISTENT)
     {
-      /* child process */
-      dup2 (stdin_pipe[0], STDIN_FILENO);
-      dup2 (stdout_pipe[1], STDOUT_FILENO);
-      dup2 (stderr_pipe[1], STDERR_FILENO);
-      do_exec (task->str);
-      _exit (127);
+      task->state = TASK_RUNNING;
+      system->n_unstarted_tasks--;
+      system->n_running_tasks++;
+      worker_pool_start_task (system, task);
+      task_run_started_traps (task);
+      return;
     }
 
-  /* parent process */
+  spawn_start = g_get_monotonic_time ();
+  system_make_pipe (stdin_pipe);
+  system_make_pipe (stdout_pipe);
+  system_make_pipe (stderr_pipe);
+
+  /* only our ends:  the child's ends are separate open files */
+  set_nonblocking (stdout_pipe[0]);
+  set_nonblocking (stderr_pipe[0]);
+
+  if (system->memory_budget != NULL)
+    task->cgroup_fd = memory_budget_new_task_cgroup (system, task);
+  pid = system_spawn_process (system, task->str,
+                              stdin_pipe[0], stdout_pipe[1], stderr_pipe[1],
+                              task->cgroup_fd, task->slot);
+  system->stats.n_spawned++;
+  system->stats.spawn_usecs += g_get_monotonic_time () - spawn_start;
+
   close (stdin_pipe[0]);
   close (stdout_pipe[1]);
   close (stderr_pipe[1]);
   task->state = TASK_RUNNING;
   system->n_unstarted_tasks--;
   system->n_running_tasks++;
+  task->info.running.worker = NULL;
   task->info.running.pid = pid;
   task->info.running.stdin_fd = stdin_pipe[1];
   task->info.running.stdin_source = NULL;
@@ -310,95 +1469,166 @@ retry_fork:
   task->info.running.stderr_fd = stderr_pipe[0];
   task->info.running.stderr_source = NULL;
   task->info.running.stdin_output_buffer = g_byte_array_new ();
-  task->info.running.stdout_input_buffer = g_byte_array_new ();
-  task->info.running.stderr_input_buffer = g_byte_array_new ();
-  task->info.running.stdout_source = g_source_fd_new (task->info.running.stdout_fd, G_IO_IN, handle_stdout_readable, task);
-  task->info.running.stderr_source = g_source_fd_new (task->info.running.stderr_fd, G_IO_IN, handle_stderr_readable, task);
-  g_child_watch_add (pid, handle_child_watch_terminated, task);
-  GTimeVal cur_time;
-  g_get_current_time (&cur_time);
-  SystemTrap *trap;
-  for (trap = task->system->trap_list; trap; trap = trap->next)
-    if (trap->funcs->handle_started)
-      trap->funcs->handle_started (task, &cur_time, task->str, trap->trap_data);
+  task->info.running.stdout_input_buffer = line_buffer_new ('\n');
+  task->info.running.stderr_input_buffer = line_buffer_new ('\n');
+  task->info.running.stdout_reader = NULL;
+  task->info.running.stderr_reader = NULL;
+  if (system->io_engine == SYSTEM_IO_ENGINE_IO_URING
+   && !uring_reader_init ())
+    system->io_engine = SYSTEM_IO_ENGINE_POLL;
+  if (system->io_engine == SYSTEM_IO_ENGINE_IO_URING)
+    {
+      task->info.running.stdout_reader = uring_reader_new (task->info.running.stdout_fd, handle_stdout_uring_data, task);
+      task->info.running.stderr_reader = uring_reader_new (task->info.running.stderr_fd, handle_stderr_uring_data, task);
+    }
+  else
+    {
+      init_read_state (&task->info.running.stdout_read_state);
+      init_read_state (&task->info.running.stderr_read_state);
+      task->info.running.stdout_source = g_source_fd_new_full (task->info.running.stdout_fd, G_IO_IN, G_SOURCE_FD_EDGE_TRIGGERED, handle_stdout_readable, task);
+      task->info.running.stderr_source = g_source_fd_new_full (task->info.running.stderr_fd, G_IO_IN, G_SOURCE_FD_EDGE_TRIGGERED, handle_stderr_readable, task);
+    }
+  child_watch_add (pid, handle_child_watch_terminated, task);
+  task_run_started_traps (task);
 }
 
 static void
-handle_source (Source *source, const char *str, void *trap_data)
+handle_source (Source     *source,
+               const char *str,
+               unsigned    len,
+               void       *trap_data)
 {
-  System *system = trap_data;
+  InputQueue *queue = trap_data;
+  System *system = queue->system;
   if (str == NULL)
     {
-      /* next source */
       DEBUG_ONLY (g_message ("handle_source: str NULL"));
-      do_input_source_untrap (system);
-      system->cur_input_source++;
-      if (system->cur_input_source < system->input_sources->len)
-        do_input_source_trap (system);
-      else
-        check_if_all_done (system);
+      input_queue_untrap (queue);
+      queue->source = NULL;
+      close_input_queue (queue);
+
+      /* the other sources' shares of the backlog grew;
+         and if it was the last, start the rest of the batch_items */
+      refill_slots (system);
+      check_if_all_done (system);
+    }
+  else if (system->batch_max_items > 0)
+    {
+      g_ptr_array_add (system->batch_items, g_strndup (str, len));
+      system->batch_items_len += len;
+      fill_slots (system);
+      if (get_queue_backlog (queue) >= get_queue_max_backlog (queue))
+        input_queue_untrap (queue);
     }
   else
     {
-      Task *task = g_slice_new (Task);
-      task->system = system;
-      task->task_index = system->tasks->len;
-      task->str = g_strdup (str);
-      task->first_message = task->last_message = NULL;
-      task->state = TASK_WAITING;
+      Task *task = new_task (system);
+      task->source = source;
+      if (system->resources != NULL)
+        task->needs = resources_parse_prefix (system, &str, &len, queue->needs);
+      if (source->has_stable_strs)
+        {
+          task->slice = str;
+          task->slice_len = len;
+        }
+      else
+        task->str = g_strndup (str, len);
+      if (system->history != NULL)
+        {
+          guint64 usecs = history_lookup (system, str, len, task->history_keys);
 
-      g_ptr_array_add (system->tasks, task);
-      system->n_unstarted_tasks += 1;
+          /* one that hasn't been run goes early, to find out */
+          task->rank = usecs == 0 ? G_MAXUINT64 : usecs;
+        }
+      queue_task (queue, task);
 
       DEBUG_ONLY(
-      g_message ("handle_source: command=%s; unstarted: %u/%u; running:%u/%u",
-                 str, system->n_unstarted_tasks, system->max_unstarted_tasks,
+      g_message ("handle_source: command=%.*s; unstarted: %u/%u; running:%u/%u",
+                 (int) len, str, system->n_unstarted_tasks, system->max_unstarted_tasks,
                  system->n_running_tasks, system->max_running_tasks)
       );
 
-      if (system->n_running_tasks < system->max_running_tasks)
-        start_next_task (system);
-      else if (system->n_unstarted_tasks >= system->max_unstarted_tasks)
-        do_input_source_untrap (system);
+      /* maybe another source's task:  it may be their turn */
+      fill_slots (system);
+      if (get_queue_backlog (queue) >= get_queue_max_backlog (queue))
+        input_queue_untrap (queue);
     }
 }
 
-static void
-do_input_source_trap (System *system)
+InputQueue *
+system_open_input_queue (System  *system,
+                         gboolean is_ranked)
 {
-  Source *source = system->input_sources->pdata[system->cur_input_source];
-  g_assert (!system->is_input_source_trapped);
-  source_trap (source, handle_source, system);
-  system->is_input_source_trapped = TRUE;
+  InputQueue *queue = input_queue_new (system, NULL, is_ranked);
+  g_ptr_array_add (system->input_queues, queue);
+  system->n_open_sources++;
+  return queue;
 }
 
-static void
-do_input_source_untrap (System *system)
+Task *
+system_queue_task (InputQueue *queue,
+                   const char *cmdline,
+                   guint64     rank)
+{
+  System *system = queue->system;
+  Task *task = new_task (system);
+  unsigned len = strlen (cmdline);
+  if (system->resources != NULL)
+    task->needs = resources_parse_prefix (system, &cmdline, &len, queue->needs);
+  task->str = g_strndup (cmdline, len);
+  task->rank = rank;
+  if (system->history != NULL)
+    history_lookup (system, cmdline, len, task->history_keys);
+  queue_task (queue, task);
+  return task;
+}
+
+void
+system_close_input_queue (InputQueue *queue)
 {
-  Source *source = system->input_sources->pdata[system->cur_input_source];
-  g_assert (system->is_input_source_trapped);
-  source_untrap (source);
-  system->is_input_source_trapped = FALSE;
+  System *system = queue->system;
+  close_input_queue (queue);
+  check_if_all_done (system);
 }
 
+void
+system_skip_task (System     *system,
+                  const char *cmdline,
+                  int         info)
+{
+  Task *task = new_task (system);
+  GTimeVal cur_time;
+  SystemTrap *trap;
+  task->str = g_strdup (cmdline);
+  task->state = TASK_DONE;
+  task->info.terminated.termination_type = TASK_TERMINATION_SKIPPED;
+  task->info.terminated.termination_info = info;
+  system->n_finished_tasks++;
+  g_get_current_time (&cur_time);
+  for (trap = system->trap_list; trap; trap = trap->next)
+    if (trap->funcs->ended)
+      trap->funcs->ended (task, &cur_time, TASK_TERMINATION_SKIPPED, info,
+                          trap->trap_data);
+  if (system->keep_running)
+    task_free (task);
+}
 
 void    system_add_input_source        (System *system,
                                         Source *source)
 {
-  g_ptr_array_add (system->input_sources, source);
-  if (system->cur_input_source == system->input_sources->len - 1
-   && system->n_unstarted_tasks < system->max_unstarted_tasks)
-    {
-      /* trap input source */
-      do_input_source_trap (system);
-    }
+  gboolean is_ranked = system->task_order == SYSTEM_TASK_ORDER_LONGEST_FIRST;
+  InputQueue *queue = input_queue_new (system, source, is_ranked);
+  g_ptr_array_add (system->input_queues, queue);
+  system->n_open_sources++;
+  if (get_queue_backlog (queue) < get_queue_max_backlog (queue))
+    input_queue_trap (queue);
 }
 
 gboolean system_add_input_script        (System     *system,
                                          const char *filename,
                                          GError    **error)
 {
-  int fd = open (filename, O_RDONLY);
+  int fd = open (filename, O_RDONLY | O_CLOEXEC);
   if (fd < 0)
     {
       g_set_error (error, PARALLELIZER_ERROR_DOMAIN_QUARK,
@@ -441,22 +1671,20 @@ struct _SourceFD
   GSourceFD *source;
   gboolean is_pollable;
   gboolean should_close;
-  GByteArray *buffer;
-  char separator_char;
+  LineBuffer *buffer;
 };
 
 static void
 maybe_do_input_source_fd_read (SourceFD *sfd,
                                gboolean  at_most_one_read)
 {
-  while (memchr (sfd->buffer->data, sfd->separator_char, sfd->buffer->len) == NULL
+  while (!line_buffer_has_line (sfd->buffer)
     && sfd->fd >= 0)
     {
-      unsigned old_len = sfd->buffer->len;
+      unsigned space;
+      guint8 *at = line_buffer_get_write_space (sfd->buffer, 4096, &space);
       ssize_t read_rv;
-      g_byte_array_set_size (sfd->buffer, old_len + 4096);
-      read_rv = read (sfd->fd, sfd->buffer->data + old_len,
-                      sfd->buffer->len - old_len);
+      read_rv = read (sfd->fd, at, space);
       if (read_rv < 0)
         {
           g_error ("error reading from file-descriptor: %s",
@@ -466,12 +1694,16 @@ maybe_do_input_source_fd_read (SourceFD *sfd,
         {
           /* eof */
           DEBUG_ONLY (g_message ("input source: got eof"));
-          g_byte_array_set_size (sfd->buffer, old_len);
-          if (sfd->buffer->len > 0)
+          if (line_buffer_get_pending_len (sfd->buffer) > 0)
             {
               /* complain about partial line */
               g_warning ("partial line encountered at end of input file");
             }
+          if (sfd->source != NULL)
+            {
+              g_source_fd_destroy (sfd->source);
+              sfd->source = NULL;
+            }
           if (sfd->should_close)
             close (sfd->fd);
           sfd->fd = -1;
@@ -479,7 +1711,7 @@ maybe_do_input_source_fd_read (SourceFD *sfd,
         }
       else
         {
-          g_byte_array_set_size (sfd->buffer, old_len + read_rv);
+          line_buffer_commit (sfd->buffer, read_rv);
           if (at_most_one_read)
             return;
         }
@@ -490,14 +1722,12 @@ run_input_source_fd_callbacks (SourceFD *sfd)
 {
   while (sfd->base.callback)
     {
-      char *start = (char *) sfd->buffer->data;
-      char *nl = memchr (start, sfd->separator_char, sfd->buffer->len);
-      if (nl == NULL)
+      unsigned len;
+      char *line = line_buffer_next_line (sfd->buffer, &len);
+      if (line == NULL)
         break;
-      *nl = 0;
-      DEBUG_ONLY (g_message ("calling back %s", (char*)sfd->buffer->data));
-      sfd->base.callback (&sfd->base, start, sfd->base.trap_data);
-      g_byte_array_remove_range (sfd->buffer, 0, (nl + 1) - start);
+      DEBUG_ONLY (g_message ("calling back %s", line));
+      sfd->base.callback (&sfd->base, line, len, sfd->base.trap_data);
     }
 }
 
@@ -508,7 +1738,7 @@ do_idle_input_source (gpointer data)
   maybe_do_input_source_fd_read (sfd, FALSE);
   run_input_source_fd_callbacks (sfd);
   if (sfd->fd < 0 && sfd->base.callback)
-    sfd->base.callback (&sfd->base, NULL, sfd->base.trap_data);
+    sfd->base.callback (&sfd->base, NULL, 0, sfd->base.trap_data);
   return TRUE;
 }
 
@@ -519,7 +1749,7 @@ handle_source_fd_readable (void *data)
   maybe_do_input_source_fd_read (sfd, TRUE);
   run_input_source_fd_callbacks (sfd);
   if (sfd->fd < 0 && sfd->base.callback)
-    sfd->base.callback (&sfd->base, NULL, sfd->base.trap_data);
+    sfd->base.callback (&sfd->base, NULL, 0, sfd->base.trap_data);
   return TRUE;
 }
 
@@ -529,7 +1759,7 @@ source_fd_trap (Source *source)
   SourceFD *sfd = (SourceFD *) source;
   if (sfd->fd < 0)
     {
-      (*source->callback) (source, NULL, source->trap_data);
+      (*source->callback) (source, NULL, 0, source->trap_data);
     }
   else if (sfd->is_pollable)
     sfd->source = g_source_fd_new (sfd->fd, G_IO_IN,
@@ -548,7 +1778,7 @@ source_fd_untrap (Source *source)
     {
       if (sfd->source)
         {
-          g_source_destroy ((GSource *) sfd->source);
+          g_source_fd_destroy (sfd->source);
           sfd->source = NULL;
         }
     }
@@ -562,63 +1792,307 @@ source_fd_destroy (Source *source)
   SourceFD *sfd = (SourceFD *) source;
   if (sfd->should_close)
     close (sfd->fd);
+  line_buffer_free (sfd->buffer);
   g_slice_free (SourceFD, sfd);
 }
 
 static gboolean
-get_fd_is_pollable (int fd)
+get_fd_is_pollable (struct stat *stat_buf, int fd)
 {
-  struct stat stat_buf;
-  if (fstat (fd, &stat_buf) < 0)
-    g_error ("error calling fstat: %s", g_strerror (errno));
-  return S_ISFIFO (stat_buf.st_mode)
-      || S_ISSOCK (stat_buf.st_mode)
-      || S_ISCHR (stat_buf.st_mode)
+  return S_ISFIFO (stat_buf->st_mode)
+      || S_ISSOCK (stat_buf->st_mode)
+      || S_ISCHR (stat_buf->st_mode)
       || isatty (fd);
 }
 
+/* --- regular files:  command-lines straight from a mapping --- */
+#define MMAP_LINES_PER_IDLE     4096
+
+typedef struct _SourceMmap SourceMmap;
+struct _SourceMmap
+{
+  Source base;
+  char *data;
+  gsize size;
+  gsize offset;                 /* the next line */
+  char separator;
+};
+
+static gboolean
+do_idle_mmap_source (gpointer data)
+{
+  SourceMmap *smap = data;
+  unsigned n = 0;
+  while (smap->base.callback != NULL && n++ < MMAP_LINES_PER_IDLE)
+    {
+      char *line = smap->data + smap->offset;
+      gsize rem = smap->size - smap->offset;
+      char *end = memchr (line, smap->separator, rem);
+      if (end == NULL)
+        {
+          if (rem > 0)
+            {
+              g_warning ("partial line encountered at end of input file");
+              smap->offset = smap->size;
+            }
+          smap->base.callback (&smap->base, NULL, 0, smap->base.trap_data);
+          break;
+        }
+      smap->offset += end - line + 1;
+      smap->base.callback (&smap->base, line, end - line,
+                           smap->base.trap_data);
+    }
+  return TRUE;
+}
+
+static void
+source_mmap_trap (Source *source)
+{
+  g_idle_add (do_idle_mmap_source, source);
+}
+
+static void
+source_mmap_untrap (Source *source)
+{
+  g_idle_remove_by_data (source);
+}
+
+static void
+source_mmap_destroy (Source *source)
+{
+  SourceMmap *smap = (SourceMmap *) source;
+  munmap (smap->data, smap->size);
+  g_slice_free (SourceMmap, smap);
+}
+
+/* Returns FALSE if the file can't be mapped (eg it is empty). */
+static gboolean
+system_add_input_mmap (System      *system,
+                       int          fd,
+                       struct stat *stat_buf)
+{
+  SourceMmap *source;
+  off_t offset;
+  void *data;
+  if (stat_buf->st_size == 0)
+    return FALSE;
+  offset = lseek (fd, 0, SEEK_CUR);
+  if (offset < 0 || offset >= stat_buf->st_size)
+    return FALSE;
+  data = mmap (NULL, stat_buf->st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (data == MAP_FAILED)
+    return FALSE;
+  madvise (data, stat_buf->st_size, MADV_SEQUENTIAL);
+
+  source = g_slice_new (SourceMmap);
+  source->base.trap = source_mmap_trap;
+  source->base.untrap = source_mmap_untrap;
+  source->base.destroy = source_mmap_destroy;
+  source->base.callback = NULL;
+  source->base.trap_data = NULL;
+  source->base.has_stable_strs = TRUE;
+  source->data = data;
+  source->size = stat_buf->st_size;
+  source->offset = offset;
+  source->separator = system->input_separator;
+  system_add_input_source (system, &source->base);
+  return TRUE;
+}
+
 void    system_add_input_fd            (System *system,
                                         int     fd,
                                         gboolean should_close)
 {
-  SourceFD *source = g_slice_new (SourceFD);
+  SourceFD *source;
+  struct stat stat_buf;
+  if (fstat (fd, &stat_buf) < 0)
+    g_error ("error calling fstat: %s", g_strerror (errno));
+
+  /* the mapping holds its own reference to the file */
+  if (S_ISREG (stat_buf.st_mode)
+   && system_add_input_mmap (system, fd, &stat_buf))
+    {
+      if (should_close)
+        close (fd);
+      return;
+    }
+
+  source = g_slice_new (SourceFD);
   source->base.trap = source_fd_trap;
   source->base.untrap = source_fd_untrap;
   source->base.destroy = source_fd_destroy;
   source->fd = fd;
   source->source = NULL;
-  source->is_pollable = get_fd_is_pollable (fd);
+  source->is_pollable = get_fd_is_pollable (&stat_buf, fd);
   source->should_close = should_close;
   source->base.callback = NULL;
   source->base.trap_data = NULL;
-  source->buffer = g_byte_array_new ();
-  source->separator_char = '\n';                /* TODO: someday support NUL */
+  source->base.has_stable_strs = FALSE;
+  source->buffer = line_buffer_new (system->input_separator);
   system_add_input_source (system, &source->base);
 }
 
 void    system_set_max_unstarted_tasks (System *system,
                                         unsigned n)
 {
+  unsigned i;
   system->max_unstarted_tasks = n;
-  if (n < system->n_unstarted_tasks)
-    {
-      if (!system->is_input_source_trapped)
-        do_input_source_trap (system);
-    }
-  else
+  for (i = 0; i < system->input_queues->len; i++)
     {
-      if (system->is_input_source_trapped)
-        do_input_source_untrap (system);
+      InputQueue *queue = system->input_queues->pdata[i];
+      if (queue->is_trapped
+       && get_queue_backlog (queue) >= get_queue_max_backlog (queue))
+        input_queue_untrap (queue);
     }
+  refill_slots (system);
 }
 
 void    system_set_max_running_tasks   (System *system,
                                         unsigned n)
 {
   system->max_running_tasks = n;
-  while (system->n_running_tasks < system->max_running_tasks
-      && system->n_unstarted_tasks > 0)
-    start_next_task (system);
+  refill_slots (system);
+}
+
+void    system_set_spawn_method        (System *system,
+                                        SystemSpawnMethod method)
+{
+  system->spawn_method = method;
+}
+
+void    system_set_direct_exec         (System  *system,
+                                        gboolean direct_exec)
+{
+  system->direct_exec = direct_exec;
+}
+
+void    system_set_worker_mode         (System *system,
+                                        SystemWorkerMode mode)
+{
+  system->worker_mode = mode;
+}
+
+void    system_set_io_engine           (System *system,
+                                        SystemIOEngine engine)
+{
+  system->io_engine = engine;
+}
+
+void    system_set_grow_pipes          (System  *system,
+                                        gboolean grow_pipes)
+{
+  system->grow_pipes = grow_pipes;
+}
+
+void    system_set_input_separator     (System *system,
+                                        char    separator)
+{
+  system->input_separator = separator;
+}
+
+void    system_set_input_schedule      (System  *system,
+                                        unsigned weight,
+                                        int      priority,
+                                        unsigned max_running)
+{
+  system->input_schedule.weight = MAX (weight, 1);
+  system->input_schedule.priority = priority;
+  system->input_schedule.max_running = max_running;
+}
+
+void    system_set_keep_running        (System  *system,
+                                        gboolean keep_running)
+{
+  system->keep_running = keep_running;
+  if (!keep_running)
+    check_if_all_done (system);
+}
+
+void    system_set_command_template    (System     *system,
+                                        const char *command_template)
+{
+  if (system->command_template != NULL)
+    cmd_template_free (system->command_template);
+  system->command_template = command_template == NULL ? NULL
+                           : cmd_template_new (command_template);
+}
+
+void    system_set_task_order          (System         *system,
+                                        SystemTaskOrder order)
+{
+  system->task_order = order;
+}
+
+/* A shell command-line is one argument, which linux limits
+   to MAX_ARG_STRLEN (32 pages) whatever ARG_MAX is. */
+static gsize
+get_default_batch_max_bytes (void)
+{
+  extern char **environ;
+  long arg_max = sysconf (_SC_ARG_MAX);
+  gsize max = 32 * 4096;
+  gsize env_len = 0;
+  char **at;
+  for (at = environ; *at; at++)
+    env_len += strlen (*at) + 1 + sizeof (char *);
+  if (arg_max > 0 && (gsize) arg_max < max + env_len)
+    max = arg_max > (long) env_len ? arg_max - env_len : 0;
+  return max > 2 * BATCH_ARG_SLOP ? max - BATCH_ARG_SLOP : BATCH_ARG_SLOP;
+}
+
+void    system_set_batch               (System *system,
+                                        unsigned max_items,
+                                        gsize    max_bytes)
+{
+  system->batch_max_items = max_items;
+  system->batch_max_bytes = max_bytes ? max_bytes
+                          : get_default_batch_max_bytes ();
+}
+
+const char * const *
+task_get_batch_items (Task     *task,
+                      unsigned *n_items_out)
+{
+  if (n_items_out != NULL)
+    *n_items_out = task->n_batch_items;
+  return (const char * const *) task->batch_items;
+}
+
+gboolean
+task_set_output_paused (Task    *task,
+                        gboolean paused)
+{
+  if (task->state != TASK_RUNNING
+   || task->from_cache
+   || task->info.running.worker != NULL
+   || task->info.running.stdout_reader != NULL
+   || task->info.running.stderr_reader != NULL)
+    return FALSE;
+  if (paused)
+    {
+      if (task->info.running.stdout_source != NULL)
+        {
+          g_source_fd_destroy (task->info.running.stdout_source);
+          task->info.running.stdout_source = NULL;
+        }
+      if (task->info.running.stderr_source != NULL)
+        {
+          g_source_fd_destroy (task->info.running.stderr_source);
+          task->info.running.stderr_source = NULL;
+        }
+    }
+  else
+    {
+      /* epoll reports a new fd that is already readable,
+         so nothing written while we were paused is missed */
+      if (task->info.running.stdout_fd >= 0
+       && task->info.running.stdout_source == NULL)
+        task->info.running.stdout_source = g_source_fd_new_full (task->info.running.stdout_fd, G_IO_IN, G_SOURCE_FD_EDGE_TRIGGERED, handle_stdout_readable, task);
+      if (task->info.running.stderr_fd >= 0
+       && task->info.running.stderr_source == NULL)
+        task->info.running.stderr_source = g_source_fd_new_full (task->info.running.stderr_fd, G_IO_IN, G_SOURCE_FD_EDGE_TRIGGERED, handle_stderr_readable, task);
+    }
+  return TRUE;
 }
 
 SystemTrap *system_trap                (System *system,
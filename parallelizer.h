@@ -11,17 +11,22 @@ typedef struct _Source Source;
 typedef enum
 {
   PARALLELIZER_ERROR_OPEN,
-  PARALLELIZER_ERROR_CMDLINE_ARG
+  PARALLELIZER_ERROR_CMDLINE_ARG,
+  PARALLELIZER_ERROR_SOCKET,
+  PARALLELIZER_ERROR_PARSE
 } ParallelizerErrorCode;
 
 /* On most systems, a process can only terminate in these two ways:
  *   - called exit() or _exit()
  *   - killed by a signal (from the kernel, or via kill() or raise())
+ * A task whose dependency failed is SKIPPED without being run;
+ * its termination_info is the task_index of the task that failed.
  */
 typedef enum
 {
   TASK_TERMINATION_EXIT,
-  TASK_TERMINATION_SIGNAL
+  TASK_TERMINATION_SIGNAL,
+  TASK_TERMINATION_SKIPPED
 } TaskTerminationType;
 
 
@@ -44,28 +49,103 @@ struct _TaskMessage
   TaskMessage *next_in_task;
 };
 
+/* reading one of a task's output pipes */
+typedef struct _TaskReadState TaskReadState;
+struct _TaskReadState
+{
+  unsigned read_size;           /* grows for chatty tasks, shrinks for quiet */
+  unsigned pipe_size;
+  unsigned n_full_pipes;        /* consecutive reads that emptied a full pipe */
+};
+
 struct _Task
 {
   System *system;
   unsigned task_index;
   char *str;		/* a command-line */
+
+  /* the input source it came from (NULL for a batch);
+     only valid while the source exists */
+  Source *source;
+
+  /* where it waits for a slot, until it ends;  in some queues,
+     tasks with a higher rank start first */
+  struct _InputQueue *queue;
+  guint64 rank;
+
+  /* if it came from a DAG (see system_add_input_dag), its node */
+  struct _DagNode *dag_node;
+
+  /* its command's and its command's class's keys in
+     the runtime history (see system_set_history), or 0 */
+  guint64 history_keys[2];
+
+  /* from a source that has_stable_strs, the command-line isn't copied
+     until the task starts:  until then 'str' is NULL, and the
+     command-line is 'slice_len' bytes at 'slice'.  In that case 'str'
+     is freed again after the ended traps have run. */
+  const char *slice;
+  unsigned slice_len;
+
+  /* if the task is a batch (see system_set_batch), its input lines;
+     they and 'str' are freed after the ended traps have run */
+  char **batch_items;
+  unsigned n_batch_items;
   TaskState state;
   TaskMessage *first_message, *last_message;
+
+  gint64 start_time;            /* monotonic, in microseconds */
+
+  /* its slot (see system_set_pin_policy()), once it has started;
+     otherwise -1 */
+  int slot;
+
+  /* how much of each resource it needs (see system_add_resource()),
+     or NULL for none;  freed once it has ended */
+  guint64 *needs;
+
+  /* while it runs with hedging (see system_set_hedge()):
+     its output so far, and its copy */
+  struct _HedgeTask *hedge;
+
+  /* its output was replayed from the result cache
+     (see system_set_result_cache()):  it didn't run */
+  gboolean from_cache;
+
+  /* from the rusage when the process was reaped;
+     0 if unknown (eg in SYSTEM_WORKERS_PERSISTENT mode) */
+  guint64 cpu_usecs;            /* user + system */
+  long max_rss;                 /* kilobytes */
+
+  /* the directory of the task's own cgroup, or -1:
+     see system_set_memory_budget() */
+  int cgroup_fd;
+
   union {
     struct {
+      /* in SYSTEM_WORKERS_PERSISTENT mode, the process
+         is the worker's shell and the fds below are unused */
+      struct _Worker *worker;
+
       pid_t pid;
 
       int stdin_fd;
       GSourceFD *stdin_source;
       GByteArray *stdin_output_buffer;
 
+      /* stdout and stderr are watched with a GSourceFD,
+         or read by a UringReader with the io_uring engine */
       int stdout_fd;
       GSourceFD *stdout_source;
-      GByteArray *stdout_input_buffer;
+      struct _UringReader *stdout_reader;
+      struct _LineBuffer *stdout_input_buffer;
+      TaskReadState stdout_read_state;
 
       int stderr_fd;
       GSourceFD *stderr_source;
-      GByteArray *stderr_input_buffer;
+      struct _UringReader *stderr_reader;
+      struct _LineBuffer *stderr_input_buffer;
+      TaskReadState stderr_read_state;
 
       TaskTerminationType termination_type;
       int termination_info;
@@ -77,8 +157,11 @@ struct _Task
   } info;
 };
 
+/* 'str' is 'len' bytes long, and NUL-terminated
+   unless the source has_stable_strs;  NULL at the end. */
 typedef void (*SourceCommandlineCallback)(Source *source,
                                           const char *str,
+                                          unsigned len,
                                           void *trap_data);
 struct _Source
 {
@@ -90,6 +173,11 @@ struct _Source
 
   SourceCommandlineCallback callback;
   void *trap_data;
+
+  /* if TRUE, the strings passed to callback stay valid
+     (eg they point into a mapped file) so they needn't be copied,
+     but they are not NUL-terminated */
+  gboolean has_stable_strs;
 };
 
 void source_trap   (Source *source,
@@ -97,6 +185,99 @@ void source_trap   (Source *source,
                     void *trap_data);
 void source_untrap (Source *source);
 
+/* --- generator-source.c --- */
+/* An input source that generates its command-lines, instead of
+ * reading them:  one for each combination of the variables' values
+ * (the last variable varies fastest), made from the command template
+ * (see cmd-template.h) with {NAME} replaced by the variable's value,
+ * and {} by all the values.
+ *
+ * Items are only made as they are asked for, so the memory used
+ * doesn't depend on how many there are.
+ *
+ * The variables and template must be set before the source is trapped.
+ */
+Source *generator_source_new          (void);
+void    generator_source_set_template (Source      *source,
+                                       const char  *command_template);
+
+/* start, start+step, ...;  up to but not including 'end' */
+void    generator_source_add_range (Source      *source,
+                                    const char  *name,
+                                    gint64       start,
+                                    gint64       end,
+                                    gint64       step);
+void    generator_source_add_list  (Source      *source,
+                                    const char  *name,
+                                    char       **values);
+
+/* --- walk-source.c --- */
+/* An input source that finds the files under one or more directories,
+ * using 'n_threads' threads to read directories at once, and gives
+ * their paths out as they are found (so tasks start before the
+ * walk is done).  If 'pattern' is non-NULL, only files whose
+ * name matches it (see fnmatch(3)) are given.  Symbolic links
+ * are given as files, never followed.  A root that isn't a
+ * directory is given itself.
+ *
+ * Once enough paths are waiting to be taken, the threads wait,
+ * so untrapping the source stops the walk.
+ */
+Source *walk_source_new (char      **roots,
+                         const char *pattern,
+                         unsigned    n_threads);
+
+/* --- dag.c --- */
+/* Run the tasks of a dependency graph, from 'filename':  a line
+ *     ID [DEPENDENCY...]: COMMAND
+ * for each task (blank lines and lines starting with '#' are ignored).
+ * The dependencies are the IDs of tasks that must succeed first;
+ * they may be anywhere in the file.  If a task fails, the tasks
+ * that depend on it (directly or not) are skipped.
+ *
+ * A task is queued as soon as its dependencies have succeeded;
+ * the one with the longest chain of tasks still to run after
+ * it (counting itself) starts first.
+ */
+gboolean system_add_input_dag (System     *system,
+                               const char *filename,
+                               GError    **error);
+
+/* --- serve.c --- */
+/* Accept clients on a unix-domain socket:  each connection is an
+ * input source of command-lines (lines, with the system's separator,
+ * until the client shuts down its end), and gets back a line for each
+ * event of its tasks, with the task's sequence number (its {#}):
+ *     start SEQNO CMDLINE
+ *     out SEQNO LINE          err SEQNO LINE
+ *     exit SEQNO STATUS       signal SEQNO SIGNAL
+ *     skip SEQNO FAILEDSEQ
+ * The connection is closed once all its tasks have ended.
+ *
+ * Clients are all run by this one system, so max_running_tasks
+ * applies to them together;  they share the slots fairly
+ * (see SourceSchedule).  The system is made to keep running
+ * (see system_set_keep_running()).
+ */
+gboolean system_serve (System     *system,
+                       const char *socket_path,
+                       GError    **error);
+
+/* The client:  send the command-lines from 'input_fd' to the server,
+ * and print the tasks' output to stdout and stderr.  Returns 1
+ * if any task failed, 0 if none did, or -1 on error. */
+int      serve_submit (const char *socket_path,
+                       int         input_fd,
+                       GError    **error);
+
+/* a NUL-terminated line of output, without its newline */
+typedef struct _TaskLine TaskLine;
+struct _TaskLine
+{
+  const char *text;
+  unsigned len;
+};
+
 typedef struct _SystemTrap SystemTrap;
 typedef struct _SystemTrapFuncs SystemTrapFuncs;
 struct _SystemTrapFuncs
@@ -124,24 +305,152 @@ struct _SystemTrapFuncs
   void (*all_done)    (System *system,
                        const GTimeVal *current_time,
                        gpointer handler_data);
+
+  /* optional:  if set, it is called instead of handle_line
+     with all the lines that arrived in one read */
+  void (*handle_lines) (Task *task,
+                        const GTimeVal *current_time,
+                        gboolean is_stderr, /* else is stdout */
+                        unsigned n_lines,
+                        const TaskLine *lines,
+                        gpointer handler_data);
 };
 
 
 
+/* How child processes are created.
+ *   - FORK: plain fork(); copies the page tables, so
+ *     it slows down as our heap grows.
+ *   - VFORK: vfork(); the child borrows our address space
+ *     until it calls exec.
+ *   - POSIX_SPAWN: posix_spawn() with file-actions for the
+ *     pipes (glibc implements it with clone(CLONE_VM|CLONE_VFORK)).
+ */
+typedef enum
+{
+  SYSTEM_SPAWN_FORK,
+  SYSTEM_SPAWN_VFORK,
+  SYSTEM_SPAWN_POSIX_SPAWN
+} SystemSpawnMethod;
+
+/* Whether each task gets its own process, or tasks are fed to
+ * a pool of long-lived shells (at most max_running_tasks of them)
+ * over their stdin.  In PERSISTENT mode each command runs in a subshell
+ * with stdin from /dev/null, and the worker reports its exit status;
+ * statuses above 128 are reported as the shell does:  a signal.
+ */
+typedef enum
+{
+  SYSTEM_WORKERS_ONESHOT,
+  SYSTEM_WORKERS_PERSISTENT
+} SystemWorkerMode;
+
+/* How task output is read.  IO_URING is the default,
+ * but it is only available when built with HAVE_IO_URING
+ * and run on linux 5.19 or later;  otherwise we fall back to POLL.
+ */
+typedef enum
+{
+  SYSTEM_IO_ENGINE_POLL,
+  SYSTEM_IO_ENGINE_IO_URING
+} SystemIOEngine;
+
+/* Which of an input source's waiting tasks starts first:
+ * the one that came first, or (with a runtime history, see
+ * system_set_history()) the one expected to take longest.
+ * Tasks that the history knows nothing about go first.
+ * Only the backlog that has been read (see
+ * system_set_max_unstarted_tasks()) is reordered.
+ */
+typedef enum
+{
+  SYSTEM_TASK_ORDER_FIFO,
+  SYSTEM_TASK_ORDER_LONGEST_FIRST
+} SystemTaskOrder;
+
+/* How tasks are pinned to cpus, by their slot:
+ *   COMPACT  each to one cpu, filling one NUMA node before the next
+ *   SCATTER  each to one cpu, taking the nodes in turn
+ *   NODE     each to all the cpus of one node, taking the nodes in turn
+ * (Only the cpus we may run on are used.)  With more slots than
+ * cpus (or nodes), the slots wrap around.
+ */
+typedef enum
+{
+  SYSTEM_PIN_NONE,
+  SYSTEM_PIN_COMPACT,
+  SYSTEM_PIN_SCATTER,
+  SYSTEM_PIN_NODE
+} SystemPinPolicy;
+
+typedef struct _SystemStats SystemStats;
+struct _SystemStats
+{
+  unsigned n_spawned;
+  guint64 spawn_usecs;          /* total time spent creating processes */
+  unsigned n_direct_exec;       /* exec'd without /bin/sh */
+  unsigned n_shell_exec;        /* run as /bin/sh -c CMDLINE */
+  guint64 child_cpu_usecs;      /* over all reaped tasks */
+  long child_max_rss;           /* largest of any task, in kilobytes */
+  unsigned n_adaptive_changes;  /* of max_running_tasks, by the controller */
+  unsigned n_memory_waits;      /* times a task was held back by the budget */
+  guint64 memory_peak_estimate; /* bytes, the last prediction of a task's peak */
+  unsigned n_hedged;            /* tasks that were given a copy */
+  unsigned n_hedge_wins;        /* ... whose copy finished first */
+  unsigned n_cache_hits;        /* tasks replayed from the result cache */
+  unsigned n_cache_stores;      /* results written to it */
+  unsigned n_cache_evictions;   /* results removed to keep it in size */
+};
+
+/* How much a resource was used (see system_add_resource()). */
+typedef struct _ResourceStats ResourceStats;
+struct _ResourceStats
+{
+  const char *name;
+  guint64 capacity;
+  guint64 max_used;
+  double mean_used;             /* averaged over the time since it was added */
+};
+
+/* How an input source's tasks share the slots with other sources'.
+ * All the sources are read at once.  A free slot goes to a source
+ * with the highest priority of those that have a task waiting;
+ * among those, slots are given out by deficit round-robin,
+ * in proportion to their weights.  A source may also have
+ * its own limit on running tasks (0 for none).
+ */
+typedef struct _SourceSchedule SourceSchedule;
+struct _SourceSchedule
+{
+  unsigned weight;
+  int priority;                 /* higher goes first */
+  unsigned max_running;
+};
+
 struct _System
 {
-  /* invariants: next_unstarted_task <= tasks->len 
-          AND    n_unstarted_tasks+n_running_tasks+n_finished_tasks = tasks->len
+  /* invariants: next_unstarted_task <= n_tasks
+          AND    n_unstarted_tasks+n_running_tasks+n_finished_tasks = n_tasks
+     (a system that keeps running doesn't keep its tasks in 'tasks')
    */
   GPtrArray *tasks;
+  unsigned n_tasks;
   unsigned next_unstarted_task;
   unsigned n_unstarted_tasks;
   unsigned n_running_tasks;
   unsigned n_finished_tasks;
 
-  GPtrArray *input_sources;
-  unsigned cur_input_source;
-  gboolean is_input_source_trapped;
+  /* a queue for each input source that may still give
+     command-lines, or has tasks waiting or running */
+  GPtrArray *input_queues;
+  unsigned n_open_sources;      /* that haven't given their last line */
+  unsigned drr_cursor;          /* the queue whose turn it is */
+  struct _InputQueue *batch_queue;      /* tasks made from batch_items */
+
+  /* for input sources added after it is set */
+  SourceSchedule input_schedule;
+  gboolean is_all_done;         /* the all_done traps have run */
+  gboolean keep_running;        /* see system_set_keep_running() */
 
   TaskMessage *first_message, *last_message;
   
@@ -151,6 +460,59 @@ struct _System
   unsigned max_running_tasks;
 
   SystemTrap *trap_list;
+
+  SystemSpawnMethod spawn_method;
+
+  /* exec simple command-lines directly, instead of through /bin/sh */
+  gboolean direct_exec;
+
+  SystemWorkerMode worker_mode;
+  struct _WorkerPool *worker_pool;
+
+  SystemIOEngine io_engine;
+
+  /* enlarge the pipes of tasks that keep filling them (F_SETPIPE_SZ) */
+  gboolean grow_pipes;
+
+  /* ends the lines of input sources added after it is set */
+  char input_separator;
+
+  /* if set, input lines are arguments for this, not command-lines */
+  struct _CmdTemplate *command_template;
+
+  /* if batch_max_items > 0, input lines are gathered
+     into batches, and each batch is one task */
+  unsigned batch_max_items;
+  gsize batch_max_bytes;
+  GPtrArray *batch_items;       /* read, but not yet in a task */
+  gsize batch_items_len;        /* their total length */
+
+  /* if set, tasks only start while they fit in the memory budget */
+  struct _MemoryBudget *memory_budget;
+
+  /* if set, how long tasks took, by command (see system_set_history()) */
+  struct _History *history;
+
+  /* for input sources added after it is set */
+  SystemTaskOrder task_order;
+
+  /* which running task is in which slot (see system_set_pin_policy()) */
+  struct _Slots *slots;
+
+  /* if set, tasks may need some of these (see system_add_resource()) */
+  struct _Resources *resources;
+
+  /* if set, stragglers get a copy (see system_set_hedge()) */
+  struct _Hedge *hedge;
+
+  /* if set, tasks that have succeeded before are replayed
+     (see system_set_result_cache()) */
+  struct _ResultCache *result_cache;
+
+  /* scratch space for gathering TaskLines */
+  GArray *tmp_lines;
+
+  SystemStats stats;
 };
 
 System *system_new                     (void);
@@ -167,6 +529,230 @@ void    system_set_max_unstarted_tasks (System *system,
                                         unsigned n);
 void    system_set_max_running_tasks   (System *system,
                                         unsigned n);
+void    system_set_spawn_method        (System *system,
+                                        SystemSpawnMethod method);
+void    system_set_direct_exec         (System  *system,
+                                        gboolean direct_exec);
+void    system_set_worker_mode         (System *system,
+                                        SystemWorkerMode mode);
+void    system_set_io_engine           (System *system,
+                                        SystemIOEngine engine);
+void    system_set_grow_pipes          (System  *system,
+                                        gboolean grow_pipes);
+void    system_set_input_separator     (System *system,
+                                        char    separator);
+
+/* Each input line is an argument for 'command_template' (see
+   cmd-template.h);  not a DAG's nodes, which are whole commands. */
+void    system_set_command_template    (System     *system,
+                                        const char *command_template);
+
+/* For the input sources added after it is set;  the default is FIFO. */
+void    system_set_task_order          (System         *system,
+                                        SystemTaskOrder order);
+
+/* For the input sources added after it is set;  the default
+   is a weight of 1, priority 0, and no limit of their own. */
+void    system_set_input_schedule      (System  *system,
+                                        unsigned weight,
+                                        int      priority,
+                                        unsigned max_running);
+
+/* Don't finish when the input sources run out:  for a server,
+   which adds a source for each client.  The all_done traps never run.
+   Nor are its tasks kept in system->tasks:  each is freed after its
+   ended traps, so set this before adding any input. */
+void    system_set_keep_running        (System  *system,
+                                        gboolean keep_running);
+
+/* Run up to 'max_items' input lines in each task (like xargs),
+ * in at most 'max_bytes' of command-line (0 for as much as
+ * ARG_MAX allows).  With a command template, each placeholder
+ * gets all of the batch's arguments;  otherwise the batch's
+ * command-lines are run by one shell.
+ *
+ * While input is being read, only full batches are started (unless
+ * nothing is running);  once it is all read, what is left is
+ * spread evenly over the free slots.
+ *
+ * Lines from all the input sources go into the same batches,
+ * so the sources' SourceSchedules don't apply.
+ */
+void    system_set_batch               (System *system,
+                                        unsigned max_items,
+                                        gsize    max_bytes);
+
+/* --- adaptive.c --- */
+/* Adjust max_running_tasks to keep the machine's pressure near
+ * 'target':  the percentage of time that some task was stalled
+ * waiting for cpu, io or memory (whichever is worst), from
+ * /proc/pressure, or estimated from the load average without it.
+ * The limit starts at the number of cpus and stays between 1
+ * and 'max_limit'.  It is lowered by an eighth while the pressure
+ * is well above the target, and raised by one while it is well below
+ * (and there are tasks waiting for a slot);  each change is logged.
+ */
+void    system_set_adaptive            (System  *system,
+                                        double   target,
+                                        unsigned max_limit);
+
+/* --- memory-budget.c --- */
+/* Only start a task while the memory in use by the running tasks,
+ * plus what the new task is predicted to need at its peak, fits
+ * in 'budget' bytes (but always start one if none are running).
+ * The prediction is the largest peak of the last few tasks to finish;
+ * until one has, a task is assumed to need an eighth of the budget.
+ *
+ * If 'use_cgroups', and we may create cgroups (cgroup v2, with the
+ * memory controller delegated to us), each task runs in its own
+ * cgroup under a new one for this process:  then the memory in use
+ * is the tasks' memory.current, and their peaks are their memory.peak.
+ * The cgroups are removed when all is done, or on SIGINT or SIGTERM
+ * (which is passed on to the tasks first).
+ * Otherwise each running task is counted as needing the prediction,
+ * and the peaks are the tasks' max-rss from their rusage.
+ *
+ * In SYSTEM_WORKERS_PERSISTENT mode nothing is learned about the tasks,
+ * so the budget merely limits how many run at once.
+ */
+void    system_set_memory_budget       (System  *system,
+                                        guint64  budget,
+                                        gboolean use_cgroups);
+
+/* --- history.c --- */
+/* Keep a runtime history in 'filename' (created if need be):
+ * for each command that succeeds, and for its class, an
+ * exponentially-weighted average of how long it took and
+ * of its peak memory.  A command's class is its template,
+ * with a command template;  otherwise its first word (the program).
+ * A command that hasn't been run is expected to take as long
+ * as its class.
+ *
+ * The file is an open-addressing hash table that is mmap()ed,
+ * so looking a command up doesn't read the file.  Runs that share
+ * a file at the same time may lose each other's updates.
+ * Batches (see system_set_batch()) aren't recorded.
+ *
+ * Set it before adding the input sources.
+ */
+gboolean system_set_history            (System     *system,
+                                        const char *filename,
+                                        GError    **error);
+
+/* --- slots.c --- */
+/* Each running task is in a slot, numbered from 0:  a task gets the
+ * lowest slot that is free when it starts, so there are as many
+ * slots as tasks run at once.  The slot is in the task's environment
+ * as PLINE_SLOT, so tasks that run at once can use separate scratch
+ * space.  With a pin policy other than NONE (the default), the task
+ * is also pinned (sched_setaffinity) to the cpus of its slot.
+ */
+void    system_set_pin_policy          (System         *system,
+                                        SystemPinPolicy policy);
+
+/* --- resources.c --- */
+/* A resource that there is 'capacity' of:  tasks that need some of it
+ * only start while it has room for them.  (Tasks that need more
+ * than all of it start when nothing else holds it.)  A task may
+ * need several resources;  it needs none unless it says so:
+ *   - an input line (or a DAG command) that starts with
+ *     "{NAME=AMOUNT,...} " needs those, and the rest is its command;
+ *   - otherwise, it needs what its input source does
+ *     (see system_set_input_needs()).
+ * An AMOUNT may have a K, M, G or T suffix (powers of 1024),
+ * so that "mem" may be counted in bytes.
+ *
+ * A task whose needs don't fit may be passed over for a later task
+ * from the same source whose needs do, so long as that doesn't take
+ * any of what the earlier task is short of:  a task that needs
+ * a lot waits only for what is held already to be given back.
+ * Only the first few waiting tasks of each source are looked at.
+ *
+ * Add the resources before any tasks, and before setting needs.
+ */
+gboolean system_add_resource           (System     *system,
+                                        const char *name,
+                                        guint64     capacity,
+                                        GError    **error);
+
+/* What each task of the input sources added after it is set needs,
+ * as "NAME=AMOUNT,...", or NULL for nothing.
+ */
+gboolean system_set_input_needs        (System     *system,
+                                        const char *needs,
+                                        GError    **error);
+
+/* FALSE once 'index' is past the last resource. */
+gboolean system_get_resource_stats     (System        *system,
+                                        unsigned       index,
+                                        ResourceStats *stats_out);
+
+/* --- hedge.c --- */
+/* Hedging, for tasks that may be run twice:  once every task
+ * has started and no more are coming, free slots go to copies
+ * of the stragglers.  A task is a straggler once it has run
+ * 'factor' times as long as the median of the tasks of its
+ * class (see system_set_history()) that have succeeded in this
+ * run;  that needs a few of them.  Whichever of a task and its
+ * copy finishes first is the one whose output and exit status
+ * the traps get, and the other is killed.  So the output of a task
+ * that may be copied is held back until it ends, and only then
+ * passed on.
+ *
+ * Tasks that need resources (see system_add_resource()) aren't
+ * copied, nor are tasks in SYSTEM_WORKERS_PERSISTENT mode;
+ * a copy isn't held to the memory budget.
+ */
+void    system_set_hedge               (System *system,
+                                        double  factor);
+
+/* --- result-cache.c --- */
+/* Keep the results of tasks that succeed in the directory 'dir':
+ * their stdout and stderr, and exit status.  A task whose inputs are
+ * those of a stored result isn't run:  the result is passed to the
+ * traps instead, as if the task had just run (with task->from_cache
+ * set).  A task's inputs are its command-line, the current directory,
+ * and what is added below.
+ *
+ * The results are files named by the SHA-256 of the inputs, and the
+ * store is kept under 'max_bytes' by removing those that were least
+ * recently used (by their mtime, so across runs).  Runs may share
+ * a store.  A task whose output is more than an eighth of it isn't
+ * stored.
+ */
+gboolean system_set_result_cache       (System     *system,
+                                        const char *dir,
+                                        guint64     max_bytes,
+                                        GError    **error);
+
+/* These may only be called before the first task starts. */
+
+/* The value of the environment variable 'name' is an input. */
+void     system_add_result_cache_env   (System     *system,
+                                        const char *name);
+
+/* The content of 'filename' is an input of every task:  it is read now. */
+gboolean system_add_result_cache_file  (System     *system,
+                                        const char *filename,
+                                        GError    **error);
+
+/* If 'stat_args', each word of a command-line that names a file
+ * makes the file's size and mtime an input of the task.
+ */
+void     system_set_result_cache_stat_args (System  *system,
+                                            gboolean stat_args);
+
+/* The input lines of a task that is a batch, or NULL. */
+const char * const *task_get_batch_items (Task     *task,
+                                          unsigned *n_items_out);
+
+/* Stop reading a running task's stdout and stderr, so that it
+   blocks once its pipes are full, or start reading them again.
+   Only tasks whose pipes are polled can be paused:  returns FALSE
+   for one read with io_uring, run by a persistent worker, or
+   replayed from the result cache. */
+gboolean task_set_output_paused (Task    *task,
+                                 gboolean paused);
 
 SystemTrap *system_trap                (System *system,
                                         SystemTrapFuncs *funcs,
@@ -2,15 +2,81 @@
 #include <string.h>
 #include <stdlib.h>
 #include <signal.h>
+#include <unistd.h>
+#include <sys/resource.h>
 #include "parallelizer.h"
 
 #define WINDOW_NAME                     "window1"
 
+/* percent of time stalled, see system_set_adaptive() */
+#define DEFAULT_ADAPTIVE_TARGET         10.0
+
+/* see system_set_result_cache() */
+#define DEFAULT_CACHE_SIZE              (G_GUINT64_CONSTANT (1) << 30)
+
+/* times the median, see system_set_hedge() */
+#define DEFAULT_HEDGE_FACTOR            3.0
+
+/* an -i input, with the schedule options given before it */
+typedef struct _CmdlineInput CmdlineInput;
+struct _CmdlineInput
+{
+  char *filename;
+  SourceSchedule schedule;
+  char *needs;
+};
+
 static GPtrArray *cmdline_inputs = NULL;
+static int cmdline_weight = 1;
+static int cmdline_priority = 0;
+static int cmdline_source_max = 0;
+static char *cmdline_needs = NULL;
+static GPtrArray *cmdline_resources = NULL;     /* NAME=AMOUNT strings */
 static int cmdline_max_parallel = -1;
+static char **cmdline_dags = NULL;
+static gboolean cmdline_stats = FALSE;
+static gboolean cmdline_always_shell = FALSE;
+static gboolean cmdline_grow_pipes = FALSE;
+static gboolean cmdline_null_separated = FALSE;
+static char **cmdline_template_words = NULL;
+static Source *cmdline_generator = NULL;
+static gboolean cmdline_batch = FALSE;
+static int cmdline_batch_items = 1000;
+static int cmdline_batch_bytes = 0;
+static char **cmdline_walk_roots = NULL;
+static char *cmdline_walk_name = NULL;
+static int cmdline_walk_threads = 8;
+static char *cmdline_serve = NULL;
+static char *cmdline_submit = NULL;
+static double cmdline_adaptive_target = 0;
+static double cmdline_hedge_factor = 0;
+static guint64 cmdline_memory_budget = 0;
+static SystemSpawnMethod cmdline_spawn_method = SYSTEM_SPAWN_POSIX_SPAWN;
+static SystemWorkerMode cmdline_worker_mode = SYSTEM_WORKERS_ONESHOT;
+static SystemIOEngine cmdline_io_engine = SYSTEM_IO_ENGINE_IO_URING;
+static SystemTaskOrder cmdline_task_order = SYSTEM_TASK_ORDER_FIFO;
+static SystemPinPolicy cmdline_pin_policy = SYSTEM_PIN_NONE;
+static char *cmdline_history = NULL;
+static char *cmdline_cache = NULL;
+static guint64 cmdline_cache_size = DEFAULT_CACHE_SIZE;
+static char **cmdline_cache_envs = NULL;
+static char **cmdline_cache_files = NULL;
+static gboolean cmdline_cache_stat_args = FALSE;
 
   static System *the_system;
 
+static void
+add_cmdline_input (const char *filename)
+{
+  CmdlineInput *input = g_new (CmdlineInput, 1);
+  input->filename = g_strdup (filename);
+  input->schedule.weight = MAX (cmdline_weight, 1);
+  input->schedule.priority = cmdline_priority;
+  input->schedule.max_running = MAX (cmdline_source_max, 0);
+  input->needs = g_strdup (cmdline_needs);
+  g_ptr_array_add (cmdline_inputs, input);
+}
+
 static gboolean
 handle_input (const gchar    *option_name,
               const gchar    *value,
@@ -20,7 +86,227 @@ handle_input (const gchar    *option_name,
   (void) option_name;
   (void) data;
   (void) error;
-  g_ptr_array_add (cmdline_inputs, g_strdup (value));
+  add_cmdline_input (value);
+  return TRUE;
+}
+
+static gboolean
+handle_adaptive (const gchar    *option_name,
+                 const gchar    *value,
+                 gpointer        data,
+                 GError        **error)
+{
+  char *end;
+  (void) option_name;
+  (void) data;
+  if (value == NULL)
+    {
+      cmdline_adaptive_target = DEFAULT_ADAPTIVE_TARGET;
+      return TRUE;
+    }
+  cmdline_adaptive_target = g_ascii_strtod (value, &end);
+  if (end == value || *end != 0 || cmdline_adaptive_target <= 0)
+    {
+      g_set_error (error, PARALLELIZER_ERROR_DOMAIN_QUARK,
+                   PARALLELIZER_ERROR_CMDLINE_ARG,
+                   "bad --adaptive target %s: expected a percentage", value);
+      return FALSE;
+    }
+  return TRUE;
+}
+
+static gboolean
+handle_hedge (const gchar    *option_name,
+              const gchar    *value,
+              gpointer        data,
+              GError        **error)
+{
+  char *end;
+  (void) option_name;
+  (void) data;
+  if (value == NULL)
+    {
+      cmdline_hedge_factor = DEFAULT_HEDGE_FACTOR;
+      return TRUE;
+    }
+  cmdline_hedge_factor = g_ascii_strtod (value, &end);
+  if (end == value || *end != 0 || cmdline_hedge_factor < 1)
+    {
+      g_set_error (error, PARALLELIZER_ERROR_DOMAIN_QUARK,
+                   PARALLELIZER_ERROR_CMDLINE_ARG,
+                   "bad --hedge factor %s: expected a number, at least 1", value);
+      return FALSE;
+    }
+  return TRUE;
+}
+
+/* a number of bytes, with an optional K, M, G or T (powers of 1024) */
+static gboolean
+parse_size (const char *str,
+            guint64    *size_out)
+{
+  char *end;
+  guint64 size = g_ascii_strtoull (str, &end, 10);
+  if (end == str)
+    return FALSE;
+  switch (g_ascii_toupper (*end))
+    {
+    case 'T': size <<= 10;      /* fall through */
+    case 'G': size <<= 10;      /* fall through */
+    case 'M': size <<= 10;      /* fall through */
+    case 'K': size <<= 10; end++; break;
+    case 0: break;
+    default: return FALSE;
+    }
+  if (*end == 'B' || *end == 'b')
+    end++;
+  if (*end != 0)
+    return FALSE;
+  *size_out = size;
+  return TRUE;
+}
+
+static gboolean
+handle_memory_budget (const gchar    *option_name,
+                      const gchar    *value,
+                      gpointer        data,
+                      GError        **error)
+{
+  (void) option_name;
+  (void) data;
+  if (!parse_size (value, &cmdline_memory_budget) || cmdline_memory_budget == 0)
+    {
+      g_set_error (error, PARALLELIZER_ERROR_DOMAIN_QUARK,
+                   PARALLELIZER_ERROR_CMDLINE_ARG,
+                   "bad --memory-budget %s: expected a size, like 512M or 16G",
+                   value);
+      return FALSE;
+    }
+  return TRUE;
+}
+
+static gboolean
+handle_cache_size (const gchar    *option_name,
+                   const gchar    *value,
+                   gpointer        data,
+                   GError        **error)
+{
+  (void) option_name;
+  (void) data;
+  if (!parse_size (value, &cmdline_cache_size) || cmdline_cache_size == 0)
+    {
+      g_set_error (error, PARALLELIZER_ERROR_DOMAIN_QUARK,
+                   PARALLELIZER_ERROR_CMDLINE_ARG,
+                   "bad --cache-size %s: expected a size, like 512M or 16G",
+                   value);
+      return FALSE;
+    }
+  return TRUE;
+}
+
+static gboolean
+handle_resource (const gchar    *option_name,
+                 const gchar    *value,
+                 gpointer        data,
+                 GError        **error)
+{
+  const char *eq = strchr (value, '=');
+  guint64 amount;
+  (void) option_name;
+  (void) data;
+  if (eq == NULL || eq == value || !parse_size (eq + 1, &amount))
+    {
+      g_set_error (error, PARALLELIZER_ERROR_DOMAIN_QUARK,
+                   PARALLELIZER_ERROR_CMDLINE_ARG,
+                   "bad --resource %s: expected NAME=AMOUNT, like io=4 or mem=64G",
+                   value);
+      return FALSE;
+    }
+  g_ptr_array_add (cmdline_resources, g_strdup (value));
+  return TRUE;
+}
+
+/* NAME=VALUES:  returns the VALUES part, with the NAME in *name_out */
+static const char *
+split_generator_spec (const char *value,
+                      char      **name_out,
+                      GError    **error)
+{
+  const char *eq = strchr (value, '=');
+  const char *at;
+  if (eq == NULL || eq == value)
+    goto bad_name;
+  for (at = value; at < eq; at++)
+    if (!g_ascii_isalnum (*at) && *at != '_')
+      goto bad_name;
+  *name_out = g_strndup (value, eq - value);
+  if (cmdline_generator == NULL)
+    cmdline_generator = generator_source_new ();
+  return eq + 1;
+
+bad_name:
+  g_set_error (error, PARALLELIZER_ERROR_DOMAIN_QUARK,
+               PARALLELIZER_ERROR_CMDLINE_ARG,
+               "bad variable in %s: expected NAME=..., with NAME alphanumeric",
+               value);
+  return NULL;
+}
+
+static gboolean
+handle_range (const gchar    *option_name,
+              const gchar    *value,
+              gpointer        data,
+              GError        **error)
+{
+  char *name;
+  const char *spec = split_generator_spec (value, &name, error);
+  gint64 start, end, step = 1;
+  char *at;
+  if (spec == NULL)
+    return FALSE;
+  start = g_ascii_strtoll (spec, &at, 10);
+  if (at == spec || *at != ':')
+    goto bad_range;
+  spec = at + 1;
+  end = g_ascii_strtoll (spec, &at, 10);
+  if (at == spec)
+    goto bad_range;
+  if (*at == ':')
+    {
+      spec = at + 1;
+      step = g_ascii_strtoll (spec, &at, 10);
+      if (at == spec || step == 0)
+        goto bad_range;
+    }
+  if (*at != 0)
+    goto bad_range;
+  generator_source_add_range (cmdline_generator, name, start, end, step);
+  g_free (name);
+  return TRUE;
+
+bad_range:
+  g_set_error (error, PARALLELIZER_ERROR_DOMAIN_QUARK,
+               PARALLELIZER_ERROR_CMDLINE_ARG,
+               "bad range %s: expected NAME=START:END[:STEP]", value);
+  g_free (name);
+  return FALSE;
+}
+
+static gboolean
+handle_product (const gchar    *option_name,
+                const gchar    *value,
+                gpointer        data,
+                GError        **error)
+{
+  char *name;
+  const char *spec = split_generator_spec (value, &name, error);
+  char **values;
+  if (spec == NULL)
+    return FALSE;
+  values = g_strsplit (spec, ",", 0);
+  generator_source_add_list (cmdline_generator, name, values);
+  g_strfreev (values);
+  g_free (name);
   return TRUE;
 }
 
@@ -82,6 +368,40 @@ syshandler__handle_line (Task *task,
            text);
 }
 
+static void
+syshandler__handle_lines (Task *task,
+                          const GTimeVal *current_time,
+                          gboolean is_stderr, /* else is stdout */
+                          unsigned n_lines,
+                          const TaskLine *lines,
+                          gpointer handler_data)
+{
+  static GString *out = NULL;
+  char prefix[128];
+  unsigned prefix_len;
+  unsigned i;
+  if (out == NULL)
+    out = g_string_new ("");
+  maybe_uptime_last_time_secs (current_time->tv_sec);
+  prefix_len = g_snprintf (prefix, sizeof (prefix),
+                           "%s.%03u [%6u]%c ",
+                           last_time_str,
+                           (unsigned) (current_time->tv_usec/1000),
+                           task->task_index,
+                           is_stderr ? '!' : ':');
+
+  /* all lines share a timestamp, so format them all with one write */
+  g_string_truncate (out, 0);
+  for (i = 0; i < n_lines; i++)
+    {
+      g_string_append_len (out, prefix, prefix_len);
+      g_string_append_len (out, lines[i].text, lines[i].len);
+      g_string_append_c (out, '\n');
+    }
+  if (fwrite (out->str, out->len, 1, is_stderr ? stderr : stdout) != 1)
+    g_error ("error writing output");
+}
+
 static void
 syshandler__ended       (Task *task,
                          const GTimeVal *current_time,
@@ -107,6 +427,11 @@ syshandler__ended       (Task *task,
                last_time_str, current_time->tv_usec/1000, task->task_index,
                termination_info, g_strsignal (termination_info));
       break;
+    case TASK_TERMINATION_SKIPPED:
+      fprintf (stderr, "%s.%03u! Task %u skipped: task %d failed: %s\n",
+               last_time_str, current_time->tv_usec/1000, task->task_index,
+               termination_info, task->str);
+      break;
     }
 }
 
@@ -135,7 +460,10 @@ chunked__handle_task_started (Task *task,
                          const char *cmdline,
                          void *handler_data)
 {
-  g_ptr_array_add (chunked_per_process_data, g_byte_array_new ());
+  /* tasks may start out of order (see SourceSchedule) */
+  if (chunked_per_process_data->len <= task->task_index)
+    g_ptr_array_set_size (chunked_per_process_data, task->task_index + 1);
+  chunked_per_process_data->pdata[task->task_index] = g_byte_array_new ();
 }
 static void
 chunked__handle_data (Task *task,
@@ -170,6 +498,19 @@ chunked__handle_line (Task *task,
   syshandler__handle_line (task, current_time, TRUE, text, NULL);
 }
 
+static void
+chunked__handle_lines (Task *task,
+                       const GTimeVal *current_time,
+                       gboolean is_stderr, /* else is stdout */
+                       unsigned n_lines,
+                       const TaskLine *lines,
+                       gpointer handler_data)
+{
+  if (!is_stderr)
+    return;
+  syshandler__handle_lines (task, current_time, TRUE, n_lines, lines, NULL);
+}
+
 static void
 chunked__ended       (Task *task,
                          const GTimeVal *current_time,
@@ -195,6 +536,19 @@ chunked__ended       (Task *task,
                last_time_str, current_time->tv_usec/1000, task->task_index,
                termination_info, g_strsignal (termination_info));
       break;
+    case TASK_TERMINATION_SKIPPED:
+      fprintf (stderr, "%s.%03u! Task %u skipped: task %d failed: %s\n",
+               last_time_str, current_time->tv_usec/1000, task->task_index,
+               termination_info, task->str);
+      break;
+    }
+
+  /* it never started, so it has no buffer */
+  if (termination_type == TASK_TERMINATION_SKIPPED)
+    {
+      if (chunked_per_process_data->len <= task->task_index)
+        g_ptr_array_set_size (chunked_per_process_data, task->task_index + 1);
+      chunked_per_process_data->pdata[task->task_index] = g_byte_array_new ();
     }
 
   if (task->task_index == chunked_next_to_end)
@@ -204,8 +558,10 @@ chunked__ended       (Task *task,
         {
           Task *task = the_system->tasks->pdata[chunked_next_to_end];
 
-          /* dump any output from task */
+          /* dump any output from task, unless it hasn't started */
           GByteArray *o = chunked_per_process_data->pdata[chunked_next_to_end];
+          if (o == NULL)
+            break;
           if (o->len > 0 && fwrite (o->data, o->len, 1, stdout) != 1)
             g_error ("error writing to standard-output");
 
@@ -246,7 +602,8 @@ static struct {
       syshandler__handle_data,
       syshandler__handle_line,
       syshandler__ended,
-      syshandler__all_done
+      syshandler__all_done,
+      syshandler__handle_lines
     }
   },
   {
@@ -258,13 +615,108 @@ static struct {
       chunked__handle_data,
       chunked__handle_line,
       chunked__ended,
-      chunked__all_done
+      chunked__all_done,
+      chunked__handle_lines
     }
   },
 };
 
 static SystemTrapFuncs *trap_funcs = &modes[0].funcs;
 
+/* --stats:  a summary written to stderr when everything is done.
+   This trap is registered after the mode's trap so that it
+   runs first (the mode's all_done handler exits). */
+static gint64 stats_start_time;
+static unsigned stats_n_ended = 0;
+
+static void
+stats__ended            (Task *task,
+                         const GTimeVal *current_time,
+                         TaskTerminationType termination_type,
+                         int termination_info,
+                         gpointer handler_data)
+{
+  stats_n_ended++;
+}
+
+static void
+stats__all_done         (System *system,
+                         const GTimeVal *current_time,
+                         gpointer handler_data)
+{
+  double elapsed = (g_get_monotonic_time () - stats_start_time) / 1e6;
+  const SystemStats *stats = &system->stats;
+  ResourceStats resource_stats;
+  struct rusage usage;
+  unsigned i;
+  getrusage (RUSAGE_SELF, &usage);
+  fprintf (stderr, "stats: %u tasks in %.3fs (%.1f tasks/s)\n",
+           stats_n_ended, elapsed,
+           elapsed > 0 ? stats_n_ended / elapsed : 0.0);
+  fprintf (stderr, "stats: %u processes spawned, %.1fus average spawn time\n",
+           stats->n_spawned,
+           stats->n_spawned ? (double) stats->spawn_usecs / stats->n_spawned : 0.0);
+  fprintf (stderr, "stats: %u exec'd directly, %u via /bin/sh\n",
+           stats->n_direct_exec, stats->n_shell_exec);
+  fprintf (stderr, "stats: output read with %s\n",
+           system->io_engine == SYSTEM_IO_ENGINE_IO_URING ? "io_uring" : "poll");
+  fprintf (stderr, "stats: tasks used %.3fs cpu, largest max-rss %ldkB\n",
+           stats->child_cpu_usecs / 1e6, stats->child_max_rss);
+  if (stats->n_adaptive_changes > 0)
+    fprintf (stderr, "stats: %u adaptive changes, ending at %u running tasks\n",
+             stats->n_adaptive_changes, system->max_running_tasks);
+  if (system->memory_budget != NULL)
+    fprintf (stderr, "stats: memory budget held tasks back %u times, "
+                     "last predicted peak %.1fMB\n",
+             stats->n_memory_waits, stats->memory_peak_estimate / 1048576.0);
+  if (system->result_cache != NULL)
+    fprintf (stderr, "stats: result cache: %u hits, %u stored, %u evicted\n",
+             stats->n_cache_hits, stats->n_cache_stores, stats->n_cache_evictions);
+  if (system->hedge != NULL)
+    fprintf (stderr, "stats: %u tasks hedged, %u won by the copy\n",
+             stats->n_hedged, stats->n_hedge_wins);
+  for (i = 0; system_get_resource_stats (system, i, &resource_stats); i++)
+    fprintf (stderr, "stats: resource %s: %.1f%% used on average, "
+                     "%" G_GUINT64_FORMAT " of %" G_GUINT64_FORMAT " at most\n",
+             resource_stats.name,
+             resource_stats.capacity > 0
+               ? 100.0 * resource_stats.mean_used / resource_stats.capacity : 0.0,
+             resource_stats.max_used, resource_stats.capacity);
+  fprintf (stderr, "stats: parent max-rss %ldkB\n", usage.ru_maxrss);
+}
+
+static SystemTrapFuncs stats_funcs =
+{
+  NULL,
+  NULL,
+  NULL,
+  stats__ended,
+  stats__all_done
+};
+
+static gboolean
+handle_spawn (const gchar    *option_name,
+              const gchar    *value,
+              gpointer        data,
+              GError        **error)
+{
+  if (strcmp (value, "fork") == 0)
+    cmdline_spawn_method = SYSTEM_SPAWN_FORK;
+  else if (strcmp (value, "vfork") == 0)
+    cmdline_spawn_method = SYSTEM_SPAWN_VFORK;
+  else if (strcmp (value, "posix_spawn") == 0)
+    cmdline_spawn_method = SYSTEM_SPAWN_POSIX_SPAWN;
+  else
+    {
+      g_set_error (error, PARALLELIZER_ERROR_DOMAIN_QUARK,
+                   PARALLELIZER_ERROR_CMDLINE_ARG,
+                   "bad spawn method %s: expected fork, vfork or posix_spawn",
+                   value);
+      return FALSE;
+    }
+  return TRUE;
+}
+
 static gboolean
 handle_mode  (const gchar    *option_name,
               const gchar    *value,
@@ -310,13 +762,174 @@ handle_list_modes  (const gchar    *option_name,
 }
 
 
+static gboolean
+handle_workers (const gchar    *option_name,
+                const gchar    *value,
+                gpointer        data,
+                GError        **error)
+{
+  if (strcmp (value, "oneshot") == 0)
+    cmdline_worker_mode = SYSTEM_WORKERS_ONESHOT;
+  else if (strcmp (value, "persistent") == 0)
+    cmdline_worker_mode = SYSTEM_WORKERS_PERSISTENT;
+  else
+    {
+      g_set_error (error, PARALLELIZER_ERROR_DOMAIN_QUARK,
+                   PARALLELIZER_ERROR_CMDLINE_ARG,
+                   "bad workers mode %s: expected oneshot or persistent",
+                   value);
+      return FALSE;
+    }
+  return TRUE;
+}
+
+static gboolean
+handle_io_engine (const gchar    *option_name,
+                  const gchar    *value,
+                  gpointer        data,
+                  GError        **error)
+{
+  if (strcmp (value, "poll") == 0)
+    cmdline_io_engine = SYSTEM_IO_ENGINE_POLL;
+  else if (strcmp (value, "io_uring") == 0)
+    cmdline_io_engine = SYSTEM_IO_ENGINE_IO_URING;
+  else
+    {
+      g_set_error (error, PARALLELIZER_ERROR_DOMAIN_QUARK,
+                   PARALLELIZER_ERROR_CMDLINE_ARG,
+                   "bad io engine %s: expected poll or io_uring",
+                   value);
+      return FALSE;
+    }
+  return TRUE;
+}
+
+static gboolean
+handle_order (const gchar    *option_name,
+              const gchar    *value,
+              gpointer        data,
+              GError        **error)
+{
+  if (strcmp (value, "fifo") == 0)
+    cmdline_task_order = SYSTEM_TASK_ORDER_FIFO;
+  else if (strcmp (value, "ljf") == 0)
+    cmdline_task_order = SYSTEM_TASK_ORDER_LONGEST_FIRST;
+  else
+    {
+      g_set_error (error, PARALLELIZER_ERROR_DOMAIN_QUARK,
+                   PARALLELIZER_ERROR_CMDLINE_ARG,
+                   "bad order %s: expected fifo or ljf",
+                   value);
+      return FALSE;
+    }
+  return TRUE;
+}
+
+static gboolean
+handle_pin (const gchar    *option_name,
+            const gchar    *value,
+            gpointer        data,
+            GError        **error)
+{
+  if (strcmp (value, "none") == 0)
+    cmdline_pin_policy = SYSTEM_PIN_NONE;
+  else if (strcmp (value, "compact") == 0)
+    cmdline_pin_policy = SYSTEM_PIN_COMPACT;
+  else if (strcmp (value, "scatter") == 0)
+    cmdline_pin_policy = SYSTEM_PIN_SCATTER;
+  else if (strcmp (value, "node") == 0)
+    cmdline_pin_policy = SYSTEM_PIN_NODE;
+  else
+    {
+      g_set_error (error, PARALLELIZER_ERROR_DOMAIN_QUARK,
+                   PARALLELIZER_ERROR_CMDLINE_ARG,
+                   "bad pin policy %s: expected none, compact, scatter or node",
+                   value);
+      return FALSE;
+    }
+  return TRUE;
+}
+
 static GOptionEntry op_entries[] =
 {
   {"input", 'i', 0, G_OPTION_ARG_CALLBACK, handle_input, "script to run", "FILENAME"},
   {"max-parallel", 'n', 0, G_OPTION_ARG_INT, &cmdline_max_parallel, "max processes to run at once", "N"},
+  {"weight", 0, 0, G_OPTION_ARG_INT, &cmdline_weight,
+   "the -i scripts after this get a W-times share of the slots (default 1)", "W"},
+  {"priority", 0, 0, G_OPTION_ARG_INT, &cmdline_priority,
+   "the -i scripts after this go before those with a lower P (default 0)", "P"},
+  {"source-max", 0, 0, G_OPTION_ARG_INT, &cmdline_source_max,
+   "the -i scripts after this each run at most N tasks at once (0: no limit)", "N"},
+  {"resource", 0, 0, G_OPTION_ARG_CALLBACK, handle_resource,
+   "there is AMOUNT of NAME, for tasks that need it (may be repeated)", "NAME=AMOUNT"},
+  {"needs", 0, 0, G_OPTION_ARG_STRING, &cmdline_needs,
+   "each task of the -i scripts after this (and of --dag, --walk, --range, --product) needs these resources, "
+   "unless its line starts with {NAME=AMOUNT,...}", "NAME=AMOUNT,..."},
   {"mode", 'm', 0, G_OPTION_ARG_CALLBACK, handle_mode, "specify mode of operation", "MODE"},
   {"list-modes", 0, G_OPTION_FLAG_NO_ARG, G_OPTION_ARG_CALLBACK, handle_list_modes,
    "list all modes of operation", NULL },
+  {"spawn", 0, 0, G_OPTION_ARG_CALLBACK, handle_spawn,
+   "how to create processes (fork, vfork, posix_spawn)", "METHOD"},
+  {"workers", 0, 0, G_OPTION_ARG_CALLBACK, handle_workers,
+   "oneshot (a process per task) or persistent (reuse shells)", "MODE"},
+  {"io-engine", 0, 0, G_OPTION_ARG_CALLBACK, handle_io_engine,
+   "how to read task output (poll, io_uring)", "ENGINE"},
+  {"pin", 0, 0, G_OPTION_ARG_CALLBACK, handle_pin,
+   "pin each task to the cpus of its slot (none, compact, scatter, node)", "POLICY"},
+  {"adaptive", 0, G_OPTION_FLAG_OPTIONAL_ARG, G_OPTION_ARG_CALLBACK, handle_adaptive,
+   "adjust -n to keep cpu/io/memory pressure near TARGET percent (default 10)", "TARGET"},
+  {"hedge", 0, G_OPTION_FLAG_OPTIONAL_ARG, G_OPTION_ARG_CALLBACK, handle_hedge,
+   "once all tasks have started, copy those that have run K times their class's median (default 3), "
+   "and keep whichever finishes first;  only for tasks that are safe to run twice", "K"},
+  {"memory-budget", 0, 0, G_OPTION_ARG_CALLBACK, handle_memory_budget,
+   "only start tasks while their predicted memory fits in SIZE", "SIZE"},
+  {"history", 0, 0, G_OPTION_ARG_FILENAME, &cmdline_history,
+   "record how long tasks take in FILE (default with --order=ljf: ~/.cache/pline/history)", "FILE"},
+  {"order", 0, 0, G_OPTION_ARG_CALLBACK, handle_order,
+   "which waiting task starts first: fifo, or ljf (longest expected first)", "ORDER"},
+  {"cache", 0, 0, G_OPTION_ARG_FILENAME, &cmdline_cache,
+   "replay the output of tasks that have succeeded before from the store in DIR", "DIR"},
+  {"cache-size", 0, 0, G_OPTION_ARG_CALLBACK, handle_cache_size,
+   "with --cache, remove the least recently used results past SIZE (default 1G)", "SIZE"},
+  {"cache-env", 0, 0, G_OPTION_ARG_STRING_ARRAY, &cmdline_cache_envs,
+   "with --cache, tasks' results depend on the environment variable NAME (may be repeated)", "NAME"},
+  {"cache-file", 0, 0, G_OPTION_ARG_FILENAME_ARRAY, &cmdline_cache_files,
+   "with --cache, tasks' results depend on the content of FILE (may be repeated)", "FILE"},
+  {"cache-stat-args", 0, 0, G_OPTION_ARG_NONE, &cmdline_cache_stat_args,
+   "with --cache, a task's result depends on the size and mtime of the files its command-line names", NULL},
+  {"always-shell", 0, 0, G_OPTION_ARG_NONE, &cmdline_always_shell,
+   "run every command-line with /bin/sh, even simple ones", NULL},
+  {"grow-pipes", 0, 0, G_OPTION_ARG_NONE, &cmdline_grow_pipes,
+   "enlarge the pipes of tasks that keep filling them", NULL},
+  {"range", 0, 0, G_OPTION_ARG_CALLBACK, handle_range,
+   "generate tasks for each VAR from START up to END (use {VAR} in the command)",
+   "VAR=START:END[:STEP]"},
+  {"product", 0, 0, G_OPTION_ARG_CALLBACK, handle_product,
+   "generate tasks for each of the VALUES of VAR", "VAR=VALUE,..."},
+  {"null", '0', 0, G_OPTION_ARG_NONE, &cmdline_null_separated,
+   "input lines are terminated by NUL, not newline", NULL},
+  {"batch", 'X', 0, G_OPTION_ARG_NONE, &cmdline_batch,
+   "run several input lines per process", NULL},
+  {"batch-items", 0, 0, G_OPTION_ARG_INT, &cmdline_batch_items,
+   "with --batch, at most N input lines per process (default 1000)", "N"},
+  {"batch-bytes", 0, 0, G_OPTION_ARG_INT, &cmdline_batch_bytes,
+   "with --batch, at most N bytes of command-line (default: as ARG_MAX allows)", "N"},
+  {"dag", 0, 0, G_OPTION_ARG_FILENAME_ARRAY, &cmdline_dags,
+   "run the tasks of a dependency graph: lines of ID [DEPENDENCY...]: COMMAND", "FILENAME"},
+  {"walk", 0, 0, G_OPTION_ARG_FILENAME_ARRAY, &cmdline_walk_roots,
+   "run the command for each file under DIR (may be repeated)", "DIR"},
+  {"walk-name", 0, 0, G_OPTION_ARG_STRING, &cmdline_walk_name,
+   "with --walk, only files whose name matches the shell PATTERN", "PATTERN"},
+  {"walk-threads", 0, 0, G_OPTION_ARG_INT, &cmdline_walk_threads,
+   "with --walk, read N directories at once (default 8)", "N"},
+  {"serve", 0, 0, G_OPTION_ARG_FILENAME, &cmdline_serve,
+   "keep running, and run the command-lines that clients send to SOCKET", "SOCKET"},
+  {"submit", 0, 0, G_OPTION_ARG_FILENAME, &cmdline_submit,
+   "send the command-lines on stdin to the server at SOCKET, and print their output", "SOCKET"},
+  {G_OPTION_REMAINING, 0, 0, G_OPTION_ARG_STRING_ARRAY, &cmdline_template_words,
+   NULL, "[-- COMMAND {}...]"},
+  {"stats", 0, 0, G_OPTION_ARG_NONE, &cmdline_stats,
+   "print a performance summary to stderr at exit", NULL},
   {NULL,0,0,0,NULL,NULL,NULL}
 };
 
@@ -328,6 +941,7 @@ int main(int argc, char **argv)
   unsigned i;
 
   cmdline_inputs = g_ptr_array_new ();
+  cmdline_resources = g_ptr_array_new ();
   op_context = g_option_context_new (NULL);
   g_option_context_set_summary (op_context, "run several programs in parallel");
   g_option_context_add_main_entries (op_context, op_entries, NULL);
@@ -341,14 +955,131 @@ int main(int argc, char **argv)
   /* ignore sigpipe */
   signal (SIGPIPE, SIG_IGN);
 
+  if (cmdline_submit != NULL)
+    {
+      int rv = serve_submit (cmdline_submit, 0, &error);
+      if (rv < 0)
+        g_error ("submitting: %s", error->message);
+      return rv;
+    }
+
   unsigned n_input_sources = 0;
   the_system = system_new ();
-  system_trap (the_system, trap_funcs, NULL);
+
+  /* a server's events go to its clients */
+  if (cmdline_serve == NULL)
+    system_trap (the_system, trap_funcs, NULL);
+  if (cmdline_stats && cmdline_serve == NULL)
+    {
+      stats_start_time = g_get_monotonic_time ();
+      system_trap (the_system, &stats_funcs, NULL);
+    }
+  system_set_spawn_method (the_system, cmdline_spawn_method);
+  if (cmdline_always_shell)
+    system_set_direct_exec (the_system, FALSE);
+  system_set_worker_mode (the_system, cmdline_worker_mode);
+  system_set_io_engine (the_system, cmdline_io_engine);
+  system_set_pin_policy (the_system, cmdline_pin_policy);
+  if (cmdline_needs != NULL && cmdline_resources->len == 0)
+    g_error ("--needs takes the resources that --resource defines");
+  for (i = 0; i < cmdline_resources->len; i++)
+    {
+      char *spec = cmdline_resources->pdata[i];
+      char *eq = strchr (spec, '=');
+      guint64 amount;
+      *eq = 0;
+      parse_size (eq + 1, &amount);
+      if (!system_add_resource (the_system, spec, amount, &error))
+        g_error ("%s", error->message);
+    }
+  system_set_grow_pipes (the_system, cmdline_grow_pipes);
   if (cmdline_max_parallel > 0)
     system_set_max_running_tasks (the_system, cmdline_max_parallel);
+  if (cmdline_adaptive_target > 0)
+    {
+      /* with -n, that is the most;  otherwise a few per cpu */
+      long n_cpus = sysconf (_SC_NPROCESSORS_ONLN);
+      unsigned max_limit = cmdline_max_parallel > 0 ? (unsigned) cmdline_max_parallel
+                         : 4 * (unsigned) MAX (n_cpus, 1);
+      system_set_adaptive (the_system, cmdline_adaptive_target, max_limit);
+    }
+  if (cmdline_hedge_factor > 0)
+    system_set_hedge (the_system, cmdline_hedge_factor);
+  if (cmdline_memory_budget > 0)
+    system_set_memory_budget (the_system, cmdline_memory_budget, TRUE);
+  if (cmdline_history == NULL
+   && cmdline_task_order == SYSTEM_TASK_ORDER_LONGEST_FIRST)
+    {
+      char *dir = g_build_filename (g_get_user_cache_dir (), "pline", NULL);
+      g_mkdir_with_parents (dir, 0755);
+      cmdline_history = g_build_filename (dir, "history", NULL);
+      g_free (dir);
+    }
+  if (cmdline_history != NULL
+   && !system_set_history (the_system, cmdline_history, &error))
+    g_error ("runtime history: %s", error->message);
+  system_set_task_order (the_system, cmdline_task_order);
+  if (cmdline_cache == NULL
+   && (cmdline_cache_envs != NULL || cmdline_cache_files != NULL
+    || cmdline_cache_stat_args))
+    g_error ("--cache-env, --cache-file and --cache-stat-args need --cache");
+  if (cmdline_cache != NULL)
+    {
+      if (!system_set_result_cache (the_system, cmdline_cache,
+                                    cmdline_cache_size, &error))
+        g_error ("result cache: %s", error->message);
+      for (i = 0; cmdline_cache_envs != NULL && cmdline_cache_envs[i] != NULL; i++)
+        system_add_result_cache_env (the_system, cmdline_cache_envs[i]);
+      for (i = 0; cmdline_cache_files != NULL && cmdline_cache_files[i] != NULL; i++)
+        if (!system_add_result_cache_file (the_system, cmdline_cache_files[i], &error))
+          g_error ("result cache: %s", error->message);
+      system_set_result_cache_stat_args (the_system, cmdline_cache_stat_args);
+    }
+  if (cmdline_null_separated)
+    system_set_input_separator (the_system, 0);
+  if (cmdline_batch)
+    system_set_batch (the_system, MAX (cmdline_batch_items, 1),
+                      MAX (cmdline_batch_bytes, 0));
+  if (cmdline_serve != NULL
+   && (cmdline_inputs->len > 0 || cmdline_walk_roots != NULL
+    || cmdline_generator != NULL || cmdline_batch || cmdline_dags != NULL))
+    g_error ("--serve takes its input from clients:  it cannot be used with -i, --dag, --walk, --range, --product or --batch");
+  if (cmdline_generator != NULL)
+    {
+      /* the template is the generator's */
+      char *text;
+      if (cmdline_template_words == NULL)
+        g_error ("--range and --product need a command:  -- COMMAND {VAR}...");
+      if (cmdline_walk_roots != NULL)
+        g_error ("--walk cannot be used with --range or --product");
+      text = g_strjoinv (" ", cmdline_template_words);
+      generator_source_set_template (cmdline_generator, text);
+      g_free (text);
+    }
+  else if (cmdline_template_words != NULL)
+    {
+      char *text = g_strjoinv (" ", cmdline_template_words);
+      system_set_command_template (the_system, text);
+      g_free (text);
+
+      /* like xargs, read arguments from stdin by default */
+      if (cmdline_inputs->len == 0 && cmdline_walk_roots == NULL
+       && cmdline_dags == NULL && cmdline_serve == NULL)
+        add_cmdline_input ("-");
+    }
+  else if (cmdline_walk_roots != NULL)
+    g_error ("--walk needs a command:  -- COMMAND {}...");
   for (i = 0; i < cmdline_inputs->len; i++)
     {
-      const char *filename = cmdline_inputs->pdata[i];
+      CmdlineInput *input = cmdline_inputs->pdata[i];
+      const char *filename = input->filename;
+      system_set_input_schedule (the_system,
+                                 input->schedule.weight,
+                                 input->schedule.priority,
+                                 input->schedule.max_running);
+      if (cmdline_resources->len > 0
+       && !system_set_input_needs (the_system, input->needs, &error))
+        g_error ("--needs: %s", error->message);
       if (strcmp (filename, "-") == 0)
         {
           n_input_sources++;
@@ -361,7 +1092,35 @@ int main(int argc, char **argv)
           n_input_sources++;
         }
     }
-  if (n_input_sources == 0)
+  system_set_input_schedule (the_system, 1, 0, 0);
+  if (cmdline_resources->len > 0
+   && !system_set_input_needs (the_system, cmdline_needs, &error))
+    g_error ("--needs: %s", error->message);
+  for (i = 0; cmdline_dags != NULL && cmdline_dags[i] != NULL; i++)
+    {
+      if (!system_add_input_dag (the_system, cmdline_dags[i], &error))
+        g_error ("reading dependency graph: %s", error->message);
+      n_input_sources++;
+    }
+  if (cmdline_walk_roots != NULL)
+    {
+      n_input_sources++;
+      system_add_input_source (the_system,
+                               walk_source_new (cmdline_walk_roots,
+                                                cmdline_walk_name,
+                                                MAX (cmdline_walk_threads, 1)));
+    }
+  if (cmdline_generator != NULL)
+    {
+      n_input_sources++;
+      system_add_input_source (the_system, cmdline_generator);
+    }
+  if (cmdline_serve != NULL)
+    {
+      if (!system_serve (the_system, cmdline_serve, &error))
+        g_error ("serving: %s", error->message);
+    }
+  else if (n_input_sources == 0)
     {
       fprintf (stderr,
                "%s: no inputs given, nothing to do.  try --help\n",
@@ -0,0 +1,342 @@
+#include <string.h>
+#include "parallelizer-private.h"
+
+/* resources are kept in a bitmask, while looking for a task to start */
+#define MAX_RESOURCES           64
+
+typedef struct _Resource Resource;
+struct _Resource
+{
+  char *name;
+  guint64 capacity;
+  guint64 in_use;
+
+  /* for ResourceStats */
+  guint64 max_used;
+  double used_usecs;            /* in_use, integrated over time */
+  gint64 last_change_time;
+};
+
+typedef struct _Resources Resources;
+struct _Resources
+{
+  GPtrArray *resources;
+  gint64 start_time;
+
+  /* for the input sources added after it is set (see
+     system_set_input_needs()), or NULL;  owned by 'input_needs_list' */
+  guint64 *input_needs;
+  GPtrArray *input_needs_list;
+
+  gboolean warned_unknown;
+};
+
+static Resources *
+get_resources (System *system)
+{
+  Resources *resources = system->resources;
+  if (resources != NULL)
+    return resources;
+  resources = g_slice_new (Resources);
+  resources->resources = g_ptr_array_new ();
+  resources->start_time = g_get_monotonic_time ();
+  resources->input_needs = NULL;
+  resources->input_needs_list = g_ptr_array_new_with_free_func (g_free);
+  resources->warned_unknown = FALSE;
+  system->resources = resources;
+  return resources;
+}
+
+static int
+find_resource (Resources  *resources,
+               const char *name,
+               gsize       name_len)
+{
+  unsigned i;
+  for (i = 0; i < resources->resources->len; i++)
+    {
+      Resource *resource = resources->resources->pdata[i];
+      if (strlen (resource->name) == name_len
+       && memcmp (resource->name, name, name_len) == 0)
+        return i;
+    }
+  return -1;
+}
+
+/* a count, with an optional K, M, G or T (powers of 1024, for memory) */
+static gboolean
+parse_amount (const char  *str,
+              const char **end_out,
+              guint64     *amount_out)
+{
+  char *end;
+  guint64 amount = g_ascii_strtoull (str, &end, 10);
+  if (end == str)
+    return FALSE;
+  switch (g_ascii_toupper (*end))
+    {
+    case 'T': amount <<= 10;    /* fall through */
+    case 'G': amount <<= 10;    /* fall through */
+    case 'M': amount <<= 10;    /* fall through */
+    case 'K': amount <<= 10; end++; break;
+    default: break;
+    }
+  if (*end == 'B' || *end == 'b')
+    end++;
+  *end_out = end;
+  *amount_out = amount;
+  return TRUE;
+}
+
+/* Parse "NAME=AMOUNT,..." up to 'end' into a new array of needs.
+   Names that aren't resources are an error if 'error' isn't NULL;
+   otherwise they are ignored, with a warning the first time. */
+static guint64 *
+parse_needs (Resources  *resources,
+             const char *str,
+             const char *end,
+             GError    **error)
+{
+  guint64 *needs = g_new0 (guint64, resources->resources->len);
+  const char *at = str;
+  while (at < end)
+    {
+      const char *eq = memchr (at, '=', end - at);
+      const char *amount_end;
+      guint64 amount;
+      int index;
+      if (eq == NULL || eq == at
+       || !parse_amount (eq + 1, &amount_end, &amount)
+       || (amount_end != end && *amount_end != ','))
+        {
+          g_set_error (error, PARALLELIZER_ERROR_DOMAIN_QUARK,
+                       PARALLELIZER_ERROR_PARSE,
+                       "bad needs %.*s: expected NAME=AMOUNT,...",
+                       (int) (end - str), str);
+          g_free (needs);
+          return NULL;
+        }
+      index = find_resource (resources, at, eq - at);
+      if (index >= 0)
+        needs[index] += amount;
+      else if (error != NULL)
+        {
+          g_set_error (error, PARALLELIZER_ERROR_DOMAIN_QUARK,
+                       PARALLELIZER_ERROR_PARSE,
+                       "no resource named %.*s", (int) (eq - at), at);
+          g_free (needs);
+          return NULL;
+        }
+      else if (!resources->warned_unknown)
+        {
+          g_warning ("tasks need %.*s, which isn't a resource:  ignoring it",
+                     (int) (eq - at), at);
+          resources->warned_unknown = TRUE;
+        }
+      at = amount_end == end ? end : amount_end + 1;
+    }
+  return needs;
+}
+
+guint64 *
+resources_parse_prefix (System       *system,
+                        const char  **str_inout,
+                        unsigned     *len_inout,
+                        const guint64 *default_needs)
+{
+  Resources *resources = system->resources;
+  const char *str = *str_inout;
+  unsigned len = *len_inout;
+  const char *close;
+  guint64 *needs;
+
+  /* "{NAME=AMOUNT,...} COMMAND":  without a space after the '{',
+     so that it isn't a shell group */
+  if (len >= 4 && str[0] == '{' && g_ascii_isalpha (str[1])
+   && (close = memchr (str, '}', len)) != NULL
+   && close + 1 < str + len && close[1] == ' '
+   && (needs = parse_needs (resources, str + 1, close, NULL)) != NULL)
+    {
+      const char *cmd = close + 1;
+      while (cmd < str + len && *cmd == ' ')
+        cmd++;
+      *len_inout = len - (cmd - str);
+      *str_inout = cmd;
+      return needs;
+    }
+  if (default_needs == NULL)
+    return NULL;
+  needs = g_new (guint64, resources->resources->len);
+  memcpy (needs, default_needs, resources->resources->len * sizeof (guint64));
+  return needs;
+}
+
+const guint64 *
+resources_get_input_needs (System *system)
+{
+  return system->resources == NULL ? NULL : system->resources->input_needs;
+}
+
+static void
+resource_update_usage (Resource *resource,
+                       gint64    now)
+{
+  resource->used_usecs += (double) resource->in_use
+                        * (now - resource->last_change_time);
+  resource->last_change_time = now;
+}
+
+/* A resource that nothing holds admits any task, even
+   one that needs more than all of it:  it runs alone. */
+static gboolean
+resource_has_room (Resource *resource,
+                   guint64   amount)
+{
+  return resource->in_use == 0
+      || resource->in_use + amount <= resource->capacity;
+}
+
+gboolean
+resources_may_start (System     *system,
+                     const Task *task,
+                     guint64    *blocked_inout)
+{
+  Resources *resources = system->resources;
+  guint64 short_of = 0;
+  gboolean rv = TRUE;
+  unsigned i;
+  if (task->needs == NULL)
+    return TRUE;
+  for (i = 0; i < resources->resources->len; i++)
+    {
+      guint64 bit = G_GUINT64_CONSTANT (1) << i;
+      if (task->needs[i] == 0)
+        continue;
+      if (*blocked_inout & bit)
+        rv = FALSE;
+      else if (!resource_has_room (resources->resources->pdata[i],
+                                   task->needs[i]))
+        {
+          short_of |= bit;
+          rv = FALSE;
+        }
+    }
+  *blocked_inout |= short_of;
+  return rv;
+}
+
+void
+resources_acquire (Task *task)
+{
+  Resources *resources = task->system->resources;
+  gint64 now;
+  unsigned i;
+  if (task->needs == NULL)
+    return;
+  now = g_get_monotonic_time ();
+  for (i = 0; i < resources->resources->len; i++)
+    {
+      Resource *resource = resources->resources->pdata[i];
+      if (task->needs[i] == 0)
+        continue;
+      resource_update_usage (resource, now);
+      resource->in_use += task->needs[i];
+      if (resource->in_use > resource->max_used)
+        resource->max_used = resource->in_use;
+    }
+}
+
+void
+resources_release (Task *task)
+{
+  Resources *resources = task->system->resources;
+  gint64 now;
+  unsigned i;
+  if (task->needs == NULL)
+    return;
+  now = g_get_monotonic_time ();
+  for (i = 0; i < resources->resources->len; i++)
+    {
+      Resource *resource = resources->resources->pdata[i];
+      if (task->needs[i] == 0)
+        continue;
+      resource_update_usage (resource, now);
+      resource->in_use -= task->needs[i];
+    }
+  g_free (task->needs);
+  task->needs = NULL;
+}
+
+gboolean
+system_add_resource (System     *system,
+                     const char *name,
+                     guint64     capacity,
+                     GError    **error)
+{
+  Resources *resources = get_resources (system);
+  Resource *resource;
+  if (system->n_tasks > 0 || resources->input_needs_list->len > 0)
+    {
+      g_set_error (error, PARALLELIZER_ERROR_DOMAIN_QUARK,
+                   PARALLELIZER_ERROR_CMDLINE_ARG,
+                   "resource %s: resources must be added before any needs",
+                   name);
+      return FALSE;
+    }
+  if (find_resource (resources, name, strlen (name)) >= 0
+   || resources->resources->len == MAX_RESOURCES)
+    {
+      g_set_error (error, PARALLELIZER_ERROR_DOMAIN_QUARK,
+                   PARALLELIZER_ERROR_CMDLINE_ARG,
+                   find_resource (resources, name, strlen (name)) >= 0
+                     ? "resource %s is already defined"
+                     : "resource %s: too many resources",
+                   name);
+      return FALSE;
+    }
+  resource = g_slice_new0 (Resource);
+  resource->name = g_strdup (name);
+  resource->capacity = capacity;
+  resource->last_change_time = resources->start_time;
+  g_ptr_array_add (resources->resources, resource);
+  return TRUE;
+}
+
+gboolean
+system_set_input_needs (System     *system,
+                        const char *needs,
+                        GError    **error)
+{
+  Resources *resources = get_resources (system);
+  guint64 *parsed = NULL;
+  if (needs != NULL && *needs != 0)
+    {
+      parsed = parse_needs (resources, needs, needs + strlen (needs), error);
+      if (parsed == NULL)
+        return FALSE;
+      g_ptr_array_add (resources->input_needs_list, parsed);
+    }
+  resources->input_needs = parsed;
+  return TRUE;
+}
+
+gboolean
+system_get_resource_stats (System        *system,
+                           unsigned       index,
+                           ResourceStats *stats_out)
+{
+  Resources *resources = system->resources;
+  Resource *resource;
+  gint64 now, elapsed;
+  if (resources == NULL || index >= resources->resources->len)
+    return FALSE;
+  resource = resources->resources->pdata[index];
+  now = g_get_monotonic_time ();
+  resource_update_usage (resource, now);
+  elapsed = now - resources->start_time;
+  stats_out->name = resource->name;
+  stats_out->capacity = resource->capacity;
+  stats_out->max_used = resource->max_used;
+  stats_out->mean_used = elapsed > 0 ? resource->used_usecs / elapsed : 0.0;
+  return TRUE;
+}
@@ -0,0 +1,515 @@
+#include <sys/stat.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include "parallelizer-private.h"
+
+#define RESULT_CACHE_MAGIC      "plinerc1"
+
+/* once over its size, the store is trimmed to this fraction of it,
+   so that eviction (a sort of the entries) isn't done for every store */
+#define TRIM_FRACTION           0.9
+
+/* a task whose output is more than this fraction of the store isn't kept */
+#define MAX_ENTRY_FRACTION      8
+
+typedef struct _ResultCache ResultCache;
+typedef struct _CacheEntry CacheEntry;
+typedef struct _CacheTask CacheTask;
+typedef struct _CacheHit CacheHit;
+
+/* a file in the store:  its name is its key, as "ab/cdef..." */
+struct _CacheEntry
+{
+  char *name;
+  guint64 size;
+  gint64 last_used;             /* seconds:  the file's mtime */
+};
+
+/* a task that is running, whose result may be stored */
+struct _CacheTask
+{
+  char *name;
+  GByteArray *output;           /* records;  NULL once it is too big */
+};
+
+/* a task whose result is to be replayed */
+struct _CacheHit
+{
+  Task *task;
+  char *contents;
+  gsize len;
+};
+
+struct _ResultCache
+{
+  System *system;
+  char *dir;
+  guint64 max_bytes;
+  guint64 total_bytes;
+  GHashTable *entries;          /* by name */
+
+  /* what every task's key starts with:  the directory, the
+     environment variables and the input files.  Once the
+     first task has started, it can't be added to. */
+  GChecksum *base;
+  gboolean is_sealed;
+  GPtrArray *env_names;
+  gboolean stat_args;
+
+  GHashTable *running;          /* CacheTasks, by Task */
+  GQueue hits;                  /* CacheHits, to be replayed */
+  guint hits_idle_id;
+};
+
+static ResultCache *
+get_result_cache (System *system)
+{
+  g_return_val_if_fail (system->result_cache != NULL, NULL);
+  g_return_val_if_fail (!system->result_cache->is_sealed, NULL);
+  return system->result_cache;
+}
+
+static char *
+get_entry_filename (ResultCache *cache,
+                    const char  *name)
+{
+  return g_build_filename (cache->dir, name, NULL);
+}
+
+static void
+add_entry (ResultCache *cache,
+           const char  *name,
+           guint64      size,
+           gint64       last_used)
+{
+  CacheEntry *entry = g_hash_table_lookup (cache->entries, name);
+  if (entry == NULL)
+    {
+      entry = g_slice_new (CacheEntry);
+      entry->name = g_strdup (name);
+      entry->size = 0;
+      g_hash_table_insert (cache->entries, entry->name, entry);
+    }
+  cache->total_bytes -= entry->size;
+  entry->size = size;
+  entry->last_used = last_used;
+  cache->total_bytes += size;
+}
+
+static void
+remove_entry (ResultCache *cache,
+              CacheEntry  *entry)
+{
+  cache->total_bytes -= entry->size;
+  g_hash_table_remove (cache->entries, entry->name);
+  g_free (entry->name);
+  g_slice_free (CacheEntry, entry);
+}
+
+/* What the store has, from a previous run:  "ab/cdef..." files. */
+static void
+scan_store (ResultCache *cache)
+{
+  GDir *dir = g_dir_open (cache->dir, 0, NULL);
+  const char *subdir_name;
+  if (dir == NULL)
+    return;
+  while ((subdir_name = g_dir_read_name (dir)) != NULL)
+    {
+      char *subdir_path = g_build_filename (cache->dir, subdir_name, NULL);
+      GDir *subdir = strlen (subdir_name) == 2 ? g_dir_open (subdir_path, 0, NULL)
+                                                : NULL;
+      const char *base_name;
+      g_free (subdir_path);
+      if (subdir == NULL)
+        continue;
+      while ((base_name = g_dir_read_name (subdir)) != NULL)
+        {
+          char *name = g_build_filename (subdir_name, base_name, NULL);
+          char *filename = get_entry_filename (cache, name);
+          struct stat stat_buf;
+          if (strchr (base_name, '.') == NULL
+           && stat (filename, &stat_buf) == 0
+           && S_ISREG (stat_buf.st_mode))
+            add_entry (cache, name, stat_buf.st_size, stat_buf.st_mtime);
+          g_free (filename);
+          g_free (name);
+        }
+      g_dir_close (subdir);
+    }
+  g_dir_close (dir);
+}
+
+static int
+compare_entries_by_last_used (gconstpointer a,
+                              gconstpointer b)
+{
+  const CacheEntry *ea = * (CacheEntry * const *) a;
+  const CacheEntry *eb = * (CacheEntry * const *) b;
+  return ea->last_used < eb->last_used ? -1
+       : ea->last_used > eb->last_used ? 1
+       : 0;
+}
+
+/* Least recently used first.  Another run may have removed
+   some of the files already:  that is fine. */
+static void
+evict (ResultCache *cache)
+{
+  guint64 target = cache->max_bytes * TRIM_FRACTION;
+  GPtrArray *entries;
+  GHashTableIter iter;
+  gpointer value;
+  unsigned i;
+  if (cache->total_bytes <= cache->max_bytes)
+    return;
+  entries = g_ptr_array_sized_new (g_hash_table_size (cache->entries));
+  g_hash_table_iter_init (&iter, cache->entries);
+  while (g_hash_table_iter_next (&iter, NULL, &value))
+    g_ptr_array_add (entries, value);
+  g_ptr_array_sort (entries, compare_entries_by_last_used);
+  for (i = 0; i < entries->len && cache->total_bytes > target; i++)
+    {
+      CacheEntry *entry = entries->pdata[i];
+      char *filename = get_entry_filename (cache, entry->name);
+      unlink (filename);
+      g_free (filename);
+      remove_entry (cache, entry);
+      cache->system->stats.n_cache_evictions++;
+    }
+  g_ptr_array_free (entries, TRUE);
+}
+
+static void
+seal_base (ResultCache *cache)
+{
+  char *cwd = g_get_current_dir ();
+  unsigned i;
+  g_checksum_update (cache->base, (const guchar *) "cwd", 4);
+  g_checksum_update (cache->base, (const guchar *) cwd, strlen (cwd) + 1);
+  g_free (cwd);
+  for (i = 0; i < cache->env_names->len; i++)
+    {
+      const char *name = cache->env_names->pdata[i];
+      const char *value = g_getenv (name);
+
+      /* unset isn't the same as empty */
+      g_checksum_update (cache->base, (const guchar *) name, strlen (name) + 1);
+      if (value != NULL)
+        {
+          g_checksum_update (cache->base, (const guchar *) "=", 1);
+          g_checksum_update (cache->base, (const guchar *) value, strlen (value) + 1);
+        }
+      else
+        g_checksum_update (cache->base, (const guchar *) "!", 1);
+    }
+  cache->is_sealed = TRUE;
+}
+
+/* The words of the command-line that name files:  their size and mtime. */
+static void
+add_arg_stats (GChecksum  *checksum,
+               const char *cmdline)
+{
+  char **words = g_strsplit_set (cmdline, " \t\n", 0);
+  unsigned i;
+  for (i = 0; words[i] != NULL; i++)
+    {
+      struct stat stat_buf;
+      gint64 info[3];
+      if (words[i][0] == 0
+       || stat (words[i], &stat_buf) < 0
+       || !S_ISREG (stat_buf.st_mode))
+        continue;
+      info[0] = stat_buf.st_size;
+      info[1] = stat_buf.st_mtim.tv_sec;
+      info[2] = stat_buf.st_mtim.tv_nsec;
+      g_checksum_update (checksum, (const guchar *) words[i], strlen (words[i]) + 1);
+      g_checksum_update (checksum, (const guchar *) info, sizeof (info));
+    }
+  g_strfreev (words);
+}
+
+/* "ab/cdef...":  the SHA-256 of the task's inputs, in hex. */
+static char *
+get_task_name (ResultCache *cache,
+               Task        *task)
+{
+  GChecksum *checksum;
+  const char *hex;
+  char *name;
+  if (!cache->is_sealed)
+    seal_base (cache);
+  checksum = g_checksum_copy (cache->base);
+  g_checksum_update (checksum, (const guchar *) "cmd", 4);
+  g_checksum_update (checksum, (const guchar *) task->str, strlen (task->str) + 1);
+  if (cache->stat_args)
+    add_arg_stats (checksum, task->str);
+  hex = g_checksum_get_string (checksum);
+  name = g_strdup_printf ("%.2s/%s", hex, hex + 2);
+  g_checksum_free (checksum);
+  return name;
+}
+
+static void
+write_entry (ResultCache *cache,
+             CacheTask   *ct,
+             int          exit_status)
+{
+  char *filename = get_entry_filename (cache, ct->name);
+  char *dir = g_path_get_dirname (filename);
+  guint32 status = exit_status;
+  GError *error = NULL;
+  GByteArray *contents = g_byte_array_sized_new (ct->output->len + 12);
+  g_byte_array_append (contents, (const guint8 *) RESULT_CACHE_MAGIC, 8);
+  g_byte_array_append (contents, (const guint8 *) &status, sizeof (status));
+  g_byte_array_append (contents, ct->output->data, ct->output->len);
+
+  /* g_file_set_contents() writes aside, then renames:
+     other runs never see half of it */
+  g_mkdir_with_parents (dir, 0755);
+  if (g_file_set_contents (filename, (const char *) contents->data,
+                           contents->len, &error))
+    {
+      add_entry (cache, ct->name, contents->len, time (NULL));
+      cache->system->stats.n_cache_stores++;
+      evict (cache);
+    }
+  else
+    {
+      g_warning ("result cache: %s", error->message);
+      g_error_free (error);
+    }
+  g_byte_array_free (contents, TRUE);
+  g_free (dir);
+  g_free (filename);
+}
+
+static void
+cache_task_free (CacheTask *ct)
+{
+  if (ct->output != NULL)
+    g_byte_array_free (ct->output, TRUE);
+  g_free (ct->name);
+  g_slice_free (CacheTask, ct);
+}
+
+static gboolean
+handle_hits_idle (gpointer data)
+{
+  ResultCache *cache = data;
+  CacheHit *hit;
+
+  /* task_done() starts more tasks, which may be hits too:
+     they are queued, and replayed by this loop */
+  while ((hit = g_queue_pop_head (&cache->hits)) != NULL)
+    {
+      guint32 status;
+      memcpy (&status, hit->contents + 8, sizeof (status));
+      task_replay_output (hit->task, (const guint8 *) hit->contents + 12,
+                          hit->len - 12);
+      task_done (hit->task, TASK_TERMINATION_EXIT, status);
+      g_free (hit->contents);
+      g_slice_free (CacheHit, hit);
+    }
+  cache->hits_idle_id = 0;
+  return FALSE;
+}
+
+gboolean
+result_cache_lookup (System *system,
+                     Task   *task)
+{
+  ResultCache *cache = system->result_cache;
+  char *name = get_task_name (cache, task);
+  char *filename = get_entry_filename (cache, name);
+  CacheEntry *entry;
+  CacheTask *ct;
+  CacheHit *hit;
+  char *contents;
+  gsize len;
+
+  if (g_file_get_contents (filename, &contents, &len, NULL))
+    {
+      if (len >= 12
+       && memcmp (contents, RESULT_CACHE_MAGIC, 8) == 0
+       && output_records_are_valid ((const guint8 *) contents + 12, len - 12))
+        {
+          /* the mtime is when it was last used, for the next run too */
+          utimensat (AT_FDCWD, filename, NULL, 0);
+          add_entry (cache, name, len, time (NULL));
+          hit = g_slice_new (CacheHit);
+          hit->task = task;
+          hit->contents = contents;
+          hit->len = len;
+          g_queue_push_tail (&cache->hits, hit);
+          if (cache->hits_idle_id == 0)
+            cache->hits_idle_id = g_idle_add (handle_hits_idle, cache);
+          task->from_cache = TRUE;
+          system->stats.n_cache_hits++;
+          g_free (filename);
+          g_free (name);
+          return TRUE;
+        }
+      g_free (contents);
+      g_warning ("result cache: %s is corrupt:  removing it", filename);
+      unlink (filename);
+      if ((entry = g_hash_table_lookup (cache->entries, name)) != NULL)
+        remove_entry (cache, entry);
+    }
+  g_free (filename);
+
+  /* its output is kept, in case it succeeds */
+  ct = g_slice_new (CacheTask);
+  ct->name = name;
+  ct->output = g_byte_array_new ();
+  g_hash_table_insert (cache->running, task, ct);
+  return FALSE;
+}
+
+static void
+result_cache__handle_data (Task           *task,
+                           const GTimeVal *current_time,
+                           gboolean        is_stderr,
+                           unsigned        len,
+                           const guint8   *data,
+                           gpointer        handler_data)
+{
+  ResultCache *cache = handler_data;
+  CacheTask *ct = g_hash_table_lookup (cache->running, task);
+  if (ct == NULL || ct->output == NULL)
+    return;
+  if (ct->output->len + len > cache->max_bytes / MAX_ENTRY_FRACTION)
+    {
+      g_byte_array_free (ct->output, TRUE);
+      ct->output = NULL;
+      return;
+    }
+  output_records_add (ct->output, is_stderr, data, len);
+}
+
+static void
+result_cache__ended (Task               *task,
+                     const GTimeVal     *current_time,
+                     TaskTerminationType termination_type,
+                     int                 termination_info,
+                     gpointer            handler_data)
+{
+  ResultCache *cache = handler_data;
+  CacheTask *ct = g_hash_table_lookup (cache->running, task);
+  if (ct == NULL)
+    return;
+  g_hash_table_remove (cache->running, task);
+  if (ct->output != NULL
+   && termination_type == TASK_TERMINATION_EXIT
+   && termination_info == 0)
+    write_entry (cache, ct, termination_info);
+  cache_task_free (ct);
+}
+
+static SystemTrapFuncs result_cache_funcs =
+{
+  NULL,
+  result_cache__handle_data,
+  NULL,
+  result_cache__ended,
+  NULL
+};
+
+gboolean
+system_set_result_cache (System     *system,
+                         const char *dir,
+                         guint64     max_bytes,
+                         GError    **error)
+{
+  ResultCache *cache;
+  g_return_val_if_fail (system->result_cache == NULL, FALSE);
+  if (g_mkdir_with_parents (dir, 0755) < 0)
+    {
+      g_set_error (error, PARALLELIZER_ERROR_DOMAIN_QUARK,
+                   PARALLELIZER_ERROR_OPEN,
+                   "could not create %s: %s", dir, g_strerror (errno));
+      return FALSE;
+    }
+  cache = g_slice_new0 (ResultCache);
+  cache->system = system;
+  cache->dir = g_strdup (dir);
+  cache->max_bytes = max_bytes;
+  cache->entries = g_hash_table_new (g_str_hash, g_str_equal);
+  cache->base = g_checksum_new (G_CHECKSUM_SHA256);
+  cache->env_names = g_ptr_array_new ();
+  cache->running = g_hash_table_new (g_direct_hash, g_direct_equal);
+  g_queue_init (&cache->hits);
+  scan_store (cache);
+  evict (cache);
+  system->result_cache = cache;
+  system_trap (system, &result_cache_funcs, cache);
+  return TRUE;
+}
+
+void
+system_add_result_cache_env (System     *system,
+                             const char *name)
+{
+  ResultCache *cache = get_result_cache (system);
+  if (cache != NULL)
+    g_ptr_array_add (cache->env_names, g_strdup (name));
+}
+
+gboolean
+system_add_result_cache_file (System     *system,
+                              const char *filename,
+                              GError    **error)
+{
+  ResultCache *cache = get_result_cache (system);
+  guint8 buf[65536];
+  ssize_t read_rv;
+  GChecksum *checksum;
+  int fd;
+  if (cache == NULL)
+    return FALSE;
+  fd = open (filename, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    {
+      g_set_error (error, PARALLELIZER_ERROR_DOMAIN_QUARK,
+                   PARALLELIZER_ERROR_OPEN,
+                   "could not open %s: %s", filename, g_strerror (errno));
+      return FALSE;
+    }
+  checksum = g_checksum_new (G_CHECKSUM_SHA256);
+  while ((read_rv = read (fd, buf, sizeof (buf))) != 0)
+    {
+      if (read_rv < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          g_set_error (error, PARALLELIZER_ERROR_DOMAIN_QUARK,
+                       PARALLELIZER_ERROR_OPEN,
+                       "error reading %s: %s", filename, g_strerror (errno));
+          g_checksum_free (checksum);
+          close (fd);
+          return FALSE;
+        }
+      g_checksum_update (checksum, buf, read_rv);
+    }
+  close (fd);
+
+  /* by content:  a file that is merely touched doesn't invalidate */
+  g_checksum_update (cache->base, (const guchar *) filename, strlen (filename) + 1);
+  g_checksum_update (cache->base, (const guchar *) g_checksum_get_string (checksum), 64);
+  g_checksum_free (checksum);
+  return TRUE;
+}
+
+void
+system_set_result_cache_stat_args (System  *system,
+                                   gboolean stat_args)
+{
+  ResultCache *cache = get_result_cache (system);
+  if (cache != NULL)
+    cache->stat_args = stat_args;
+}
@@ -0,0 +1,670 @@
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <fcntl.h>
+#include "parallelizer.h"
+#include "line-buffer.h"
+
+#if 1
+# define DEBUG_ONLY(x)
+#else
+# define DEBUG_ONLY(x) x
+#endif
+
+#define LISTEN_BACKLOG          64
+#define READ_SIZE               4096
+#define CLIENT_BUFFER_SIZE      65536
+
+/* Above this much unsent output, a client is paused:  its tasks'
+   output isn't read, and no more of its command-lines are run,
+   until it has read us down to half of it. */
+#define MAX_CLIENT_OUTPUT       (1024*1024)
+
+static void
+set_nonblocking (int fd)
+{
+  fcntl (fd, F_SETFL, fcntl (fd, F_GETFL, 0) | O_NONBLOCK);
+}
+
+typedef struct _Server Server;
+struct _Server
+{
+  System *system;
+  int listen_fd;
+  GSourceFD *listen_source;
+  unsigned n_connections;
+};
+
+/* a client:  the input source for its command-lines,
+   and where their tasks' events are sent */
+typedef struct _Connection Connection;
+struct _Connection
+{
+  Source base;
+  Server *server;
+  int fd;
+
+  LineBuffer *input;
+  GSourceFD *input_source;      /* while trapped, until eof */
+  gboolean got_eof;             /* all the client's input is in 'input' */
+  gboolean gave_end;            /* the system has been given NULL */
+  unsigned n_submitted;
+  unsigned n_ended;
+
+  GByteArray *output;           /* not yet written to the client */
+  GSourceFD *output_source;     /* while there is output */
+  gboolean is_broken;           /* the client went away:  discard output */
+  gboolean is_paused;           /* 'output' is over MAX_CLIENT_OUTPUT */
+  GPtrArray *running_tasks;     /* started and not ended */
+};
+
+static void connection_trap (Source *source);
+static void connection_deliver (Connection *conn);
+
+static Connection *
+get_connection (Task *task)
+{
+  if (task->source == NULL || task->source->trap != connection_trap)
+    return NULL;
+  return (Connection *) task->source;
+}
+
+static void
+connection_free (Connection *conn)
+{
+  DEBUG_ONLY (g_message ("connection %d: closing", conn->fd));
+  g_assert (conn->base.callback == NULL);
+  if (conn->output_source != NULL)
+    g_source_fd_destroy (conn->output_source);
+  close (conn->fd);
+  line_buffer_free (conn->input);
+  g_byte_array_free (conn->output, TRUE);
+  g_ptr_array_free (conn->running_tasks, TRUE);
+  conn->server->n_connections--;
+  g_slice_free (Connection, conn);
+}
+
+/* Once the client's tasks have all ended, and it has
+   been sent everything, close the connection. */
+static void
+connection_maybe_finish (Connection *conn)
+{
+  if (conn->gave_end
+   && conn->n_ended == conn->n_submitted
+   && (conn->output->len == 0 || conn->is_broken))
+    connection_free (conn);
+}
+
+/* for lines withheld while we were paused */
+static gboolean
+do_idle_connection_deliver (gpointer data)
+{
+  connection_deliver (data);
+  return FALSE;
+}
+
+static void
+connection_set_paused (Connection *conn,
+                       gboolean    paused)
+{
+  unsigned i;
+  DEBUG_ONLY (g_message ("connection %d: %s", conn->fd, paused ? "paused" : "resumed"));
+  conn->is_paused = paused;
+  for (i = 0; i < conn->running_tasks->len; i++)
+    task_set_output_paused (conn->running_tasks->pdata[i], paused);
+  if (!paused && conn->base.callback != NULL)
+    g_idle_add (do_idle_connection_deliver, conn);
+}
+
+static void
+connection_set_broken (Connection *conn)
+{
+  conn->is_broken = TRUE;
+  if (conn->is_paused)
+    connection_set_paused (conn, FALSE);
+  g_byte_array_set_size (conn->output, 0);
+  if (conn->output_source != NULL)
+    {
+      g_source_fd_destroy (conn->output_source);
+      conn->output_source = NULL;
+    }
+}
+
+/* write as much of 'output' as the socket takes */
+static void
+connection_flush (Connection *conn)
+{
+  while (conn->output->len > 0)
+    {
+      ssize_t n = write (conn->fd, conn->output->data, conn->output->len);
+      if (n < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          if (errno == EAGAIN)
+            break;
+          DEBUG_ONLY (g_message ("connection %d: write: %s", conn->fd, g_strerror (errno)));
+          connection_set_broken (conn);
+          return;
+        }
+      g_byte_array_remove_range (conn->output, 0, n);
+    }
+}
+
+static gboolean
+handle_connection_writable (void *data)
+{
+  Connection *conn = data;
+  connection_flush (conn);
+  if (conn->is_paused && conn->output->len <= MAX_CLIENT_OUTPUT / 2)
+    connection_set_paused (conn, FALSE);
+  if (conn->output->len > 0)
+    return TRUE;
+  if (conn->output_source != NULL)
+    {
+      g_source_fd_destroy (conn->output_source);
+      conn->output_source = NULL;
+    }
+  connection_maybe_finish (conn);
+  return TRUE;
+}
+
+/* Queue one event line:  "KIND SEQNO TEXT\n". */
+static void
+connection_send (Connection *conn,
+                 const char *kind,
+                 Task       *task,
+                 const char *text,
+                 unsigned    text_len)
+{
+  char prefix[64];
+  unsigned prefix_len;
+  gboolean was_empty = conn->output->len == 0;
+  if (conn->is_broken)
+    return;
+  prefix_len = g_snprintf (prefix, sizeof (prefix), "%s %u ",
+                           kind, task->task_index + 1);
+  g_byte_array_append (conn->output, (guint8 *) prefix, prefix_len);
+  g_byte_array_append (conn->output, (const guint8 *) text, text_len);
+  g_byte_array_append (conn->output, (const guint8 *) "\n", 1);
+  if (was_empty)
+    {
+      connection_flush (conn);
+      if (conn->output->len > 0 && conn->output_source == NULL)
+        conn->output_source = g_source_fd_new (conn->fd, G_IO_OUT,
+                                               handle_connection_writable,
+                                               conn);
+    }
+  else if (!conn->is_paused && conn->output->len > MAX_CLIENT_OUTPUT)
+    connection_set_paused (conn, TRUE);
+}
+
+static void
+connection_read (Connection *conn)
+{
+  unsigned space;
+  guint8 *at = line_buffer_get_write_space (conn->input, READ_SIZE, &space);
+  ssize_t n = read (conn->fd, at, space);
+  if (n < 0)
+    {
+      if (errno == EINTR || errno == EAGAIN)
+        return;
+
+      /* eg ECONNRESET:  take what we have */
+      connection_set_broken (conn);
+      n = 0;
+    }
+  if (n > 0)
+    {
+      line_buffer_commit (conn->input, n);
+      return;
+    }
+
+  /* eof:  an unterminated last line is still a command-line */
+  DEBUG_ONLY (g_message ("connection %d: eof", conn->fd));
+  conn->got_eof = TRUE;
+  if (line_buffer_get_pending_len (conn->input) > 0)
+    line_buffer_append (conn->input, (guint8 *) &conn->input->separator, 1);
+  if (conn->input_source != NULL)
+    {
+      g_source_fd_destroy (conn->input_source);
+      conn->input_source = NULL;
+    }
+}
+
+/* Give the system command-lines until we are untrapped,
+   or paused;  may free the connection. */
+static void
+connection_deliver (Connection *conn)
+{
+  if (conn->is_paused)
+    return;
+  while (conn->base.callback != NULL)
+    {
+      unsigned len;
+      char *line = line_buffer_next_line (conn->input, &len);
+      if (line == NULL)
+        break;
+      conn->n_submitted++;
+      conn->base.callback (&conn->base, line, len, conn->base.trap_data);
+    }
+  if (conn->got_eof
+   && conn->base.callback != NULL
+   && !line_buffer_has_line (conn->input))
+    {
+      conn->gave_end = TRUE;
+      conn->base.callback (&conn->base, NULL, 0, conn->base.trap_data);
+      connection_maybe_finish (conn);
+    }
+}
+
+static gboolean
+handle_connection_readable (void *data)
+{
+  Connection *conn = data;
+  connection_read (conn);
+  connection_deliver (conn);
+  return TRUE;
+}
+
+static void
+connection_trap (Source *source)
+{
+  Connection *conn = (Connection *) source;
+  if (!conn->got_eof)
+    conn->input_source = g_source_fd_new (conn->fd, G_IO_IN,
+                                          handle_connection_readable, conn);
+  if (conn->got_eof || line_buffer_has_line (conn->input))
+    g_idle_add (do_idle_connection_deliver, conn);
+}
+
+static void
+connection_untrap (Source *source)
+{
+  Connection *conn = (Connection *) source;
+  if (conn->input_source != NULL)
+    {
+      g_source_fd_destroy (conn->input_source);
+      conn->input_source = NULL;
+    }
+  while (g_idle_remove_by_data (conn))
+    ;
+}
+
+/* The connection frees itself, once its tasks are done. */
+static void
+connection_destroy (Source *source)
+{
+  (void) source;
+}
+
+static Connection *
+connection_new (Server *server,
+                int     fd)
+{
+  Connection *conn = g_slice_new (Connection);
+  conn->base.trap = connection_trap;
+  conn->base.untrap = connection_untrap;
+  conn->base.destroy = connection_destroy;
+  conn->base.callback = NULL;
+  conn->base.trap_data = NULL;
+  conn->base.has_stable_strs = FALSE;
+  conn->server = server;
+  conn->fd = fd;
+  conn->input = line_buffer_new (server->system->input_separator);
+  conn->input_source = NULL;
+  conn->got_eof = FALSE;
+  conn->gave_end = FALSE;
+  conn->n_submitted = 0;
+  conn->n_ended = 0;
+  conn->output = g_byte_array_new ();
+  conn->output_source = NULL;
+  conn->is_broken = FALSE;
+  conn->is_paused = FALSE;
+  conn->running_tasks = g_ptr_array_new ();
+  server->n_connections++;
+  return conn;
+}
+
+static gboolean
+handle_listen_readable (void *data)
+{
+  Server *server = data;
+  for (;;)
+    {
+      int fd = accept4 (server->listen_fd, NULL, NULL,
+                        SOCK_NONBLOCK | SOCK_CLOEXEC);
+      if (fd < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          if (errno != EAGAIN && errno != ECONNABORTED)
+            g_warning ("error accepting connection: %s", g_strerror (errno));
+          break;
+        }
+      DEBUG_ONLY (g_message ("connection %d: accepted", fd));
+
+      /* each client is an input source of its own:  its tasks
+         share the slots with the other clients' through the
+         input queues, by weight and priority */
+      system_add_input_source (server->system,
+                               &connection_new (server, fd)->base);
+    }
+  return TRUE;
+}
+
+/* --- sending task events back to their clients --- */
+static void
+serve__handle_started (Task           *task,
+                       const GTimeVal *current_time,
+                       const char     *cmdline,
+                       gpointer        handler_data)
+{
+  Connection *conn = get_connection (task);
+  if (conn == NULL)
+    return;
+  g_ptr_array_add (conn->running_tasks, task);
+  if (conn->is_paused)
+    task_set_output_paused (task, TRUE);
+  connection_send (conn, "start", task, cmdline, strlen (cmdline));
+}
+
+static void
+serve__handle_lines (Task           *task,
+                     const GTimeVal *current_time,
+                     gboolean        is_stderr,
+                     unsigned        n_lines,
+                     const TaskLine *lines,
+                     gpointer        handler_data)
+{
+  Connection *conn = get_connection (task);
+  unsigned i;
+  if (conn == NULL)
+    return;
+  for (i = 0; i < n_lines; i++)
+    connection_send (conn, is_stderr ? "err" : "out", task,
+                     lines[i].text, lines[i].len);
+}
+
+static void
+serve__handle_line (Task           *task,
+                    const GTimeVal *current_time,
+                    gboolean        is_stderr,
+                    const char     *text,
+                    gpointer        handler_data)
+{
+  TaskLine line;
+  line.text = text;
+  line.len = strlen (text);
+  serve__handle_lines (task, current_time, is_stderr, 1, &line, handler_data);
+}
+
+static void
+serve__ended (Task               *task,
+              const GTimeVal     *current_time,
+              TaskTerminationType termination_type,
+              int                 termination_info,
+              gpointer            handler_data)
+{
+  Connection *conn = get_connection (task);
+  const char *event;
+  char buf[32];
+  if (conn == NULL)
+    return;
+  switch (termination_type)
+    {
+    case TASK_TERMINATION_SIGNAL: event = "signal"; break;
+    case TASK_TERMINATION_SKIPPED: event = "skip"; break;
+    default: event = "exit"; break;
+    }
+  g_ptr_array_remove_fast (conn->running_tasks, task);
+  g_snprintf (buf, sizeof (buf), "%d", termination_info);
+  connection_send (conn, event, task, buf, strlen (buf));
+  conn->n_ended++;
+
+  /* the connection may be freed now */
+  task->source = NULL;
+  connection_maybe_finish (conn);
+}
+
+static SystemTrapFuncs serve_funcs =
+{
+  serve__handle_started,
+  NULL,
+  serve__handle_line,
+  serve__ended,
+  NULL,
+  serve__handle_lines
+};
+
+static gboolean
+make_socket_address (struct sockaddr_un *addr,
+                     const char         *socket_path,
+                     GError            **error)
+{
+  memset (addr, 0, sizeof (*addr));
+  addr->sun_family = AF_UNIX;
+  if (strlen (socket_path) >= sizeof (addr->sun_path))
+    {
+      g_set_error (error, PARALLELIZER_ERROR_DOMAIN_QUARK,
+                   PARALLELIZER_ERROR_SOCKET,
+                   "socket path too long: %s", socket_path);
+      return FALSE;
+    }
+  strcpy (addr->sun_path, socket_path);
+  return TRUE;
+}
+
+gboolean
+system_serve (System     *system,
+              const char *socket_path,
+              GError    **error)
+{
+  struct sockaddr_un addr;
+  Server *server;
+  int fd;
+
+  if (!make_socket_address (&addr, socket_path, error))
+    return FALSE;
+  fd = socket (AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    {
+      g_set_error (error, PARALLELIZER_ERROR_DOMAIN_QUARK,
+                   PARALLELIZER_ERROR_SOCKET,
+                   "error creating socket: %s", g_strerror (errno));
+      return FALSE;
+    }
+
+  /* a socket left by a server that has gone can be replaced;
+     one that is still being served can't */
+  if (connect (fd, (struct sockaddr *) &addr, sizeof (addr)) == 0)
+    {
+      close (fd);
+      g_set_error (error, PARALLELIZER_ERROR_DOMAIN_QUARK,
+                   PARALLELIZER_ERROR_SOCKET,
+                   "%s is already being served", socket_path);
+      return FALSE;
+    }
+  if (errno == ECONNREFUSED)
+    unlink (socket_path);
+
+  if (bind (fd, (struct sockaddr *) &addr, sizeof (addr)) < 0
+   || listen (fd, LISTEN_BACKLOG) < 0)
+    {
+      g_set_error (error, PARALLELIZER_ERROR_DOMAIN_QUARK,
+                   PARALLELIZER_ERROR_SOCKET,
+                   "error listening on %s: %s",
+                   socket_path, g_strerror (errno));
+      close (fd);
+      return FALSE;
+    }
+
+  server = g_slice_new (Server);
+  server->system = system;
+  server->listen_fd = fd;
+  server->n_connections = 0;
+  server->listen_source = g_source_fd_new (fd, G_IO_IN,
+                                           handle_listen_readable, server);
+  system_set_keep_running (system, TRUE);
+  system_trap (system, &serve_funcs, server);
+  return TRUE;
+}
+
+/* --- the client --- */
+
+/* An event line from the server;  returns FALSE for a failed task. */
+static gboolean
+handle_client_event (char *line)
+{
+  char *seqno = strchr (line, ' ');
+  char *text;
+  if (seqno == NULL)
+    return TRUE;
+  *seqno++ = 0;
+  text = strchr (seqno, ' ');
+  if (text == NULL)
+    return TRUE;
+  *text++ = 0;
+  if (strcmp (line, "out") == 0)
+    {
+      fputs (text, stdout);
+      fputc ('\n', stdout);
+    }
+  else if (strcmp (line, "err") == 0)
+    {
+      fputs (text, stderr);
+      fputc ('\n', stderr);
+    }
+  else if (strcmp (line, "exit") == 0 && atoi (text) != 0)
+    {
+      fprintf (stderr, "Task %s exitted with status %s!\n", seqno, text);
+      return FALSE;
+    }
+  else if (strcmp (line, "signal") == 0)
+    {
+      fprintf (stderr, "Task %s killed by signal %s (%s)!\n",
+               seqno, text, g_strsignal (atoi (text)));
+      return FALSE;
+    }
+  else if (strcmp (line, "skip") == 0)
+    {
+      fprintf (stderr, "Task %s skipped: task %s failed!\n", seqno, text);
+      return FALSE;
+    }
+  return TRUE;
+}
+
+int
+serve_submit (const char *socket_path,
+              int         input_fd,
+              GError    **error)
+{
+  struct sockaddr_un addr;
+  LineBuffer *events;
+  char *buf;
+  unsigned buf_start = 0, buf_len = 0;
+  gboolean input_done = FALSE;
+  unsigned n_failed = 0;
+  int fd;
+
+  if (!make_socket_address (&addr, socket_path, error))
+    return -1;
+  fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0 || connect (fd, (struct sockaddr *) &addr, sizeof (addr)) < 0)
+    {
+      g_set_error (error, PARALLELIZER_ERROR_DOMAIN_QUARK,
+                   PARALLELIZER_ERROR_SOCKET,
+                   "could not connect to %s: %s",
+                   socket_path, g_strerror (errno));
+      if (fd >= 0)
+        close (fd);
+      return -1;
+    }
+
+  /* Copy our input to the server while printing its events,
+     so neither side can fill the socket while the other waits. */
+  set_nonblocking (fd);
+  events = line_buffer_new ('\n');
+  buf = g_malloc (CLIENT_BUFFER_SIZE);
+  for (;;)
+    {
+      struct pollfd fds[2];
+      unsigned n_fds = 1;
+      fds[0].fd = fd;
+      fds[0].events = POLLIN | (buf_len > 0 ? POLLOUT : 0);
+      if (buf_len == 0 && !input_done)
+        {
+          fds[1].fd = input_fd;
+          fds[1].events = POLLIN;
+          n_fds = 2;
+        }
+      if (poll (fds, n_fds, -1) < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          g_error ("error polling: %s", g_strerror (errno));
+        }
+
+      if (n_fds > 1 && fds[1].revents != 0)
+        {
+          ssize_t n = read (input_fd, buf, CLIENT_BUFFER_SIZE);
+          if (n < 0 && errno != EINTR)
+            g_error ("error reading input: %s", g_strerror (errno));
+          if (n == 0)
+            {
+              input_done = TRUE;
+              shutdown (fd, SHUT_WR);
+            }
+          else if (n > 0)
+            {
+              buf_start = 0;
+              buf_len = n;
+            }
+        }
+
+      if (buf_len > 0 && (fds[0].revents & (POLLOUT | POLLERR)) != 0)
+        {
+          ssize_t n = write (fd, buf + buf_start, buf_len);
+          if (n < 0 && errno != EINTR && errno != EAGAIN)
+            g_error ("error writing to server: %s", g_strerror (errno));
+          if (n > 0)
+            {
+              buf_start += n;
+              buf_len -= n;
+            }
+        }
+
+      if ((fds[0].revents & (POLLIN | POLLHUP)) != 0)
+        {
+          unsigned space, len;
+          guint8 *at = line_buffer_get_write_space (events, READ_SIZE, &space);
+          ssize_t n = read (fd, at, space);
+          char *line;
+          if (n < 0 && (errno == EINTR || errno == EAGAIN))
+            continue;
+          if (n <= 0)
+            break;
+          line_buffer_commit (events, n);
+          while ((line = line_buffer_next_line (events, &len)) != NULL)
+            if (!handle_client_event (line))
+              n_failed++;
+        }
+    }
+  fflush (stdout);
+  g_free (buf);
+  line_buffer_free (events);
+  close (fd);
+  if (!input_done)
+    {
+      g_set_error (error, PARALLELIZER_ERROR_DOMAIN_QUARK,
+                   PARALLELIZER_ERROR_SOCKET,
+                   "server closed the connection");
+      return -1;
+    }
+  return n_failed > 0 ? 1 : 0;
+}
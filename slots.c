@@ -0,0 +1,212 @@
+#include <sched.h>
+#include <string.h>
+#include "parallelizer-private.h"
+
+#define NODE_SYSFS_DIR          "/sys/devices/system/node"
+
+typedef struct _Slots Slots;
+struct _Slots
+{
+  /* the running task in each slot, or NULL */
+  GPtrArray *tasks;
+
+  /* the environment, and room for PLINE_SLOT before the NULL */
+  char **environ;
+  unsigned n_environ;
+  GPtrArray *slot_vars;         /* "PLINE_SLOT=N" for each slot */
+
+  /* with a SystemPinPolicy:  the cpus we may use, by NUMA node */
+  SystemPinPolicy pin_policy;
+  GArray **node_cpus;           /* ints */
+  unsigned n_nodes;
+  GArray *compact_cpus;         /* ints:  node by node */
+};
+
+static Slots *
+get_slots (System *system)
+{
+  Slots *slots = system->slots;
+  extern char **environ;
+  unsigned i;
+  if (slots != NULL)
+    return slots;
+  slots = g_slice_new0 (Slots);
+  slots->tasks = g_ptr_array_new ();
+  slots->slot_vars = g_ptr_array_new ();
+  slots->pin_policy = SYSTEM_PIN_NONE;
+
+  /* without any PLINE_SLOT of our own (when pline runs pline) */
+  slots->environ = g_new (char *, g_strv_length (environ) + 2);
+  for (i = 0; environ[i] != NULL; i++)
+    if (!g_str_has_prefix (environ[i], "PLINE_SLOT="))
+      slots->environ[slots->n_environ++] = environ[i];
+  slots->environ[slots->n_environ] = NULL;
+  slots->environ[slots->n_environ + 1] = NULL;
+  system->slots = slots;
+  return slots;
+}
+
+/* The lowest free slot. */
+int
+slots_acquire (System *system,
+               Task   *task)
+{
+  Slots *slots = get_slots (system);
+  unsigned i;
+  for (i = 0; i < slots->tasks->len; i++)
+    if (slots->tasks->pdata[i] == NULL)
+      break;
+  if (i == slots->tasks->len)
+    {
+      g_ptr_array_add (slots->tasks, NULL);
+      g_ptr_array_add (slots->slot_vars, g_strdup_printf ("PLINE_SLOT=%u", i));
+    }
+  slots->tasks->pdata[i] = task;
+  return i;
+}
+
+void
+slots_release (System *system,
+               int     slot)
+{
+  Slots *slots = system->slots;
+  g_assert (slots->tasks->pdata[slot] != NULL);
+  slots->tasks->pdata[slot] = NULL;
+}
+
+/* Valid until the next call. */
+char **
+slots_get_environ (System *system,
+                   int     slot)
+{
+  Slots *slots = get_slots (system);
+  slots->environ[slots->n_environ] = slots->slot_vars->pdata[slot];
+  return slots->environ;
+}
+
+gboolean
+slots_get_cpus (System    *system,
+                int        slot,
+                cpu_set_t *cpus_out)
+{
+  Slots *slots = system->slots;
+  GArray *cpus;
+  unsigned i;
+  if (slots == NULL || slots->pin_policy == SYSTEM_PIN_NONE)
+    return FALSE;
+  CPU_ZERO (cpus_out);
+  switch (slots->pin_policy)
+    {
+    case SYSTEM_PIN_COMPACT:
+      cpus = slots->compact_cpus;
+      CPU_SET (g_array_index (cpus, int, slot % cpus->len), cpus_out);
+      break;
+    case SYSTEM_PIN_SCATTER:
+      cpus = slots->node_cpus[slot % slots->n_nodes];
+      CPU_SET (g_array_index (cpus, int, slot / slots->n_nodes % cpus->len),
+               cpus_out);
+      break;
+    case SYSTEM_PIN_NODE:
+      cpus = slots->node_cpus[slot % slots->n_nodes];
+      for (i = 0; i < cpus->len; i++)
+        CPU_SET (g_array_index (cpus, int, i), cpus_out);
+      break;
+    default:
+      g_assert_not_reached ();
+    }
+  return TRUE;
+}
+
+/* Parse a cpulist, like "0-3,8-11", into those of 'allowed'
+   (or all of them, if it is NULL). */
+static GArray *
+parse_cpu_list (const char      *str,
+                const cpu_set_t *allowed)
+{
+  GArray *cpus = g_array_new (FALSE, FALSE, sizeof (int));
+  char **ranges = g_strsplit (str, ",", 0);
+  unsigned i;
+  for (i = 0; ranges[i] != NULL; i++)
+    {
+      char *end;
+      int first = strtol (ranges[i], &end, 10);
+      int last = *end == '-' ? strtol (end + 1, NULL, 10) : first;
+      int cpu;
+      if (end == ranges[i])
+        continue;
+      for (cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++)
+        if (allowed == NULL || CPU_ISSET (cpu, allowed))
+          g_array_append_val (cpus, cpu);
+    }
+  g_strfreev (ranges);
+  return cpus;
+}
+
+/* The NUMA nodes' cpus, from sysfs, leaving out nodes with none
+   that we may use;  without NUMA, one node with all of them. */
+static void
+read_topology (Slots *slots)
+{
+  GPtrArray *nodes = g_ptr_array_new ();
+  GArray *online = NULL;
+  cpu_set_t allowed;
+  unsigned i;
+  char *contents;
+  int cpu;
+  if (sched_getaffinity (0, sizeof (allowed), &allowed) < 0)
+    {
+      CPU_ZERO (&allowed);
+      CPU_SET (0, &allowed);
+    }
+
+  /* node numbers may have gaps, eg after memory hot-remove:
+     the online list, in the same format as a cpulist, has them all */
+  if (g_file_get_contents (NODE_SYSFS_DIR "/online", &contents, NULL, NULL))
+    {
+      online = parse_cpu_list (g_strstrip (contents), NULL);
+      g_free (contents);
+    }
+  for (i = 0; online != NULL && i < online->len; i++)
+    {
+      char *filename = g_strdup_printf (NODE_SYSFS_DIR "/node%d/cpulist",
+                                        g_array_index (online, int, i));
+      gboolean got = g_file_get_contents (filename, &contents, NULL, NULL);
+      GArray *cpus;
+      g_free (filename);
+      if (!got)
+        continue;
+      cpus = parse_cpu_list (g_strstrip (contents), &allowed);
+      g_free (contents);
+      if (cpus->len > 0)
+        g_ptr_array_add (nodes, cpus);
+      else
+        g_array_free (cpus, TRUE);
+    }
+  if (online != NULL)
+    g_array_free (online, TRUE);
+  if (nodes->len == 0)
+    {
+      GArray *cpus = g_array_new (FALSE, FALSE, sizeof (int));
+      for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+        if (CPU_ISSET (cpu, &allowed))
+          g_array_append_val (cpus, cpu);
+      g_ptr_array_add (nodes, cpus);
+    }
+
+  slots->n_nodes = nodes->len;
+  slots->node_cpus = (GArray **) g_ptr_array_free (nodes, FALSE);
+  slots->compact_cpus = g_array_new (FALSE, FALSE, sizeof (int));
+  for (i = 0; i < slots->n_nodes; i++)
+    g_array_append_vals (slots->compact_cpus, slots->node_cpus[i]->data,
+                         slots->node_cpus[i]->len);
+}
+
+void
+system_set_pin_policy (System         *system,
+                       SystemPinPolicy policy)
+{
+  Slots *slots = get_slots (system);
+  if (policy != SYSTEM_PIN_NONE && slots->node_cpus == NULL)
+    read_topology (slots);
+  slots->pin_policy = policy;
+}
@@ -0,0 +1,84 @@
+#!/bin/sh
+# Check pline --serve and --submit:  that a client gets its tasks'
+# output and exit status, and that a client which reads slowly holds
+# up its tasks (their output is paused, rather than piling up in the
+# server) without losing any of it.
+#
+# The server uses --io-engine=poll:  only that engine can pause a
+# task's output (see task_set_output_paused()).
+#
+# usage: tests/check-serve.sh [PLINE]
+
+PLINE=${1:-./pline}
+TIMEOUT=60                      # a run that stalls fails, rather than hangs
+SLOW_LINES=1000000              # 11MB of output, well over the server's 1MB
+
+tmp=$(mktemp -d) || exit 1
+server=
+trap '[ -n "$server" ] && kill $server; rm -rf "$tmp"' EXIT
+failed=0
+sock=$tmp/sock
+
+# expect WHAT GOT WANTED
+expect ()
+{
+  if [ "$2" = "$3" ]
+  then
+    echo "ok:   $1"
+  else
+    echo "FAIL: $1: got '$2', expected '$3'"
+    failed=1
+  fi
+}
+
+"$PLINE" --serve "$sock" --io-engine=poll 2>"$tmp/server.err" &
+server=$!
+i=0
+while [ ! -S "$sock" ] && [ $i -lt 50 ]
+do
+  sleep 0.1
+  i=$((i + 1))
+done
+if [ ! -S "$sock" ]
+then
+  echo "FAIL: the server didn't start"
+  cat "$tmp/server.err"
+  exit 1
+fi
+
+echo "== tasks that succeed"
+printf '%s\n' 'echo one' 'echo two >&2' 'echo "three four"' \
+  | timeout $TIMEOUT "$PLINE" --submit "$sock" >"$tmp/out" 2>"$tmp/err"
+expect "exit status" $? 0
+expect "stdout" "$(sort "$tmp/out" | tr '\n' ,)" "one,three four,"
+expect "stderr" "$(cat "$tmp/err")" "two"
+
+echo "== a task that fails"
+printf '%s\n' 'echo five' 'exit 3' \
+  | timeout $TIMEOUT "$PLINE" --submit "$sock" >"$tmp/out" 2>"$tmp/err"
+expect "exit status" $? 1
+expect "stdout" "$(cat "$tmp/out")" "five"
+expect "stderr" "$(sed -n 's/^Task [0-9]* exitted with status \([0-9]*\)!$/\1/p' "$tmp/err")" 3
+
+# the client's stdout isn't read for 2s:  the server should stop
+# reading the task's output, so that the task can't finish until
+# it is read
+echo "== a client that reads slowly"
+echo "yes 0123456789 | head -n $SLOW_LINES; touch $tmp/done" \
+  | timeout $TIMEOUT "$PLINE" --submit "$sock" 2>"$tmp/err" \
+  | {
+      sleep 2
+      if [ -e "$tmp/done" ]; then echo finished; else echo paused; fi
+      cat
+    } >"$tmp/out"
+expect "the task while unread" "$(head -n 1 "$tmp/out")" paused
+expect "lines" "$(grep -c '^0123456789$' "$tmp/out")" $SLOW_LINES
+expect "stderr" "$(cat "$tmp/err")" ""
+expect "the task" "$([ -e "$tmp/done" ] && echo finished)" finished
+
+# the server is still there for the next client
+echo "== another client"
+echo 'echo six' | timeout $TIMEOUT "$PLINE" --submit "$sock" >"$tmp/out"
+expect "stdout" "$(cat "$tmp/out")" "six"
+
+exit $failed
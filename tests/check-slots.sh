@@ -0,0 +1,118 @@
+#!/bin/sh
+# Check that pline keeps its slots full:  as each task ends, the next
+# queued one should start at once, and input should keep coming, so
+# that while work is queued, N tasks are running.  And that --source-max
+# and --weight divide the slots up as they say.
+#
+# Every task prints when it starts and ends ("S TAG NS", "E TAG NS");
+# from those we work out how many tasks were running at each moment.
+#
+# usage: tests/check-slots.sh [PLINE]
+
+PLINE=${1:-./pline}
+TASK_SECS=0.2
+MIN_UTILISATION=90              # percent of the slots busy
+TIMEOUT=60                      # a run that stalls fails, rather than hangs
+
+tmp=$(mktemp -d) || exit 1
+trap 'rm -rf "$tmp"' EXIT
+failed=0
+
+# make_input TAG N:  N tasks that print their tag as they start and end
+make_input ()
+{
+  i=0
+  while [ $i -lt $2 ]
+  do
+    echo "echo S $1 \$(date +%s%N); sleep $TASK_SECS; echo E $1 \$(date +%s%N)"
+    i=$((i + 1))
+  done > "$tmp/$1"
+}
+
+# measure FROM UNTIL:  from pline's output on stdin, for the time from
+# the first start of a FROM task to the last start of an UNTIL task
+# (while both had work queued), print "TAG MEAN MAX STARTS" for each
+# tag, and for "all":  how many of its tasks were running on average,
+# and at most, and how many it started then
+measure ()
+{
+  sed -n 's/^.*\]: \([SE]\) \([a-z]*\) \([0-9]*\)$/\3 \1 \2/p' \
+  | sort -n \
+  | awk -v from_tag="$1" -v until_tag="$2" '
+      { t[NR] = $1; kind[NR] = $2; tag[NR] = $3
+        if (start == "" && $2 == "S" && $3 == from_tag) start = $1
+        if ($2 == "S" && $3 == until_tag) end = $1 }
+      END {
+        tags["all"] = 1
+        for (i = 1; i <= NR; i++) {
+          if (t[i] > end) break
+          if (i > 1 && t[i - 1] >= start)
+            for (k in running) area[k] += running[k] * (t[i] - t[i - 1])
+          d = kind[i] == "S" ? 1 : -1
+          running[tag[i]] += d; running["all"] += d; tags[tag[i]] = 1
+          for (k in running) if (running[k] > max[k]) max[k] = running[k]
+          if (d == 1 && t[i] >= start) { starts[tag[i]]++; starts["all"]++ }
+        }
+        for (k in tags)
+          printf "%s %.2f %d %d\n", k,
+                 (end > start ? area[k] / (end - start) : 0), max[k], starts[k]
+      }'
+}
+
+# busy N:  how many of N slots should be busy on average
+busy ()
+{
+  awk -v n="$1" -v pc="$MIN_UTILISATION" 'BEGIN { print n * pc / 100 }'
+}
+
+# check RESULTS TAG WHAT OP VALUE:  fail unless TAG's WHAT OP VALUE
+check ()
+{
+  line=$(grep "^$2 " "$1")
+  set -- "$@" $line
+  case $3 in
+    mean) value=$7 ;;
+    max) value=$8 ;;
+    starts) value=$9 ;;
+  esac
+  if [ -n "$value" ] && awk -v a="$value" -v b="$5" "BEGIN { exit !(a $4 b) }"
+  then
+    echo "ok:   $2 $3 $value $4 $5"
+  else
+    echo "FAIL: $2 $3 $value, expected $4 $5"
+    failed=1
+  fi
+}
+
+# one input, 64 tasks on 8 slots
+echo "== -n 8, one input"
+make_input a 64
+timeout $TIMEOUT "$PLINE" -n 8 -i "$tmp/a" 2>/dev/null | measure a a > "$tmp/r1"
+check "$tmp/r1" all mean ">=" "$(busy 8)"
+check "$tmp/r1" all max "<=" 8
+
+# with a second input limited to one task at a time:  the other
+# input takes up the rest of the slots, while it has work
+echo "== -n 4, one input with --source-max 1"
+make_input b 16
+make_input c 16
+timeout $TIMEOUT "$PLINE" -n 4 -i "$tmp/b" --source-max 1 -i "$tmp/c" 2>/dev/null \
+  | measure b b > "$tmp/r2"
+check "$tmp/r2" all mean ">=" "$(busy 4)"
+check "$tmp/r2" all max "<=" 4
+check "$tmp/r2" c max "<=" 1
+
+# --weight 3 gives the second input three starts for each of the
+# first's, once it has work (the first is read first, and has all
+# the slots to begin with)
+echo "== -n 4, --weight 3 on the second input"
+make_input d 32
+make_input e 32
+timeout $TIMEOUT "$PLINE" -n 4 -i "$tmp/d" --weight 3 -i "$tmp/e" 2>/dev/null \
+  | measure e e > "$tmp/r3"
+check "$tmp/r3" all mean ">=" "$(busy 4)"
+d_starts=$(sed -n 's/^d .* //p' "$tmp/r3")
+check "$tmp/r3" e starts ">=" $((${d_starts:-0} * 5 / 2))
+check "$tmp/r3" e starts "<=" $((${d_starts:-0} * 7 / 2))
+
+exit $failed
@@ -0,0 +1,98 @@
+#!/bin/sh
+# Check command templates (see cmd-template.h):  that each placeholder
+# gives the argument, or the part of it, that it says, as one word
+# however awkward the input line, and that -X repeats the words with
+# placeholders for each argument of a batch.
+#
+# Each task runs printf '[%s]\n' with the expanded words, so every
+# argument it got is a line of output;  --mode=chunked prints the
+# tasks' output in order.
+#
+# usage: tests/check-template.sh [PLINE]
+
+PLINE=${1:-./pline}
+TIMEOUT=60                      # a run that stalls fails, rather than hangs
+
+tmp=$(mktemp -d) || exit 1
+trap 'rm -rf "$tmp"' EXIT
+failed=0
+
+# check WHAT:  fail unless $tmp/got is the same as $tmp/expected
+check ()
+{
+  if cmp -s "$tmp/got" "$tmp/expected"
+  then
+    echo "ok:   $1"
+  else
+    echo "FAIL: $1"
+    diff "$tmp/expected" "$tmp/got" | sed 's/^/      /'
+    failed=1
+  fi
+}
+
+# run PLINE-ARGS... -- TEMPLATE-WORDS...:  input lines from $tmp/input
+run ()
+{
+  timeout $TIMEOUT "$PLINE" --mode=chunked -n 1 -i "$tmp/input" "$@" \
+    > "$tmp/got" 2>/dev/null
+}
+
+printf '%s\n' \
+  'a b/c.d/e f.txt' \
+  "it's" \
+  '-x.y' \
+  'dir.v1/file' \
+  '/top.tar.gz' \
+  '.hidden' \
+  '$HOME `id` "q" a\b' \
+  > "$tmp/input"
+
+echo "== each placeholder"
+run -- "printf '[%s]\n'" {} {.} {/} {//} {/.} {#}
+printf '[%s]\n' \
+  'a b/c.d/e f.txt' 'a b/c.d/e f' 'e f.txt' 'a b/c.d' 'e f' 1 \
+  "it's" "it's" "it's" . "it's" 2 \
+  -x.y -x -x.y . -x 3 \
+  dir.v1/file dir.v1/file file dir.v1 file 4 \
+  /top.tar.gz /top.tar top.tar.gz / top.tar 5 \
+  .hidden .hidden .hidden . .hidden 6 \
+  '$HOME `id` "q" a\b' '$HOME `id` "q" a\b' '$HOME `id` "q" a\b' . \
+  '$HOME `id` "q" a\b' 7 \
+  > "$tmp/expected"
+check "{} {.} {/} {//} {/.} {#}"
+
+echo "== placeholders inside words"
+run -- "printf '[%s]\n'" --out={/.}.o x{#}y
+printf '[%s]\n' \
+  '--out=e f.o' x1y "--out=it's.o" x2y --out=-x.o x3y --out=file.o x4y \
+  --out=top.tar.o x5y --out=.hidden.o x6y '--out=$HOME `id` "q" a\b.o' x7y \
+  > "$tmp/expected"
+check "--out={/.}.o x{#}y"
+
+echo "== no placeholder"
+run -- "printf '[%s]\n'" --
+printf '[%s]\n' -- 'a b/c.d/e f.txt' -- "it's" -- -x.y -- dir.v1/file \
+  -- /top.tar.gz -- .hidden -- '$HOME `id` "q" a\b' \
+  > "$tmp/expected"
+check "the argument appended"
+
+# the first line runs on its own, as nothing is running yet;  the rest
+# wait for the one slot, and then make one batch
+echo "== -X"
+run -X -- "printf '[%s]\n'" -o {.}.o {} {#}
+printf '[%s]\n' \
+  -o 'a b/c.d/e f.o' 'a b/c.d/e f.txt' 1 \
+  -o "it's.o" -x.o dir.v1/file.o /top.tar.o .hidden.o \
+     '$HOME `id` "q" a\b.o' \
+     "it's" -x.y dir.v1/file /top.tar.gz .hidden '$HOME `id` "q" a\b' 2 \
+  > "$tmp/expected"
+check "-o {.}.o {} {#}"
+
+echo "== {VAR}"
+timeout $TIMEOUT "$PLINE" --mode=chunked -n 1 \
+  --product "V=a b,it's,-x" --range N=1:3 \
+  -- "printf '[%s]\n'" {V}/{N} 2>/dev/null > "$tmp/got"
+printf '[%s]\n' 'a b/1' 'a b/2' "it's/1" "it's/2" -x/1 -x/2 > "$tmp/expected"
+check "--product V=... --range N=1:3, {V}/{N}"
+
+exit $failed
@@ -0,0 +1,87 @@
+#!/bin/sh
+# Check --walk:  that it gives every file under its roots once, that a
+# root that isn't a directory is given itself, that symbolic links are
+# given as files rather than followed (so a loop of them ends), and
+# that a directory it can't read is warned about and the rest walked.
+#
+# (The unreadable directory can't be checked as root, who can read it
+# anyway:  that check is skipped then.)
+#
+# usage: tests/check-walk.sh [PLINE]
+
+PLINE=${1:-./pline}
+TIMEOUT=60                      # a walk that loops fails, rather than hangs
+
+tmp=$(mktemp -d) || exit 1
+trap 'chmod -R u+rwx "$tmp"; rm -rf "$tmp"' EXIT
+failed=0
+
+# check WHAT:  fail unless $tmp/got is the same as $tmp/expected
+check ()
+{
+  if cmp -s "$tmp/got" "$tmp/expected"
+  then
+    echo "ok:   $1"
+  else
+    echo "FAIL: $1"
+    diff "$tmp/expected" "$tmp/got" | sed 's/^/      /'
+    failed=1
+  fi
+}
+
+# walk ROOT...:  the sorted paths that a walk of ROOTs gives
+walk ()
+{
+  for root
+  do
+    set -- "$@" --walk "$root"
+    shift
+  done
+  timeout $TIMEOUT "$PLINE" --mode=chunked "$@" -- echo {} \
+    2>"$tmp/err" | sort > "$tmp/got"
+}
+
+mkdir -p "$tmp/t/a/b" "$tmp/t/c"
+touch "$tmp/t/a/f1" "$tmp/t/a/b/f2" "$tmp/t/c/f3" "$tmp/t/plain"
+
+echo "== a tree"
+walk "$tmp/t"
+printf '%s\n' "$tmp/t/a/b/f2" "$tmp/t/a/f1" "$tmp/t/c/f3" "$tmp/t/plain" \
+  > "$tmp/expected"
+check "every file once"
+
+echo "== a root that isn't a directory"
+walk "$tmp/t/plain" "$tmp/t/c"
+printf '%s\n' "$tmp/t/c/f3" "$tmp/t/plain" > "$tmp/expected"
+check "the file itself, with another root"
+
+echo "== symbolic link loops"
+ln -s .. "$tmp/t/a/b/up"
+ln -s loop2 "$tmp/t/loop1"
+ln -s loop1 "$tmp/t/loop2"
+walk "$tmp/t"
+printf '%s\n' "$tmp/t/a/b/f2" "$tmp/t/a/b/up" "$tmp/t/a/f1" "$tmp/t/c/f3" \
+  "$tmp/t/loop1" "$tmp/t/loop2" "$tmp/t/plain" > "$tmp/expected"
+check "links given, not followed"
+rm "$tmp/t/a/b/up" "$tmp/t/loop1" "$tmp/t/loop2"
+
+echo "== an unreadable directory"
+chmod 000 "$tmp/t/a"
+if ls "$tmp/t/a" >/dev/null 2>&1
+then
+  echo "skip: $tmp/t/a is readable anyway (running as root?)"
+else
+  walk "$tmp/t"
+  printf '%s\n' "$tmp/t/c/f3" "$tmp/t/plain" > "$tmp/expected"
+  check "the rest walked"
+  if grep -q "error opening directory $tmp/t/a" "$tmp/err"
+  then
+    echo "ok:   warned about it"
+  else
+    echo "FAIL: no warning about $tmp/t/a:"
+    sed 's/^/      /' "$tmp/err"
+    failed=1
+  fi
+fi
+
+exit $failed
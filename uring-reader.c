@@ -0,0 +1,480 @@
+#include "uring-reader.h"
+
+#ifndef HAVE_IO_URING
+
+gboolean
+uring_reader_init (void)
+{
+  return FALSE;
+}
+
+UringReader *
+uring_reader_new (int             fd,
+                  UringReaderFunc func,
+                  void           *func_data)
+{
+  g_assert_not_reached ();
+  return NULL;
+}
+
+void
+uring_reader_destroy (UringReader *reader)
+{
+  g_assert_not_reached ();
+}
+
+#else /* HAVE_IO_URING */
+
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <string.h>
+#include "g-source-fd.h"
+
+#if 1
+# define DEBUG_ONLY(x)
+#else
+# define DEBUG_ONLY(x) x
+#endif
+
+/* not in older kernel headers (added in linux 6.7) */
+#define URING_OP_READ_MULTISHOT         49
+
+#define SQ_ENTRIES                      256
+#define CQ_ENTRIES                      4096
+
+/* the provided-buffer ring:  N_BUFFERS must be a power of two */
+#define BUFFER_GROUP                    0
+#define N_BUFFERS                       256
+#define BUFFER_SIZE                     16384
+
+struct _UringReader
+{
+  int fd;
+  UringReaderFunc func;
+  void *func_data;
+  gboolean read_pending;
+  gboolean got_eof;
+  gboolean is_destroyed;
+  gboolean is_freed;
+  UringReader *next_destroyed;
+  UringReader *next_starved;
+};
+
+static struct
+{
+  int fd;
+
+  /* submission queue */
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_flags, *sq_array;
+  struct io_uring_sqe *sqes;
+  unsigned sq_local_tail;
+  unsigned n_unsubmitted;
+
+  /* completion queue */
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_cqe *cqes;
+
+  /* provided buffers */
+  struct io_uring_buf_ring *buf_ring;
+  guint8 *buffers;
+
+  gboolean has_multishot;
+
+  int event_fd;
+  GSourceFD *event_source;
+
+  /* readers destroyed while reaping are freed afterwards */
+  gboolean in_reap;
+  UringReader *destroyed;
+
+  /* readers whose read ran out of buffers:  re-armed once
+     the reap has given back the buffers it consumed */
+  UringReader *starved;
+} ring;
+
+static gboolean init_tried = FALSE;
+static gboolean init_ok = FALSE;
+
+static int
+sys_io_uring_setup (unsigned entries, struct io_uring_params *params)
+{
+  return syscall (__NR_io_uring_setup, entries, params);
+}
+
+static int
+sys_io_uring_enter (unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+  return syscall (__NR_io_uring_enter, ring.fd, to_submit, min_complete,
+                  flags, NULL, 0);
+}
+
+static int
+sys_io_uring_register (unsigned opcode, void *arg, unsigned nr_args)
+{
+  return syscall (__NR_io_uring_register, ring.fd, opcode, arg, nr_args);
+}
+
+static void
+submit_pending (void)
+{
+  while (ring.n_unsubmitted > 0)
+    {
+      int rv = sys_io_uring_enter (ring.n_unsubmitted, 0, 0);
+      if (rv < 0)
+        {
+          if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+            continue;
+          g_error ("error submitting to io_uring: %s", g_strerror (errno));
+        }
+      ring.n_unsubmitted -= rv;
+    }
+}
+
+static struct io_uring_sqe *
+get_sqe (void)
+{
+  unsigned head = __atomic_load_n (ring.sq_head, __ATOMIC_ACQUIRE);
+  struct io_uring_sqe *sqe;
+  unsigned index;
+  if (ring.sq_local_tail - head >= SQ_ENTRIES)
+    {
+      submit_pending ();
+      head = __atomic_load_n (ring.sq_head, __ATOMIC_ACQUIRE);
+    }
+  index = ring.sq_local_tail & *ring.sq_mask;
+  sqe = &ring.sqes[index];
+  memset (sqe, 0, sizeof (*sqe));
+  ring.sq_array[index] = index;
+  return sqe;
+}
+
+static void
+queue_sqe (void)
+{
+  ring.sq_local_tail++;
+  ring.n_unsubmitted++;
+  __atomic_store_n (ring.sq_tail, ring.sq_local_tail, __ATOMIC_RELEASE);
+}
+
+static void
+recycle_buffer (unsigned bid)
+{
+  unsigned short tail = ring.buf_ring->tail;
+  struct io_uring_buf *buf = &ring.buf_ring->bufs[tail & (N_BUFFERS - 1)];
+  buf->addr = (guint64) (uintptr_t) (ring.buffers + (gsize) bid * BUFFER_SIZE);
+  buf->len = BUFFER_SIZE;
+  buf->bid = bid;
+  __atomic_store_n (&ring.buf_ring->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+static void
+arm_reader (UringReader *reader)
+{
+  struct io_uring_sqe *sqe = get_sqe ();
+  sqe->opcode = ring.has_multishot ? URING_OP_READ_MULTISHOT : IORING_OP_READ;
+  sqe->fd = reader->fd;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = BUFFER_GROUP;
+  sqe->len = ring.has_multishot ? 0 : BUFFER_SIZE;
+  sqe->off = (guint64) -1;
+  sqe->user_data = (guint64) (uintptr_t) reader;
+  queue_sqe ();
+  reader->read_pending = TRUE;
+}
+
+static void
+free_reader (UringReader *reader)
+{
+  if (reader->is_freed)
+    return;
+  reader->is_freed = TRUE;
+  if (ring.in_reap)
+    {
+      reader->next_destroyed = ring.destroyed;
+      ring.destroyed = reader;
+    }
+  else
+    g_slice_free (UringReader, reader);
+}
+
+static void
+handle_cqe (const struct io_uring_cqe *cqe)
+{
+  UringReader *reader = (UringReader *) (uintptr_t) cqe->user_data;
+  int res = cqe->res;
+
+  /* completions of cancel requests */
+  if (reader == NULL)
+    return;
+
+  if (!(cqe->flags & IORING_CQE_F_MORE))
+    reader->read_pending = FALSE;
+
+  if (res > 0)
+    {
+      unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+      if (!reader->is_destroyed)
+        reader->func (ring.buffers + (gsize) bid * BUFFER_SIZE, res,
+                      reader->func_data);
+      recycle_buffer (bid);
+    }
+  else if (res == 0)
+    {
+      reader->got_eof = TRUE;
+      if (!reader->is_destroyed)
+        reader->func (NULL, 0, reader->func_data);
+    }
+  else if (res != -ENOBUFS && res != -EINTR && res != -EAGAIN
+        && res != -ECANCELED)
+    {
+      g_warning ("error reading from fd %d with io_uring: %s",
+                 reader->fd, g_strerror (-res));
+      reader->got_eof = TRUE;
+      if (!reader->is_destroyed)
+        reader->func (NULL, 0, reader->func_data);
+    }
+
+  if (!reader->read_pending)
+    {
+      if (reader->is_destroyed)
+        free_reader (reader);
+      else if (res == -ENOBUFS)
+        {
+          reader->next_starved = ring.starved;
+          ring.starved = reader;
+        }
+      else if (!reader->got_eof)
+        arm_reader (reader);
+    }
+}
+
+static gboolean
+handle_eventfd_readable (void *data)
+{
+  guint64 count;
+  unsigned head, tail;
+
+  if (read (ring.event_fd, &count, sizeof (count)) < 0 && errno != EAGAIN)
+    g_error ("error reading io_uring eventfd: %s", g_strerror (errno));
+
+  ring.in_reap = TRUE;
+  for (;;)
+    {
+      head = *ring.cq_head;
+      tail = __atomic_load_n (ring.cq_tail, __ATOMIC_ACQUIRE);
+      if (head == tail)
+        {
+          /* completions that didn't fit in the CQ ring
+             are held by the kernel until we ask for them */
+          if (__atomic_load_n (ring.sq_flags, __ATOMIC_ACQUIRE) & IORING_SQ_CQ_OVERFLOW)
+            {
+              sys_io_uring_enter (0, 0, IORING_ENTER_GETEVENTS);
+              continue;
+            }
+          break;
+        }
+      DEBUG_ONLY (g_message ("uring: reaping %u completions", tail - head));
+      while (head != tail)
+        {
+          handle_cqe (&ring.cqes[head & *ring.cq_mask]);
+          head++;
+        }
+      __atomic_store_n (ring.cq_head, head, __ATOMIC_RELEASE);
+    }
+  ring.in_reap = FALSE;
+
+  /* every buffer we reaped has been recycled by now */
+  while (ring.starved != NULL)
+    {
+      UringReader *reader = ring.starved;
+      ring.starved = reader->next_starved;
+      if (!reader->is_destroyed)
+        arm_reader (reader);
+    }
+
+  while (ring.destroyed != NULL)
+    {
+      UringReader *reader = ring.destroyed;
+      ring.destroyed = reader->next_destroyed;
+      g_slice_free (UringReader, reader);
+    }
+
+  /* one syscall re-arms everything we reaped */
+  submit_pending ();
+  return TRUE;
+}
+
+static gboolean
+probe_multishot (void)
+{
+  gsize size = sizeof (struct io_uring_probe)
+             + 256 * sizeof (struct io_uring_probe_op);
+  struct io_uring_probe *probe = g_malloc0 (size);
+  gboolean rv = FALSE;
+  if (sys_io_uring_register (IORING_REGISTER_PROBE, probe, 256) == 0
+   && probe->last_op >= URING_OP_READ_MULTISHOT
+   && (probe->ops[URING_OP_READ_MULTISHOT].flags & IO_URING_OP_SUPPORTED))
+    rv = TRUE;
+  g_free (probe);
+  return rv;
+}
+
+static gboolean
+do_init (void)
+{
+  struct io_uring_params params;
+  struct io_uring_buf_reg buf_reg;
+  gsize sq_len, cq_len, ring_len, sqes_len, buf_ring_len;
+  void *sq_ptr, *cq_ptr;
+  unsigned i;
+
+  memset (&params, 0, sizeof (params));
+  params.flags = IORING_SETUP_CQSIZE;
+  params.cq_entries = CQ_ENTRIES;
+  ring.fd = sys_io_uring_setup (SQ_ENTRIES, &params);
+  if (ring.fd < 0)
+    {
+      DEBUG_ONLY (g_message ("io_uring_setup: %s", g_strerror (errno)));
+      return FALSE;
+    }
+  if (!(params.features & IORING_FEAT_SINGLE_MMAP))
+    goto fail_close;
+
+  sq_len = params.sq_off.array + params.sq_entries * sizeof (unsigned);
+  cq_len = params.cq_off.cqes + params.cq_entries * sizeof (struct io_uring_cqe);
+  ring_len = MAX (sq_len, cq_len);
+  sq_ptr = mmap (NULL, ring_len, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+  if (sq_ptr == MAP_FAILED)
+    goto fail_close;
+  cq_ptr = sq_ptr;
+  ring.sq_head = (unsigned *) ((char *) sq_ptr + params.sq_off.head);
+  ring.sq_tail = (unsigned *) ((char *) sq_ptr + params.sq_off.tail);
+  ring.sq_mask = (unsigned *) ((char *) sq_ptr + params.sq_off.ring_mask);
+  ring.sq_flags = (unsigned *) ((char *) sq_ptr + params.sq_off.flags);
+  ring.sq_array = (unsigned *) ((char *) sq_ptr + params.sq_off.array);
+  ring.cq_head = (unsigned *) ((char *) cq_ptr + params.cq_off.head);
+  ring.cq_tail = (unsigned *) ((char *) cq_ptr + params.cq_off.tail);
+  ring.cq_mask = (unsigned *) ((char *) cq_ptr + params.cq_off.ring_mask);
+  ring.cqes = (struct io_uring_cqe *) ((char *) cq_ptr + params.cq_off.cqes);
+  sqes_len = params.sq_entries * sizeof (struct io_uring_sqe);
+  ring.sqes = mmap (NULL, sqes_len,
+                    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    ring.fd, IORING_OFF_SQES);
+  if (ring.sqes == MAP_FAILED)
+    goto fail_unmap_rings;
+  ring.sq_local_tail = *ring.sq_tail;
+  ring.n_unsubmitted = 0;
+
+  /* provided buffers (linux 5.19) */
+  buf_ring_len = N_BUFFERS * sizeof (struct io_uring_buf);
+  ring.buf_ring = mmap (NULL, buf_ring_len, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (ring.buf_ring == MAP_FAILED)
+    goto fail_unmap_sqes;
+  memset (&buf_reg, 0, sizeof (buf_reg));
+  buf_reg.ring_addr = (guint64) (uintptr_t) ring.buf_ring;
+  buf_reg.ring_entries = N_BUFFERS;
+  buf_reg.bgid = BUFFER_GROUP;
+  if (sys_io_uring_register (IORING_REGISTER_PBUF_RING, &buf_reg, 1) < 0)
+    {
+      DEBUG_ONLY (g_message ("IORING_REGISTER_PBUF_RING: %s", g_strerror (errno)));
+      goto fail_unmap_buf_ring;
+    }
+  ring.buffers = g_malloc ((gsize) N_BUFFERS * BUFFER_SIZE);
+  ring.buf_ring->tail = 0;
+  for (i = 0; i < N_BUFFERS; i++)
+    recycle_buffer (i);
+
+  ring.has_multishot = probe_multishot ();
+
+  ring.event_fd = eventfd (0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (ring.event_fd < 0)
+    goto fail_free_buffers;
+  if (sys_io_uring_register (IORING_REGISTER_EVENTFD, &ring.event_fd, 1) < 0)
+    goto fail_close_event_fd;
+  ring.event_source = g_source_fd_new (ring.event_fd, G_IO_IN,
+                                       handle_eventfd_readable, NULL);
+  ring.in_reap = FALSE;
+  ring.destroyed = NULL;
+  ring.starved = NULL;
+  DEBUG_ONLY (g_message ("io_uring reader ready (multishot=%d)", ring.has_multishot));
+  return TRUE;
+
+  /* closing the ring unregisters the buffer ring and the eventfd */
+fail_close_event_fd:
+  close (ring.event_fd);
+fail_free_buffers:
+  g_free (ring.buffers);
+fail_unmap_buf_ring:
+  munmap (ring.buf_ring, buf_ring_len);
+fail_unmap_sqes:
+  munmap (ring.sqes, sqes_len);
+fail_unmap_rings:
+  munmap (sq_ptr, ring_len);
+fail_close:
+  close (ring.fd);
+  return FALSE;
+}
+
+gboolean
+uring_reader_init (void)
+{
+  if (!init_tried)
+    {
+      init_tried = TRUE;
+      init_ok = do_init ();
+    }
+  return init_ok;
+}
+
+UringReader *
+uring_reader_new (int             fd,
+                  UringReaderFunc func,
+                  void           *func_data)
+{
+  UringReader *reader = g_slice_new (UringReader);
+  g_assert (init_ok);
+  reader->fd = fd;
+  reader->func = func;
+  reader->func_data = func_data;
+  reader->read_pending = FALSE;
+  reader->got_eof = FALSE;
+  reader->is_destroyed = FALSE;
+  reader->is_freed = FALSE;
+  reader->next_destroyed = NULL;
+  reader->next_starved = NULL;
+  arm_reader (reader);
+  if (!ring.in_reap)
+    submit_pending ();
+  return reader;
+}
+
+/* If a read is still outstanding, it is cancelled, and
+   the reader is freed when its last completion arrives. */
+void
+uring_reader_destroy (UringReader *reader)
+{
+  g_assert (!reader->is_destroyed);
+  reader->is_destroyed = TRUE;
+  if (reader->read_pending)
+    {
+      struct io_uring_sqe *sqe = get_sqe ();
+      sqe->opcode = IORING_OP_ASYNC_CANCEL;
+      sqe->fd = -1;
+      sqe->addr = (guint64) (uintptr_t) reader;
+      sqe->user_data = 0;
+      queue_sqe ();
+      if (!ring.in_reap)
+        submit_pending ();
+    }
+  else
+    free_reader (reader);
+}
+
+#endif /* HAVE_IO_URING */
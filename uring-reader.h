@@ -0,0 +1,24 @@
+
+#include <glib.h>
+
+/* Read from pipes using io_uring:  every UringReader keeps a read
+   outstanding (multishot, where the kernel supports it), with buffers
+   from a shared provided-buffer ring, and completions for all readers
+   are reaped in batches when one eventfd becomes readable.
+
+   Only compiled in with HAVE_IO_URING;  otherwise, or if the kernel
+   doesn't support what we need, uring_reader_init() returns FALSE
+   and the caller should poll the fds instead. */
+typedef struct _UringReader UringReader;
+
+/* 'len' is 0 at end-of-file;  after that, func is not called again.
+   'data' is only valid during the callback. */
+typedef void (*UringReaderFunc) (const guint8 *data,
+                                 unsigned      len,
+                                 void         *func_data);
+
+gboolean     uring_reader_init    (void);
+UringReader *uring_reader_new     (int             fd,
+                                   UringReaderFunc func,
+                                   void           *func_data);
+void         uring_reader_destroy (UringReader    *reader);
@@ -0,0 +1,342 @@
+#include <sys/syscall.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "parallelizer.h"
+
+#if 1
+# define DEBUG_ONLY(x)
+#else
+# define DEBUG_ONLY(x) x
+#endif
+
+/* the walkers stop when this many matches are waiting */
+#define MAX_RESULTS             4096
+#define GETDENTS_BUFFER_SIZE    (64*1024)
+
+/* as returned by getdents64;  glibc doesn't declare it */
+struct linux_dirent64
+{
+  guint64        d_ino;
+  gint64         d_off;
+  unsigned short d_reclen;
+  unsigned char  d_type;
+  char           d_name[];
+};
+
+typedef struct _SourceWalk SourceWalk;
+struct _SourceWalk
+{
+  Source base;
+  char *pattern;                /* NULL to match every file */
+  unsigned n_threads;
+  GThread **threads;            /* NULL until first trapped */
+
+  /* shared with the walker threads */
+  GMutex lock;
+  GCond dirs_cond;              /* dirs was added to, or we are done */
+  GCond results_cond;           /* results has room */
+  GQueue dirs;                  /* paths still to read */
+  unsigned n_busy;              /* walkers reading a directory */
+  GPtrArray *results;
+  gboolean is_walk_done;
+  gboolean is_cancelled;
+  int event_fd;                 /* written when results are added */
+
+  /* only used by the main thread:  results taken
+     from the walkers, but not yet given out */
+  GPtrArray *pending;
+  unsigned pending_at;
+  GSourceFD *source;
+};
+
+static void
+walk_add_result (SourceWalk *walk,
+                 char       *path)
+{
+  guint64 one = 1;
+  g_mutex_lock (&walk->lock);
+  while (walk->results->len >= MAX_RESULTS && !walk->is_cancelled)
+    g_cond_wait (&walk->results_cond, &walk->lock);
+  g_ptr_array_add (walk->results, path);
+  g_mutex_unlock (&walk->lock);
+  if (write (walk->event_fd, &one, sizeof (one)) < 0 && errno != EAGAIN)
+    g_warning ("error writing to eventfd: %s", g_strerror (errno));
+}
+
+static char *
+join_path (const char *dir, const char *name)
+{
+  gsize dir_len = strlen (dir);
+  if (dir_len > 0 && dir[dir_len - 1] == '/')
+    return g_strconcat (dir, name, NULL);
+  return g_strconcat (dir, "/", name, NULL);
+}
+
+static void
+walk_read_dir (SourceWalk *walk,
+               const char *dir,
+               char       *buf)
+{
+  int fd = openat (AT_FDCWD, dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  GPtrArray *subdirs = NULL;
+  long n;
+  if (fd < 0 && errno == ENOTDIR)
+    {
+      /* a root that is a file:  it is a result itself */
+      const char *name = strrchr (dir, '/');
+      name = name == NULL ? dir : name + 1;
+      if (walk->pattern == NULL || fnmatch (walk->pattern, name, 0) == 0)
+        walk_add_result (walk, g_strdup (dir));
+      return;
+    }
+  if (fd < 0)
+    {
+      g_warning ("error opening directory %s: %s", dir, g_strerror (errno));
+      return;
+    }
+  while ((n = syscall (SYS_getdents64, fd, buf, GETDENTS_BUFFER_SIZE)) > 0)
+    {
+      long at = 0;
+      while (at < n)
+        {
+          struct linux_dirent64 *ent = (struct linux_dirent64 *) (buf + at);
+          const char *name = ent->d_name;
+          unsigned char type = ent->d_type;
+          at += ent->d_reclen;
+          if (name[0] == '.'
+           && (name[1] == 0 || (name[1] == '.' && name[2] == 0)))
+            continue;
+          if (type == DT_UNKNOWN)
+            {
+              /* some filesystems don't fill in d_type */
+              struct stat stat_buf;
+              if (fstatat (fd, name, &stat_buf, AT_SYMLINK_NOFOLLOW) < 0)
+                continue;
+              type = S_ISDIR (stat_buf.st_mode) ? DT_DIR : DT_REG;
+            }
+          if (type == DT_DIR)
+            {
+              if (subdirs == NULL)
+                subdirs = g_ptr_array_new ();
+              g_ptr_array_add (subdirs, join_path (dir, name));
+            }
+          else if (walk->pattern == NULL
+                || fnmatch (walk->pattern, name, 0) == 0)
+            walk_add_result (walk, join_path (dir, name));
+        }
+    }
+  if (n < 0)
+    g_warning ("error reading directory %s: %s", dir, g_strerror (errno));
+  close (fd);
+
+  if (subdirs != NULL)
+    {
+      unsigned i;
+      g_mutex_lock (&walk->lock);
+      for (i = 0; i < subdirs->len; i++)
+        g_queue_push_tail (&walk->dirs, subdirs->pdata[i]);
+      if (subdirs->len > 1)
+        g_cond_broadcast (&walk->dirs_cond);
+      else
+        g_cond_signal (&walk->dirs_cond);
+      g_mutex_unlock (&walk->lock);
+      g_ptr_array_free (subdirs, TRUE);
+    }
+}
+
+static gpointer
+walker_thread (gpointer data)
+{
+  SourceWalk *walk = data;
+  char *buf = g_malloc (GETDENTS_BUFFER_SIZE);
+  guint64 one = 1;
+
+  g_mutex_lock (&walk->lock);
+  for (;;)
+    {
+      char *dir;
+      while (g_queue_is_empty (&walk->dirs)
+          && walk->n_busy > 0
+          && !walk->is_cancelled)
+        g_cond_wait (&walk->dirs_cond, &walk->lock);
+      if (walk->is_cancelled || g_queue_is_empty (&walk->dirs))
+        break;
+      dir = g_queue_pop_head (&walk->dirs);
+      walk->n_busy++;
+      g_mutex_unlock (&walk->lock);
+
+      walk_read_dir (walk, dir, buf);
+      g_free (dir);
+
+      g_mutex_lock (&walk->lock);
+      walk->n_busy--;
+      if (walk->n_busy == 0 && g_queue_is_empty (&walk->dirs))
+        {
+          /* nothing left:  wake everyone so they exit */
+          g_cond_broadcast (&walk->dirs_cond);
+        }
+    }
+  if (!walk->is_walk_done && walk->n_busy == 0)
+    {
+      walk->is_walk_done = TRUE;
+      if (write (walk->event_fd, &one, sizeof (one)) < 0 && errno != EAGAIN)
+        g_warning ("error writing to eventfd: %s", g_strerror (errno));
+    }
+  g_mutex_unlock (&walk->lock);
+  g_free (buf);
+  return NULL;
+}
+
+/* give out matches until we are untrapped */
+static gboolean
+handle_walk_eventfd_readable (void *data)
+{
+  SourceWalk *walk = data;
+  guint64 count;
+  gboolean is_walk_done;
+  if (read (walk->event_fd, &count, sizeof (count)) < 0 && errno != EAGAIN)
+    g_error ("error reading eventfd: %s", g_strerror (errno));
+
+  for (;;)
+    {
+      while (walk->pending_at < walk->pending->len)
+        {
+          char *path;
+          if (walk->base.callback == NULL)
+            return TRUE;
+          path = walk->pending->pdata[walk->pending_at++];
+          walk->base.callback (&walk->base, path, strlen (path),
+                               walk->base.trap_data);
+          g_free (path);
+        }
+      g_ptr_array_set_size (walk->pending, 0);
+      walk->pending_at = 0;
+
+      /* swap in the walkers' results */
+      g_mutex_lock (&walk->lock);
+      if (walk->results->len > 0)
+        {
+          GPtrArray *tmp = walk->pending;
+          walk->pending = walk->results;
+          walk->results = tmp;
+          g_cond_broadcast (&walk->results_cond);
+        }
+      is_walk_done = walk->is_walk_done;
+      g_mutex_unlock (&walk->lock);
+      if (walk->pending->len == 0)
+        break;
+    }
+
+  if (is_walk_done && walk->base.callback != NULL)
+    walk->base.callback (&walk->base, NULL, 0, walk->base.trap_data);
+  return TRUE;
+}
+
+static void
+walk_trap (Source *source)
+{
+  SourceWalk *walk = (SourceWalk *) source;
+  unsigned i;
+  if (walk->threads == NULL)
+    {
+      walk->threads = g_new (GThread *, walk->n_threads);
+      for (i = 0; i < walk->n_threads; i++)
+        walk->threads[i] = g_thread_new ("walker", walker_thread, walk);
+    }
+  walk->source = g_source_fd_new (walk->event_fd, G_IO_IN,
+                                  handle_walk_eventfd_readable, walk);
+
+  /* anything pending from before we were untrapped */
+  if (walk->pending_at < walk->pending->len)
+    {
+      guint64 one = 1;
+      if (write (walk->event_fd, &one, sizeof (one)) < 0 && errno != EAGAIN)
+        g_warning ("error writing to eventfd: %s", g_strerror (errno));
+    }
+}
+
+static void
+walk_untrap (Source *source)
+{
+  SourceWalk *walk = (SourceWalk *) source;
+  if (walk->source != NULL)
+    {
+      g_source_fd_destroy (walk->source);
+      walk->source = NULL;
+    }
+}
+
+static void
+walk_destroy (Source *source)
+{
+  SourceWalk *walk = (SourceWalk *) source;
+  unsigned i;
+  char *dir;
+  walk_untrap (source);
+  if (walk->threads != NULL)
+    {
+      g_mutex_lock (&walk->lock);
+      walk->is_cancelled = TRUE;
+      g_cond_broadcast (&walk->dirs_cond);
+      g_cond_broadcast (&walk->results_cond);
+      g_mutex_unlock (&walk->lock);
+      for (i = 0; i < walk->n_threads; i++)
+        g_thread_join (walk->threads[i]);
+      g_free (walk->threads);
+    }
+  while ((dir = g_queue_pop_head (&walk->dirs)) != NULL)
+    g_free (dir);
+  for (i = walk->pending_at; i < walk->pending->len; i++)
+    g_free (walk->pending->pdata[i]);
+  for (i = 0; i < walk->results->len; i++)
+    g_free (walk->results->pdata[i]);
+  g_ptr_array_free (walk->pending, TRUE);
+  g_ptr_array_free (walk->results, TRUE);
+  g_mutex_clear (&walk->lock);
+  g_cond_clear (&walk->dirs_cond);
+  g_cond_clear (&walk->results_cond);
+  close (walk->event_fd);
+  g_free (walk->pattern);
+  g_slice_free (SourceWalk, walk);
+}
+
+Source *
+walk_source_new (char      **roots,
+                 const char *pattern,
+                 unsigned    n_threads)
+{
+  SourceWalk *walk = g_slice_new (SourceWalk);
+  char **at;
+  walk->base.trap = walk_trap;
+  walk->base.untrap = walk_untrap;
+  walk->base.destroy = walk_destroy;
+  walk->base.callback = NULL;
+  walk->base.trap_data = NULL;
+  walk->base.has_stable_strs = FALSE;
+  walk->pattern = g_strdup (pattern);
+  walk->n_threads = MAX (n_threads, 1);
+  walk->threads = NULL;
+  g_mutex_init (&walk->lock);
+  g_cond_init (&walk->dirs_cond);
+  g_cond_init (&walk->results_cond);
+  g_queue_init (&walk->dirs);
+  for (at = roots; *at != NULL; at++)
+    g_queue_push_tail (&walk->dirs, g_strdup (*at));
+  walk->n_busy = 0;
+  walk->results = g_ptr_array_new ();
+  walk->is_walk_done = FALSE;
+  walk->is_cancelled = FALSE;
+  walk->event_fd = eventfd (0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (walk->event_fd < 0)
+    g_error ("error creating eventfd: %s", g_strerror (errno));
+  walk->pending = g_ptr_array_new ();
+  walk->pending_at = 0;
+  walk->source = NULL;
+  return &walk->base;
+}
@@ -0,0 +1,458 @@
+#include <errno.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+#include "parallelizer-private.h"
+#include "line-buffer.h"
+#include "child-watch.h"
+
+/* Persistent workers:  long-lived shells that read command-lines
+   from their stdin.  Each command is followed by an end-of-task marker
+   on both stdout and stderr:
+
+     ( eval 'CMDLINE' ) </dev/null; printf '%s%03d\n' TOKEN $?; printf '%s\n' TOKEN >&2
+
+   TOKEN is random per pool, so a task's output will not contain
+   it by accident.  If the task's output did not end in a newline,
+   the marker ends up at the end of its last line, so we look for
+   markers at the end of lines rather than as whole lines.
+
+   Output is passed to the traps a line at a time, since we must
+   strip out the markers.  Output from background processes
+   that outlive their task is dropped (or, worse, attributed to
+   the worker's next task). */
+
+#if 1
+# define DEBUG_ONLY(x)
+#else
+# define DEBUG_ONLY(x) x
+#endif
+
+typedef struct _Worker Worker;
+typedef struct _WorkerPool WorkerPool;
+
+struct _Worker
+{
+  WorkerPool *pool;
+  pid_t pid;
+  int wait_status;
+
+  int stdin_fd;
+  int stdout_fd;
+  GSourceFD *stdout_source;
+  LineBuffer *stdout_buffer;
+  int stderr_fd;
+  GSourceFD *stderr_source;
+  LineBuffer *stderr_buffer;
+
+  /* the task we are running, or NULL if idle */
+  Task *task;
+  gboolean got_stdout_marker;
+  gboolean got_stderr_marker;
+  int exit_status;
+
+  /* we closed stdin, or the shell died:  no further tasks */
+  gboolean is_closing;
+};
+
+struct _WorkerPool
+{
+  System *system;
+  char *token;
+  unsigned token_len;
+  GPtrArray *idle_workers;
+  unsigned n_workers;           /* not counting closing workers */
+};
+
+static WorkerPool *
+get_pool (System *system)
+{
+  WorkerPool *pool = system->worker_pool;
+  if (pool == NULL)
+    {
+      pool = g_slice_new (WorkerPool);
+      pool->system = system;
+      pool->token = g_strdup_printf ("PLINE-EOT-%u-%08x%08x",
+                                     (unsigned) getpid (),
+                                     g_random_int (), g_random_int ());
+      pool->token_len = strlen (pool->token);
+      pool->idle_workers = g_ptr_array_new ();
+      pool->n_workers = 0;
+      system->worker_pool = pool;
+    }
+  return pool;
+}
+
+static void
+maybe_destroy_worker (Worker *worker)
+{
+  WorkerPool *pool = worker->pool;
+  Task *task = worker->task;
+  int wait_status = worker->wait_status;
+  if (worker->pid >= 0
+   || worker->stdout_source != NULL
+   || worker->stderr_source != NULL)
+    return;
+
+  DEBUG_ONLY (g_message ("worker destroyed (task=%p)", task));
+  if (!worker->is_closing)
+    pool->n_workers--;
+  g_ptr_array_remove_fast (pool->idle_workers, worker);
+  if (worker->stdin_fd >= 0)
+    close (worker->stdin_fd);
+  line_buffer_free (worker->stdout_buffer);
+  line_buffer_free (worker->stderr_buffer);
+  g_slice_free (Worker, worker);
+
+  /* the shell died in the middle of a task */
+  if (task != NULL)
+    {
+      TaskTerminationType type;
+      int info;
+      decode_wait_status (wait_status, &type, &info);
+      task_done (task, type, info);
+    }
+}
+
+static void
+close_worker (Worker *worker)
+{
+  if (!worker->is_closing)
+    {
+      worker->is_closing = TRUE;
+      worker->pool->n_workers--;
+    }
+  if (worker->stdin_fd >= 0)
+    {
+      close (worker->stdin_fd);
+      worker->stdin_fd = -1;
+    }
+}
+
+static void
+handle_worker_exited (GPid                 pid,
+                      gint                 status,
+                      const struct rusage *usage,
+                      gpointer             data)
+{
+  Worker *worker = data;
+  worker->pid = -1;
+  worker->wait_status = status;
+  if (!worker->is_closing)
+    close_worker (worker);
+  maybe_destroy_worker (worker);
+}
+
+static void
+finish_worker_task (Worker *worker)
+{
+  WorkerPool *pool = worker->pool;
+  Task *task = worker->task;
+  TaskTerminationType type = TASK_TERMINATION_EXIT;
+  int info = worker->exit_status;
+
+  /* what the shell reports for a command killed by a signal */
+  if (info > 128)
+    {
+      type = TASK_TERMINATION_SIGNAL;
+      info -= 128;
+    }
+
+  worker->task = NULL;
+  if (pool->n_workers > pool->system->max_running_tasks)
+    close_worker (worker);
+  else
+    g_ptr_array_add (pool->idle_workers, worker);
+  task_done (task, type, info);
+}
+
+/* If 'line' ends with a marker, return the length of the
+   output that precedes the marker; otherwise -1. */
+static int
+find_marker (WorkerPool *pool,
+             const char *line,
+             unsigned    line_len,
+             gboolean    is_stderr,
+             int        *exit_status_out)
+{
+  unsigned status_len = is_stderr ? 0 : 3;
+  const char *marker;
+  if (line_len < pool->token_len + status_len)
+    return -1;
+  marker = line + line_len - pool->token_len - status_len;
+  if (memcmp (marker, pool->token, pool->token_len) != 0)
+    return -1;
+  if (!is_stderr)
+    {
+      const char *status = marker + pool->token_len;
+      if (!g_ascii_isdigit (status[0])
+       || !g_ascii_isdigit (status[1])
+       || !g_ascii_isdigit (status[2]))
+        return -1;
+      *exit_status_out = (status[0] - '0') * 100
+                       + (status[1] - '0') * 10
+                       + (status[2] - '0');
+    }
+  return marker - line;
+}
+
+/* pass the lines gathered so far to the traps */
+static void
+flush_lines (Task           *task,
+             const GTimeVal *cur_time,
+             gboolean        is_stderr,
+             GArray         *lines)
+{
+  if (lines->len > 0)
+    task_run_lines_traps (task, cur_time, is_stderr,
+                          lines->len, (TaskLine *) lines->data);
+  g_array_set_size (lines, 0);
+}
+
+static gboolean
+handle_worker_readable (Worker     *worker,
+                        int         fd,
+                        LineBuffer *buffer,
+                        gboolean    is_stderr)
+{
+  unsigned space;
+  guint8 *at = line_buffer_get_write_space (buffer, 4096, &space);
+  ssize_t read_rv;
+  char *line;
+  unsigned line_len;
+  GArray *lines = worker->pool->system->tmp_lines;
+  GTimeVal cur_time;
+  gboolean finished_task = FALSE;
+
+  read_rv = read (fd, at, space);
+  if (read_rv < 0)
+    g_error ("error reading from worker %s file-descriptor: %s",
+             is_stderr ? "stderr" : "stdout", g_strerror (errno));
+  if (read_rv == 0)
+    return FALSE;
+  line_buffer_commit (buffer, read_rv);
+
+  g_get_current_time (&cur_time);
+  g_array_set_size (lines, 0);
+  while ((line = line_buffer_next_line (buffer, &line_len)) != NULL)
+    {
+      /* finishing a task may start the next one on this worker:
+         the rest of this buffer is still from the old one */
+      Task *task = finished_task ? NULL : worker->task;
+      int exit_status = 0;
+      int output_len;
+
+      if (task == NULL)
+        {
+          /* output from a background process of some old task */
+        }
+      else if ((output_len = find_marker (worker->pool, line, line_len,
+                                          is_stderr, &exit_status)) >= 0)
+        {
+          flush_lines (task, &cur_time, is_stderr, lines);
+
+          /* like a task's partial last line at eof:
+             passed as data, but not as a line */
+          if (output_len > 0)
+            task_run_data_traps (task, &cur_time, is_stderr,
+                                 output_len, (guint8 *) line);
+          if (is_stderr)
+            worker->got_stderr_marker = TRUE;
+          else
+            {
+              worker->got_stdout_marker = TRUE;
+              worker->exit_status = exit_status;
+            }
+        }
+      else
+        {
+          TaskLine task_line;
+
+          /* the data includes the newline */
+          line[line_len] = '\n';
+          task_run_data_traps (task, &cur_time, is_stderr,
+                               line_len + 1, (guint8 *) line);
+          line[line_len] = 0;
+          task_line.text = line;
+          task_line.len = line_len;
+          g_array_append_val (lines, task_line);
+        }
+
+      if (task != NULL
+       && worker->got_stdout_marker
+       && worker->got_stderr_marker)
+        {
+          finish_worker_task (worker);
+          finished_task = TRUE;
+        }
+    }
+  if (worker->task != NULL && !finished_task)
+    flush_lines (worker->task, &cur_time, is_stderr, lines);
+  return TRUE;
+}
+
+static gboolean
+handle_worker_stdout_readable (void *data)
+{
+  Worker *worker = data;
+  if (!handle_worker_readable (worker, worker->stdout_fd,
+                               worker->stdout_buffer, FALSE))
+    {
+      g_source_fd_destroy (worker->stdout_source);
+      worker->stdout_source = NULL;
+      close (worker->stdout_fd);
+      worker->stdout_fd = -1;
+      maybe_destroy_worker (worker);
+      return FALSE;
+    }
+  return TRUE;
+}
+
+static gboolean
+handle_worker_stderr_readable (void *data)
+{
+  Worker *worker = data;
+  if (!handle_worker_readable (worker, worker->stderr_fd,
+                               worker->stderr_buffer, TRUE))
+    {
+      g_source_fd_destroy (worker->stderr_source);
+      worker->stderr_source = NULL;
+      close (worker->stderr_fd);
+      worker->stderr_fd = -1;
+      maybe_destroy_worker (worker);
+      return FALSE;
+    }
+  return TRUE;
+}
+
+static Worker *
+worker_new (WorkerPool *pool)
+{
+  System *system = pool->system;
+  Worker *worker = g_slice_new (Worker);
+  int stdin_pipe[2], stdout_pipe[2], stderr_pipe[2];
+  gint64 spawn_start = g_get_monotonic_time ();
+
+  system_make_pipe (stdin_pipe);
+  system_make_pipe (stdout_pipe);
+  system_make_pipe (stderr_pipe);
+  worker->pid = system_spawn_process (system, NULL,
+                                      stdin_pipe[0],
+                                      stdout_pipe[1],
+                                      stderr_pipe[1],
+                                      -1, -1);
+  system->stats.n_spawned++;
+  system->stats.spawn_usecs += g_get_monotonic_time () - spawn_start;
+  close (stdin_pipe[0]);
+  close (stdout_pipe[1]);
+  close (stderr_pipe[1]);
+
+  worker->pool = pool;
+  worker->wait_status = 0;
+  worker->stdin_fd = stdin_pipe[1];
+  worker->stdout_fd = stdout_pipe[0];
+  worker->stdout_buffer = line_buffer_new ('\n');
+  worker->stdout_source = g_source_fd_new (worker->stdout_fd, G_IO_IN,
+                                           handle_worker_stdout_readable,
+                                           worker);
+  worker->stderr_fd = stderr_pipe[0];
+  worker->stderr_buffer = line_buffer_new ('\n');
+  worker->stderr_source = g_source_fd_new (worker->stderr_fd, G_IO_IN,
+                                           handle_worker_stderr_readable,
+                                           worker);
+  worker->task = NULL;
+  worker->is_closing = FALSE;
+  pool->n_workers++;
+  child_watch_add (worker->pid, handle_worker_exited, worker);
+  return worker;
+}
+
+static void
+write_all (int fd, const char *data, size_t len)
+{
+  while (len > 0)
+    {
+      ssize_t write_rv = write (fd, data, len);
+      if (write_rv < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          /* the worker died: its child-watch will fail the task */
+          if (errno == EPIPE)
+            return;
+          g_error ("error writing to worker: %s", g_strerror (errno));
+        }
+      data += write_rv;
+      len -= write_rv;
+    }
+}
+
+void
+worker_pool_start_task (System *system,
+                        Task   *task)
+{
+  WorkerPool *pool = get_pool (system);
+  GString *script;
+  Worker *worker;
+  cpu_set_t cpus;
+  const char *at;
+
+  if (pool->idle_workers->len > 0)
+    worker = g_ptr_array_remove_index_fast (pool->idle_workers,
+                                            pool->idle_workers->len - 1);
+  else
+    worker = worker_new (pool);
+
+  worker->task = task;
+  worker->got_stdout_marker = FALSE;
+  worker->got_stderr_marker = FALSE;
+  worker->exit_status = 0;
+
+  task->info.running.worker = worker;
+  task->info.running.pid = worker->pid;
+  task->info.running.stdin_fd = -1;
+  task->info.running.stdin_source = NULL;
+  task->info.running.stdin_output_buffer = NULL;
+  task->info.running.stdout_fd = -1;
+  task->info.running.stdout_source = NULL;
+  task->info.running.stdout_reader = NULL;
+  task->info.running.stdout_input_buffer = NULL;
+  task->info.running.stderr_fd = -1;
+  task->info.running.stderr_source = NULL;
+  task->info.running.stderr_reader = NULL;
+  task->info.running.stderr_input_buffer = NULL;
+
+  /* the subshell inherits the shell's affinity when it forks */
+  if (slots_get_cpus (system, task->slot, &cpus))
+    sched_setaffinity (worker->pid, sizeof (cpus), &cpus);
+
+  /* single-quote the command-line for eval */
+  script = g_string_new (NULL);
+  g_string_printf (script, "( export PLINE_SLOT=%d; eval '", task->slot);
+  for (at = task->str; *at; at++)
+    if (*at == '\'')
+      g_string_append (script, "'\\''");
+    else
+      g_string_append_c (script, *at);
+  g_string_append_printf (script,
+                          "' ) </dev/null; "
+                          "printf '%%s%%03d\\n' %s $?; "
+                          "printf '%%s\\n' %s >&2\n",
+                          pool->token, pool->token);
+  write_all (worker->stdin_fd, script->str, script->len);
+  g_string_free (script, TRUE);
+}
+
+/* Called when all tasks are done:  let the workers exit.
+   If more tasks arrive later, new workers will be started. */
+void
+worker_pool_shutdown (System *system)
+{
+  WorkerPool *pool = system->worker_pool;
+  while (pool->idle_workers->len > 0)
+    {
+      Worker *worker = g_ptr_array_remove_index_fast (pool->idle_workers,
+                                                      pool->idle_workers->len - 1);
+      close_worker (worker);
+    }
+}